@@ -6,8 +6,11 @@
 #include <thread>
 #include <arpa/inet.h>
 #include <fstream>
+#include <google/protobuf/io/coded_stream.h>
 
 #include "batcher.h"
+#include "transport.h"
+#include "connectionManager.h"
 
 namespace
 {
@@ -19,6 +22,25 @@ namespace
     static thread_local std::uniform_int_distribution<int32_t> dist(
         std::numeric_limits<int32_t>::min(),
         std::numeric_limits<int32_t>::max());
+
+    // txn as the transaction field of a Request, which is all of a PARTIAL frame but its envelope
+    SharedEncodedTransaction encodeTransaction(const request::Transaction &txn, int32_t round)
+    {
+        auto encoded = std::make_shared<EncodedTransaction>();
+
+        uint8_t head[1 + 5]; // tag, then at most five bytes of varint length
+        head[0] = uint8_t(request::Request::kTransactionFieldNumber << 3 | 2); // length-delimited
+        uint8_t *end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(uint32_t(txn.ByteSizeLong()), head + 1);
+
+        encoded->body.assign(reinterpret_cast<char *>(head), end - head);
+        if (!txn.AppendToString(&encoded->body))
+            return nullptr;
+
+        encoded->id = txn.id();
+        encoded->operations = txn.operations_size();
+        encoded->batcher_round = round;
+        return encoded;
+    }
 }
 
 void Batcher::batchRequests()
@@ -56,8 +78,8 @@ void Batcher::batchRequests()
                 for (const auto &req : batch)
                 {
                     log_file << "round=" << current_window
-                             << " tx=" << req.transaction(0).id()
-                             << " ops=" << req.transaction(0).operations_size()
+                             << " tx=" << req->transaction(0).id()
+                             << " ops=" << req->transaction(0).operations_size()
                              << "\n";
                 }
             }
@@ -82,17 +104,18 @@ void Batcher::batchRequests()
 void Batcher::processBatch()
 {
 
-    std::vector<request::Request> batch_for_partial_sequencer;
+    std::vector<SharedRequest> batch_for_partial_sequencer;
     batch_for_partial_sequencer.reserve(batch.size());
+    RegionSet peers_with_work;
 
-    for (request::Request &req_proto : batch)
+    for (SharedRequest &req : batch)
     {
-        auto *txn = req_proto.mutable_transaction(0);
+        auto *txn = req->mutable_transaction(0);
 
         txn->set_random_stamp(dist(rng));
 
         // figure out which servers to send this transaction to
-        std::unordered_set<int32_t> target_peers;
+        RegionSet target_peers;
         bool validTransaction = true;
         for (const auto &op : txn->operations())
         {
@@ -105,7 +128,7 @@ void Batcher::processBatch()
             }
 
             const DataItem &data_item = it->second;
-            target_peers.insert(data_item.primaryCopyID);
+            target_peers.set(data_item.primaryCopyID);
         }
 
         if (!validTransaction)
@@ -115,27 +138,73 @@ void Batcher::processBatch()
             continue;
         }
 
-        for (auto target_id : target_peers)
+        // the other regions all get the same encoded bytes, whatever their number; with
+        // payload dedup every other server does, so that its merger has the body
+        RegionSet remote = target_peers;
+        if (PAYLOAD_DEDUP)
+        {
+            for (auto &entry : peer_senders)
+                remote.set(entry.first);
+        }
+        remote.reset(my_id);
+        if (remote.any())
         {
-            // clone the original request
-            request::Request req = req_proto;
-            req.set_recipient(request::Request::PARTIAL);
-            req.set_server_id(my_id);
-            req.set_target_server_id(target_id);
-            req.set_batcher_round(current_window);
-
-            if (target_id == my_id)
+            SharedEncodedTransaction encoded = encodeTransaction(*txn, int32_t(current_window));
+            if (!encoded)
             {
-                batch_for_partial_sequencer.push_back(req);
+                perror("SerializeToString failed");
+                continue;
             }
-            else
+
+            for (int32_t target_id = 0; target_id < MAX_CLUSTER_SIZE; ++target_id)
             {
-                outbound_queue.push(req);
+                if (!remote.test(target_id))
+                    continue;
+
+                auto it = peer_senders.find(target_id);
+                if (it == peer_senders.end())
+                {
+                    fprintf(stderr, "BATCHER: no peer %d for transaction %s\n", target_id, txn->id().c_str());
+                    continue;
+                }
+                it->second->queue.push({encoded, !target_peers.test(target_id)});
+                peers_with_work.set(target_id);
             }
         }
+
+        // this server's own partial sequencer takes the parsed request itself
+        if (target_peers.test(my_id))
+        {
+            req->set_recipient(request::Request::PARTIAL);
+            req->set_server_id(my_id);
+            req->set_target_server_id(my_id);
+            req->set_batcher_round(current_window);
+            batch_for_partial_sequencer.push_back(req);
+        }
+
+        // this server's merger gets the body straight from here
+        if (PAYLOAD_DEDUP)
+        {
+            {
+                std::lock_guard<std::mutex> lk(partial_sequencer_to_merger_queue_mtx);
+                partial_sequencer_to_merger_queue_.push({req, nullptr, true});
+            }
+            partial_sequencer_to_merger_queue_cv.notify_one();
+        }
     }
 
-    batch_cv.notify_all();
+    for (int32_t target_id = 0; target_id < MAX_CLUSTER_SIZE; ++target_id)
+    {
+        if (!peers_with_work.test(target_id))
+            continue;
+
+        // taking the lock orders the pushes before the sender's empty() check, so the wakeup is not lost
+        PeerSender &peer = *peer_senders.at(target_id);
+        {
+            std::lock_guard<std::mutex> lk(peer.mtx);
+        }
+        peer.cv.notify_one();
+    }
 
     if (!batch_for_partial_sequencer.empty()) // has to have at least one transaction because transactions are always sent to nodes that have the primary copy of one of the keys in
     {
@@ -145,9 +214,9 @@ void Batcher::processBatch()
         {
             for (const auto &req : batch_for_partial_sequencer)
             {
-                log_file << "round=" << req.batcher_round()
-                         << " tx=" << req.transaction(0).id()
-                         << " ops=" << req.transaction(0).operations_size()
+                log_file << "round=" << req->batcher_round()
+                         << " tx=" << req->transaction(0).id()
+                         << " ops=" << req->transaction(0).operations_size()
                          << "\n";
             }
         }
@@ -160,65 +229,83 @@ void Batcher::processBatch()
     }
 }
 
-void Batcher::sendTransaction(request::Request &req_proto) // send batch actually
+void Batcher::queueTransaction(PeerSender &peer, const QueuedTransaction &queued) // send batch actually
 {
-    int target_id = req_proto.target_server_id();
-    int &connfd = partial_sequencer_fds[target_id];
+    int target_id = peer.target.id;
+    const EncodedTransaction &txn = *queued.txn;
 
-    // (re)connect on-demand if we lost it
-    if (connfd < 0)
+    // the only part of the frame that is this peer's own, the same for a whole round
+    if (peer.envelope_round != txn.batcher_round)
     {
-        server target = target_peers[target_id];
-
-        while ((connfd = setupConnection(target.ip, target.port)) < 0)
+        request::Request envelope;
+        envelope.set_recipient(request::Request::PARTIAL);
+        envelope.set_server_id(my_id);
+        envelope.set_target_server_id(target_id);
+        envelope.set_batcher_round(txn.batcher_round);
+        bool ok = envelope.SerializeToString(&peer.envelope);
+
+        envelope.set_target_server_id(PAYLOAD_ONLY);
+        if (!ok || !envelope.SerializeToString(&peer.payload_envelope))
         {
-            std::cerr << "Batcher " << my_id << ": reconnect to peer " << target_id << " failed, retrying in 1s…\n";
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            perror("SerializeToString failed");
+            return;
         }
-
-        partial_sequencer_fds[target_id] = connfd; // update the fd in the map
+        peer.envelope_round = txn.batcher_round;
     }
 
-    req_proto.set_recipient(request::Request::PARTIAL);
-    req_proto.set_server_id(my_id);
-
-    // Log the transaction details
-    std::ofstream log_file("./batcher_logs/sent_batches_" + std::to_string(my_id) + ".log", std::ios::app);
-    if (log_file)
+    // Log the transaction details (a body only sent for the peer's merger is not a batch for it)
+    if (!queued.payload_only)
     {
-        for (const auto &txn : req_proto.transaction())
+        std::lock_guard<std::mutex> lk(sent_log_mtx);
+        std::ofstream log_file("./batcher_logs/sent_batches_" + std::to_string(my_id) + ".log", std::ios::app);
+        if (log_file)
         {
             log_file << "to=" << target_id
-                     << " round=" << req_proto.batcher_round()
-                     << " tx=" << txn.id()
-                     << " ops=" << txn.operations_size()
+                     << " round=" << txn.batcher_round
+                     << " tx=" << txn.id
+                     << " ops=" << txn.operations
                      << "\n";
         }
+        else
+        {
+            std::cerr << "Failed to open log file for batcher " << my_id << "\n";
+        }
     }
-    else
+
+    peer.link.push(queued.payload_only ? peer.payload_envelope : peer.envelope, txn.body);
+
+    if (peer.link.full())
     {
-        std::cerr << "Failed to open log file for batcher " << my_id << "\n";
+        flushPeer(peer);
     }
+}
+
+void Batcher::flushPeer(PeerSender &peer)
+{
+    ConnectionManager *connections = getConnectionManager();
 
-    std::string serialized_request;
-    if (!req_proto.SerializeToString(&serialized_request))
+    // only this peer's thread waits for its connection
+    ConnectionManager::Lease lease;
+    while (!(lease = connections->waitFor(peer.target.id, ConnectionManager::Clock::now() + std::chrono::seconds(1))))
     {
-        perror("SerializeToString failed");
-        close(connfd);
-        return;
+        std::cerr << "Batcher " << my_id << ": peer " << peer.target.id << " not connected ("
+                  << peer.queue.size() << " requests waiting)\n";
     }
 
-    uint32_t netlen = htonl(uint32_t(serialized_request.size()));
-    if (!writeNBytes(connfd, &netlen, sizeof(netlen)) ||
-        !writeNBytes(connfd, serialized_request.data(), serialized_request.size()))
+    if (!peer.link.flush(lease.fd()))
     {
-        perror("writeNBytes failed");
-        // connection broken, force reconnect
-        close(connfd);
-        connfd = -1;
+        perror("sendFrames failed");
+        // connection broken, the manager reconnects
+        lease.broken();
     }
 }
 
+Batcher::PeerSender::PeerSender(Batcher *batcher, const server &target)
+    : batcher(batcher), target(target),
+      link(COALESCE_BYTES, std::chrono::microseconds(COALESCE_DELAY_US))
+{
+}
+
 // Constructor
 Batcher::Batcher()
 {
@@ -227,15 +314,29 @@ Batcher::Batcher()
     std::ofstream init_sent_log("./batcher_logs/local_pushed_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
     std::ofstream init_recv_log("./batcher_logs/sent_batches_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
 
-    if (pthread_create(&sender_thread, NULL, [](void *arg) -> void *
-                       {
-            static_cast<Batcher*>(arg)->Batcher::sendTransactions();
-            return nullptr; }, this) != 0)
+    // the peer map is read by the batcher thread, so it is filled in first
+    for (auto &server : servers)
     {
-        threadError("Error creating sender thread");
+        if (server.id != my_id)
+        {
+            peer_senders[server.id] = std::make_unique<PeerSender>(this, server);
+        }
     }
 
-    pthread_detach(sender_thread);
+    for (auto &entry : peer_senders)
+    {
+        PeerSender *peer = entry.second.get();
+        if (pthread_create(&peer->thread, NULL, [](void *arg) -> void *
+                           {
+                auto *p = static_cast<PeerSender*>(arg);
+                p->batcher->sendTransactions(*p);
+                return nullptr; }, peer) != 0)
+        {
+            threadError("Error creating sender thread");
+        }
+
+        pthread_detach(peer->thread);
+    }
 
     if (pthread_create(&batcher_thread, NULL, [](void *arg) -> void *
                        {
@@ -247,29 +348,39 @@ Batcher::Batcher()
 
     pthread_detach(batcher_thread);
 
-    for (auto &server : servers)
-    {
-        if (server.id != my_id)
-        {
-            target_peers[server.id] = server;
-            partial_sequencer_fds[server.id] = -1;
-        }
-    }
-
-    printf("Batcher initialized with %zu target peers\n", target_peers.size());
+    printf("Batcher initialized with %zu target peers\n", peer_senders.size());
 }
 
-void Batcher::sendTransactions()
+void Batcher::sendTransactions(PeerSender &peer)
 {
 
     while (true)
     {
-        std::unique_lock<std::mutex> lk(batch_mutex);
-        batch_cv.wait(lk, [&]
-                      { return !outbound_queue.empty(); });
-        auto req = outbound_queue.pop(); // thread-safe pop
+        // sleep until there is more to send or a queued frame runs out of its latency budget
+        std::unique_lock<std::mutex> lk(peer.mtx);
+        auto ready = [&]
+        { return !peer.queue.empty(); };
+        if (peer.link.empty())
+            peer.cv.wait(lk, ready);
+        else
+            peer.cv.wait_until(lk, peer.link.deadline(), ready);
+        auto reqs = peer.queue.popAll(); // thread-safe pop
         lk.unlock();
 
-        sendTransaction(req);
+        for (auto &queued : reqs)
+        {
+            queueTransaction(peer, queued);
+        }
+
+        if (peer.link.due(FrameCoalescer::Clock::now()))
+        {
+            flushPeer(peer);
+        }
     }
 }
+
+size_t Batcher::outboundDepth(int target_id)
+{
+    auto it = peer_senders.find(target_id);
+    return it == peer_senders.end() ? 0 : it->second->queue.size();
+}
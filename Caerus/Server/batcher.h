@@ -11,10 +11,12 @@
 #include <condition_variable>
 #include <random>
 #include <limits>
+#include <memory>
 
 #include "utils.h"
 #include "transaction.h"
 #include "queueTS.h"
+#include "frameCoalescer.h"
 #include "../proto/request.pb.h"
 
 class Batcher
@@ -22,16 +24,33 @@ class Batcher
 private:
 
     int64_t current_window;
-    std::vector<request::Request> batch;
+    std::vector<SharedRequest> batch;
     pthread_t batcher_thread;
 
-    pthread_t sender_thread;
-    Queue_TS <request::Request> outbound_queue;
-    std::mutex batch_mutex;
-    std::condition_variable batch_cv;
+    // One per peer, with its own queue, connection and sender thread: a peer that
+    // is down or slow only holds up what is bound for it.
+    struct PeerSender
+    {
+        Batcher *batcher;
+        server target;
+        Queue_TS<QueuedTransaction> queue;
+        std::mutex mtx;
+        std::condition_variable cv;
+        FrameCoalescer link; // frames taken off the queue, not written yet
+        std::string envelope;         // routing part of every frame to this peer, for envelope_round
+        std::string payload_envelope; // the same for payload-only frames
+        int32_t envelope_round = -1;
+        pthread_t thread;
 
-    std::unordered_map<int, server> target_peers;
-    std::unordered_map<int,int> partial_sequencer_fds; // id to fd mapping for partial sequencer connections
+        PeerSender(Batcher *batcher, const server &target);
+    };
+
+    std::unordered_map<int, std::unique_ptr<PeerSender>> peer_senders;
+    std::mutex sent_log_mtx; // the sender threads share the sent_batches log
+
+    void queueTransaction(PeerSender &peer, const QueuedTransaction &queued);
+    void flushPeer(PeerSender &peer);
+    void sendTransactions(PeerSender &peer);
 
     int32_t next_round_{0};
 
@@ -40,8 +59,9 @@ public:
     Batcher();
     void batchRequests();
     void processBatch();
-    void sendTransaction(request::Request& txn);
-    void sendTransactions();
+
+    // requests waiting to be sent to target_id
+    size_t outboundDepth(int target_id);
 
 };
 
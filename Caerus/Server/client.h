@@ -6,30 +6,24 @@
 #include "batcher.h"
 #include "logger.h"
 #include "merger.h"
+#include "transport.h"
 
-struct ClientListenerThreadsArgs
+struct ClientListenerArgs
 {
     int listenfd;
     Merger* merger; 
 };
 
-struct ClientArgs {
-    int connfd;
-    struct sockaddr_in client_addr;
-    Merger* merger; 
-};
-
-// Function prototypes
-void* clientListener(void *args);
-void* handleClient(void *client_args);
+// Handles one frame received on a client connection; returns false to drop the connection.
+bool handleClientFrame(Connection &conn, const char *data, uint32_t msglen, Merger* merger);
 
 class ClientListener
 {
 private:
-    ClientListenerThreadsArgs args;
+    ClientListenerArgs args;
 public:
 
-    ClientListener(int listenfd, Merger* merger);
+    ClientListener(int listenfd, Merger* merger, Transport* transport);
 
 };
 
@@ -0,0 +1,672 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <random>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "connectionManager.h"
+
+namespace
+{
+    constexpr std::chrono::milliseconds INITIAL_BACKOFF{50};
+    constexpr std::chrono::milliseconds MAX_BACKOFF{5000};
+    constexpr std::chrono::milliseconds CONNECT_TIMEOUT{2000};
+    constexpr std::chrono::milliseconds HEARTBEAT_INTERVAL{500}; // idle time before a PING goes out
+    constexpr std::chrono::milliseconds DEAD_AFTER{3000};        // silence before a connection is given up
+
+    std::atomic<ConnectionManager *> current_manager{nullptr};
+
+    std::string ringName(int32_t from, int32_t to, int32_t nonce)
+    {
+        return "/caerus-ring-" + std::to_string(from) + "-" + std::to_string(to) + "-" + std::to_string(nonce);
+    }
+
+    struct ConsumerArgs
+    {
+        ConnectionManager *manager;
+        std::shared_ptr<ShmRing> ring;
+        Connection conn;
+        FrameHandler handler;
+    };
+}
+
+ConnectionManager::ConnectionManager(const std::vector<server> &servers, int32_t self_id)
+    : self_id(self_id)
+{
+    for (const server &s : servers)
+    {
+        if (s.id == self_id)
+            continue;
+
+        Peer &peer = peers[s.id];
+        peer.info = s;
+        peer.dialer = self_id < s.id;
+        peer.local = LOCAL_SOCKETS && isColocated(s);
+        peer.backoff = INITIAL_BACKOFF;
+        if (peer.dialer)
+            resolve(peer);
+    }
+
+    flat = WIRE_FORMAT == "flat";
+    if (!flat && WIRE_FORMAT != "protobuf")
+    {
+        fprintf(stderr, "ConnectionManager: unknown wire format %s, using protobuf\n", WIRE_FORMAT.c_str());
+    }
+
+    request::Request ping_msg;
+    ping_msg.set_recipient(request::Request::PING);
+    ping_msg.set_server_id(self_id);
+    if (flat)
+        ping_msg.set_client_id(READS_FLAT);
+    if (!ping_msg.SerializeToString(&ping))
+    {
+        error("ConnectionManager: SerializeToString failed");
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0)
+    {
+        error("ConnectionManager: eventfd failed");
+    }
+
+    if (pthread_create(&thread, NULL, [](void *arg) -> void *
+                       {
+            static_cast<ConnectionManager*>(arg)->run();
+            return nullptr; }, this) != 0)
+    {
+        threadError("ConnectionManager: error creating thread");
+    }
+
+    pthread_detach(thread);
+}
+
+bool ConnectionManager::resolve(Peer &peer)
+{
+    if (peer.local)
+    {
+        std::string path = localSocketPath(peer.info.id);
+        sockaddr_un &addr = reinterpret_cast<sockaddr_un &>(peer.addr);
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "ConnectionManager: socket path too long: %s\n", path.c_str());
+            return false;
+        }
+
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        peer.addrlen = sizeof(sockaddr_un);
+        peer.resolved = true;
+        return true;
+    }
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port[6];
+    snprintf(port, sizeof(port), "%d", peer.info.port);
+
+    int err = getaddrinfo(peer.info.ip.c_str(), port, &hints, &res);
+    if (err != 0 || !res)
+    {
+        fprintf(stderr, "ConnectionManager: cannot resolve %s: %s\n", peer.info.ip.c_str(), gai_strerror(err));
+        return false;
+    }
+
+    memcpy(&peer.addr, res->ai_addr, res->ai_addrlen);
+    peer.addrlen = res->ai_addrlen;
+    peer.resolved = true;
+    freeaddrinfo(res);
+    return true;
+}
+
+void ConnectionManager::wake()
+{
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("ConnectionManager: wake failed");
+    }
+}
+
+ConnectionManager::Peer *ConnectionManager::find(int peer_id)
+{
+    auto it = peers.find(peer_id);
+    return it == peers.end() ? nullptr : &it->second;
+}
+
+void ConnectionManager::serve(Transport *t, FrameHandler h)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+
+    transport = t;
+    handler = std::move(h);
+
+    auto now = Clock::now();
+    for (auto &entry : peers)
+    {
+        Peer &peer = entry.second;
+        if (peer.dialer && peer.state == State::IDLE)
+        {
+            peer.state = State::BACKOFF;
+            peer.retry_at = now;
+        }
+    }
+    wake();
+}
+
+ConnectionManager::Lease ConnectionManager::acquire(int peer_id)
+{
+    Peer *peer = find(peer_id);
+    if (!peer)
+        return Lease();
+
+    return grant(*peer, std::unique_lock<std::mutex>(peer->send_mtx));
+}
+
+ConnectionManager::Lease ConnectionManager::tryAcquire(int peer_id)
+{
+    Peer *peer = find(peer_id);
+    if (!peer)
+        return Lease();
+
+    std::unique_lock<std::mutex> send(peer->send_mtx, std::try_to_lock);
+    if (!send.owns_lock())
+        return Lease();
+
+    return grant(*peer, std::move(send));
+}
+
+ConnectionManager::Lease ConnectionManager::grant(Peer &peer, std::unique_lock<std::mutex> send)
+{
+    Lease lease;
+    lease.lock = std::move(send);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (peer.state != State::READY)
+        return Lease();
+
+    lease.manager = this;
+    lease.peer = &peer;
+    lease.connfd = peer.fd;
+    return lease;
+}
+
+ConnectionManager::Lease ConnectionManager::waitFor(int peer_id, Clock::time_point deadline)
+{
+    Peer *peer = find(peer_id);
+    if (!peer)
+        return Lease();
+
+    while (true)
+    {
+        Lease lease = acquire(peer_id);
+        if (lease)
+            return lease;
+
+        std::unique_lock<std::mutex> lk(mtx);
+        auto up = [&]
+        { return peer->state == State::READY; };
+
+        if (deadline == Clock::time_point::max())
+            ready_cv.wait(lk, up);
+        else if (!ready_cv.wait_until(lk, deadline, up))
+            return Lease();
+    }
+}
+
+ConnectionManager::Lease::~Lease()
+{
+    // a lease that was handed out counts as traffic, it holds the heartbeat off
+    if (connfd >= 0 && lock.owns_lock())
+        peer->last_sent.store(Clock::now().time_since_epoch().count());
+}
+
+void ConnectionManager::Lease::broken()
+{
+    if (connfd < 0)
+        return;
+
+    std::lock_guard<std::mutex> lk(manager->mtx);
+    if (peer->state == State::READY && peer->fd == connfd)
+        manager->lost(*peer);
+    connfd = -1;
+}
+
+bool ConnectionManager::isUp(int peer_id)
+{
+    Peer *peer = find(peer_id);
+    if (!peer)
+        return false;
+
+    std::lock_guard<std::mutex> lk(mtx);
+    return peer->state == State::READY;
+}
+
+bool ConnectionManager::hello(Connection &conn, int32_t peer_id)
+{
+    Peer *peer = find(peer_id);
+    if (!peer || peer->dialer)
+    {
+        fprintf(stderr, "ConnectionManager: unexpected hello from server %d at %s:%d\n",
+                peer_id, conn.ip.c_str(), conn.port);
+        return false;
+    }
+
+    conn.peer = peer_id;
+
+    {
+        // the peer reconnected: wake a writer still blocked on the old connection
+        std::lock_guard<std::mutex> lk(mtx);
+        if (peer->state == State::READY)
+            shutdown(peer->fd, SHUT_RDWR);
+    }
+
+    std::lock_guard<std::mutex> send(peer->send_mtx);
+    std::lock_guard<std::mutex> lk(mtx);
+
+    if (peer->state == State::READY)
+        lost(*peer);
+
+    auto now = Clock::now().time_since_epoch().count();
+    peer->fd = conn.fd;
+    peer->state = State::READY;
+    peer->reads_flat.store(false);
+    peer->last_heard.store(now);
+    peer->last_sent.store(now);
+    printf("ConnectionManager: peer %d connected from %s:%d\n", peer_id, conn.ip.c_str(), conn.port);
+
+    // the dialer hears what this side reads at once rather than with the first heartbeat
+    if (flat && !sendFrame(conn.fd, ping))
+        perror("ConnectionManager: PING failed");
+    offerRing(*peer);
+
+    ready_cv.notify_all();
+    wake(); // for the heartbeats
+    return true;
+}
+
+void ConnectionManager::formats(Connection &conn, int32_t formats)
+{
+    Peer *peer = conn.peer < 0 ? nullptr : find(conn.peer);
+    if (!peer)
+        return;
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (peer->state == State::READY && peer->fd == conn.fd)
+        peer->reads_flat.store(flat && (formats & READS_FLAT));
+}
+
+void ConnectionManager::heard(int32_t peer_id)
+{
+    if (Peer *peer = find(peer_id))
+        peer->last_heard.store(Clock::now().time_since_epoch().count());
+}
+
+void ConnectionManager::closed(Connection &conn)
+{
+    Peer *peer = conn.peer < 0 ? nullptr : find(conn.peer);
+    if (!peer)
+        return;
+
+    // the socket is still open until this returns; fail any write blocked on it, then
+    // wait for its writer, so nobody uses the number once it is closed and reused
+    shutdown(conn.fd, SHUT_RDWR);
+    if (std::shared_ptr<ShmRing> ring = ringFor(conn.fd))
+        ring->close();
+
+    std::lock_guard<std::mutex> send(peer->send_mtx);
+    std::lock_guard<std::mutex> lk(mtx);
+
+    if (peer->state == State::READY && peer->fd == conn.fd)
+        lost(*peer);
+    detachRing(conn.fd);
+}
+
+void ConnectionManager::lost(Peer &peer)
+{
+    fprintf(stderr, "ConnectionManager: connection to peer %d (%s:%d) lost\n",
+            peer.info.id, peer.info.ip.c_str(), peer.info.port);
+
+    // the transport owns the socket: shutting it down ends its reads, and it closes it
+    shutdown(peer.fd, SHUT_RDWR);
+    if (std::shared_ptr<ShmRing> ring = ringFor(peer.fd))
+        ring->close();
+    if (peer.inbound)
+    {
+        peer.inbound->close();
+        peer.inbound.reset();
+    }
+    peer.fd = -1;
+
+    if (peer.dialer)
+    {
+        // it was working a moment ago: try again at once, backing off from there
+        peer.state = State::BACKOFF;
+        peer.retry_at = Clock::now();
+        peer.backoff = INITIAL_BACKOFF;
+        wake();
+    }
+    else
+    {
+        peer.state = State::IDLE;
+    }
+}
+
+void ConnectionManager::offerRing(Peer &peer)
+{
+    if (!SHM_RINGS || !peer.local)
+        return;
+
+    static std::random_device rd;
+    int32_t nonce = int32_t(rd() & 0x7fffffff);
+
+    std::shared_ptr<ShmRing> ring = ShmRing::create(ringName(self_id, peer.info.id, nonce), SHM_RING_BYTES);
+    if (!ring)
+        return; // frames keep going over the socket
+
+    request::Request offer;
+    offer.set_recipient(request::Request::PING);
+    offer.set_server_id(self_id);
+    offer.set_round(nonce);
+
+    // the last frame on the socket itself; everything after it goes into the ring
+    std::string serialized;
+    if (!offer.SerializeToString(&serialized) || !sendFrame(peer.fd, serialized))
+    {
+        ring->close();
+        return;
+    }
+
+    attachRing(peer.fd, ring);
+    printf("ConnectionManager: frames to peer %d go through %s\n", peer.info.id, ring->name().c_str());
+}
+
+bool ConnectionManager::ringOffered(Connection &conn, int32_t nonce)
+{
+    Peer *peer = conn.peer < 0 ? nullptr : find(conn.peer);
+    if (!peer)
+        return false;
+
+    // its frames from now on are only in the ring
+    std::shared_ptr<ShmRing> ring = ShmRing::open(ringName(peer->info.id, self_id, nonce));
+    if (!ring)
+        return false;
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (peer->state != State::READY || peer->fd != conn.fd)
+    {
+        ring->close();
+        return true;
+    }
+
+    if (peer->inbound)
+        peer->inbound->close();
+    peer->inbound = ring;
+    peer->inbound_fd = conn.fd;
+
+    // the ring gets a reader of its own, handing frames to the peer listener's handler
+    pthread_t consumer;
+    auto *args = new ConsumerArgs{this, ring, conn, handler};
+    if (pthread_create(&consumer, NULL, [](void *arg) -> void *
+                       {
+            std::unique_ptr<ConsumerArgs> a(static_cast<ConsumerArgs*>(arg));
+            if (!a->ring->consume(a->handler, a->conn))
+                a->manager->ringFailed(a->conn);
+            return nullptr; }, args) != 0)
+    {
+        perror("ConnectionManager: error creating ring reader");
+        delete args;
+        ring->close();
+        peer->inbound.reset();
+        return false;
+    }
+    pthread_detach(consumer);
+
+    printf("ConnectionManager: frames from peer %d come through %s\n", peer->info.id, ring->name().c_str());
+    return true;
+}
+
+void ConnectionManager::ringFailed(Connection &conn)
+{
+    Peer *peer = find(conn.peer);
+
+    // the handler refused a frame, as when it drops a socket
+    std::lock_guard<std::mutex> lk(mtx);
+    if (peer && peer->state == State::READY && peer->fd == conn.fd)
+        lost(*peer);
+}
+
+void ConnectionManager::startConnect(Peer &peer, Clock::time_point now)
+{
+    if (!peer.resolved && !resolve(peer))
+    {
+        fail(peer, "address not resolved", now);
+        return;
+    }
+
+    int fd = socket(peer.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        fail(peer, strerror(errno), now);
+        return;
+    }
+
+    peer.fd = fd;
+    peer.started = now;
+
+    // a unix socket connects at once or fails, EAGAIN included (the listener's backlog is full)
+    if (connect(fd, (sockaddr *)&peer.addr, peer.addrlen) < 0 && errno != EINPROGRESS)
+    {
+        fail(peer, strerror(errno), now);
+        return;
+    }
+
+    // in progress, or already done on loopback: the socket turns writable either way
+    peer.state = State::CONNECTING;
+}
+
+void ConnectionManager::established(Peer &peer, Clock::time_point now)
+{
+    // the hello goes out before the transport or any writer has the socket
+    if (!sendFrame(peer.fd, ping))
+    {
+        fail(peer, strerror(errno), now);
+        return;
+    }
+
+    transport->addConnection(Connection{peer.fd, peer.info.ip, peer.info.port, peer.info.id}, handler,
+                             [this](Connection &conn)
+                             { closed(conn); });
+
+    peer.state = State::READY;
+    peer.reads_flat.store(false);
+    peer.backoff = INITIAL_BACKOFF;
+    peer.last_heard.store(now.time_since_epoch().count());
+    peer.last_sent.store(now.time_since_epoch().count());
+    printf("ConnectionManager: connected to peer %d (%s:%d) over %s\n", peer.info.id, peer.info.ip.c_str(),
+           peer.info.port, peer.local ? "a unix socket" : "TCP");
+    offerRing(peer);
+}
+
+void ConnectionManager::fail(Peer &peer, const char *why, Clock::time_point now)
+{
+    if (peer.fd >= 0)
+    {
+        close(peer.fd);
+        peer.fd = -1;
+    }
+
+    fprintf(stderr, "ConnectionManager: connection to peer %d (%s:%d) failed: %s, retrying in %lld ms\n",
+            peer.info.id, peer.info.ip.c_str(), peer.info.port, why,
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(peer.backoff).count());
+
+    peer.state = State::BACKOFF;
+    peer.retry_at = now + peer.backoff;
+    peer.backoff = std::min<Clock::duration>(peer.backoff * 2, MAX_BACKOFF);
+}
+
+void ConnectionManager::heartbeat(Clock::time_point now)
+{
+    for (auto &entry : peers)
+    {
+        Peer &peer = entry.second;
+
+        // a writer holding the connection is sending anyway
+        std::unique_lock<std::mutex> send(peer.send_mtx, std::try_to_lock);
+
+        int fd;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (peer.state != State::READY)
+                continue;
+
+            Clock::time_point heard{Clock::duration(peer.last_heard.load())};
+            if (now - heard > DEAD_AFTER)
+            {
+                fprintf(stderr, "ConnectionManager: nothing from peer %d for %lld ms\n", peer.info.id,
+                        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - heard).count());
+                lost(peer);
+                continue;
+            }
+
+            Clock::time_point sent{Clock::duration(peer.last_sent.load())};
+            if (!send.owns_lock() || now - sent < HEARTBEAT_INTERVAL)
+                continue;
+            fd = peer.fd;
+        }
+
+        if (!sendFrame(fd, ping))
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (peer.state == State::READY && peer.fd == fd)
+                lost(peer);
+            continue;
+        }
+        peer.last_sent.store(now.time_since_epoch().count());
+    }
+}
+
+void ConnectionManager::run()
+{
+    std::vector<pollfd> pfds;
+    std::vector<Peer *> owners; // who each pfds entry past the first belongs to
+
+    while (true)
+    {
+        int timeout_ms = -1;
+
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto now = Clock::now();
+
+            pfds.assign(1, pollfd{wake_fd, POLLIN, 0});
+            owners.clear();
+
+            for (auto &entry : peers)
+            {
+                Peer &peer = entry.second;
+
+                if (peer.state == State::BACKOFF && peer.retry_at <= now)
+                    startConnect(peer, now);
+
+                if (peer.state == State::CONNECTING && now - peer.started >= CONNECT_TIMEOUT)
+                    fail(peer, "timed out", now);
+
+                Clock::time_point due;
+                if (peer.state == State::CONNECTING)
+                {
+                    pfds.push_back(pollfd{peer.fd, POLLOUT, 0});
+                    owners.push_back(&peer);
+                    due = peer.started + CONNECT_TIMEOUT;
+                }
+                else if (peer.state == State::BACKOFF)
+                {
+                    due = peer.retry_at;
+                }
+                else if (peer.state == State::READY)
+                {
+                    // checked twice per heartbeat interval
+                    due = now + HEARTBEAT_INTERVAL / 2;
+                }
+                else
+                {
+                    continue;
+                }
+
+                long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+                ms = std::max(ms, 0LL);
+                if (timeout_ms < 0 || ms < timeout_ms)
+                    timeout_ms = int(ms);
+            }
+        }
+
+        int n = poll(pfds.data(), pfds.size(), timeout_ms);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            threadError("ConnectionManager: poll failed");
+        }
+
+        if (pfds[0].revents)
+        {
+            uint64_t value;
+            while (read(wake_fd, &value, sizeof(value)) > 0)
+            {
+            }
+        }
+
+        bool connected = false;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto now = Clock::now();
+
+            for (size_t i = 1; i < pfds.size(); ++i)
+            {
+                if (!pfds[i].revents)
+                    continue;
+
+                Peer &peer = *owners[i - 1];
+
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                    err = errno;
+                if (err != 0)
+                {
+                    fail(peer, strerror(err), now);
+                    continue;
+                }
+
+                established(peer, now);
+                connected |= peer.state == State::READY;
+            }
+        }
+
+        if (connected)
+        {
+            ready_cv.notify_all();
+        }
+
+        heartbeat(Clock::now());
+    }
+}
+
+void setConnectionManager(ConnectionManager *manager)
+{
+    current_manager.store(manager);
+}
+
+ConnectionManager *getConnectionManager()
+{
+    return current_manager.load();
+}
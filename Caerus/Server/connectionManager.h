@@ -0,0 +1,179 @@
+#ifndef CONNECTION_MANAGER_H
+#define CONNECTION_MANAGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "transport.h"
+#include "shmRing.h"
+
+// Owns the one connection this server keeps to each other server. Every kind of
+// peer traffic (partial transactions, partial sequences, READY/START, pings)
+// shares it, in both directions: the server with the lower id connects (over
+// the peer's unix socket when it runs on the same machine), the
+// other one takes the connection over when its hello (a PING carrying the
+// sender's id) arrives on the peer listener, and the transport serves both ends
+// like any accepted connection.
+//
+// Connects run non-blocking on the manager's own thread, with exponential
+// backoff between failed attempts, so no caller ever sits in connect() or a
+// retry sleep. Every frame received from a peer counts as a heartbeat; a
+// connection nothing has been sent on for a while gets a PING, and one nothing
+// has been heard on for longer than that is shut down and set up again.
+//
+// With shared-memory rings on, two co-located peers each offer the other a
+// ShmRing once the unix socket is up (a PING carrying a nonce that names it),
+// and from then on send their frames through it; the socket only tells either
+// side when the other one is gone.
+//
+// Every PING also says which wire formats its sender reads besides protobuf (in
+// its client_id, a set of bits). A server with "wire_format": "flat" sends flat
+// partial sequences to a peer once it has heard that the peer reads them; both
+// sides start out with protobuf on every new connection.
+//
+// Writers take a Lease on the connection, so frames from different threads
+// never interleave on the socket (or in the ring: it has one producer).
+class ConnectionManager
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    enum class State
+    {
+        IDLE,       // not serving yet, or waiting for the peer to connect
+        CONNECTING, // connect() in progress
+        READY,
+        BACKOFF // waiting for retry_at
+    };
+
+    struct Peer
+    {
+        server info;
+        bool dialer;      // this side connects
+        bool local;       // over the peer's unix socket
+        bool resolved = false;
+        sockaddr_storage addr{};
+        socklen_t addrlen = 0;
+
+        // guarded by mtx
+        State state = State::IDLE;
+        int fd = -1;
+        Clock::time_point started;  // when the current connect began
+        Clock::time_point retry_at; // when to try again while backing off
+        Clock::duration backoff;    // wait after the next failure
+
+        std::shared_ptr<ShmRing> inbound; // the peer's frames to us, guarded by mtx
+        int inbound_fd = -1;              // the connection it came with
+
+        std::atomic<bool> reads_flat{false}; // on the current connection
+
+        std::mutex send_mtx; // held by a Lease, taken before mtx
+        std::atomic<Clock::rep> last_heard{0};
+        std::atomic<Clock::rep> last_sent{0};
+    };
+
+    std::mutex mtx;
+    std::condition_variable ready_cv;
+    std::unordered_map<int, Peer> peers; // fixed after construction
+    int32_t self_id;
+    bool flat;        // this server reads and sends flat frames
+    std::string ping; // serialized PING from this server: the hello and the heartbeat
+    int wake_fd;
+    pthread_t thread;
+
+    Transport *transport = nullptr;
+    FrameHandler handler; // for the connections this side opens, and the rings
+
+    void run();
+    void wake();
+    bool resolve(Peer &peer);
+    void startConnect(Peer &peer, Clock::time_point now);
+    void established(Peer &peer, Clock::time_point now);
+    void fail(Peer &peer, const char *why, Clock::time_point now);
+    void lost(Peer &peer); // with mtx held: the connection is gone, set up the next one
+    void heartbeat(Clock::time_point now);
+    void offerRing(Peer &peer); // with mtx held, before anyone else writes on the connection
+    void ringFailed(Connection &conn);
+    Peer *find(int peer_id);
+
+public:
+    // wire formats in a PING's client_id
+    static constexpr int32_t READS_FLAT = 1;
+
+    // Exclusive use of the connection to one peer while held; empty if it is not up.
+    class Lease
+    {
+    private:
+        friend class ConnectionManager;
+
+        ConnectionManager *manager = nullptr;
+        Peer *peer = nullptr;
+        int connfd = -1;
+        std::unique_lock<std::mutex> lock;
+
+    public:
+        Lease() = default;
+        Lease(Lease &&) = default;
+        Lease &operator=(Lease &&) = default;
+        ~Lease();
+
+        int fd() const { return connfd; }
+        bool readsFlat() const { return connfd >= 0 && peer->reads_flat.load(); }
+        explicit operator bool() const { return connfd >= 0; }
+
+        // Reports that a write failed: the connection is shut down and set up again.
+        void broken();
+    };
+
+private:
+    Lease grant(Peer &peer, std::unique_lock<std::mutex> send); // with send held: a lease if the peer is up
+
+public:
+    // Knows every server in peers but itself.
+    ConnectionManager(const std::vector<server> &servers, int32_t self_id);
+    ConnectionManager(const ConnectionManager &) = delete;
+    ConnectionManager &operator=(const ConnectionManager &) = delete;
+
+    // Starts connecting; the connections this side opens are served by transport
+    // with handler, the one the peer listener uses.
+    void serve(Transport *transport, FrameHandler handler);
+
+    // The connection to peer_id if it is up, otherwise an empty lease. Never waits
+    // for a connect, only for another writer to finish.
+    Lease acquire(int peer_id);
+
+    // Like acquire, but an empty lease while another writer has the connection,
+    // for the round-driven threads, which keep their frames for later instead.
+    Lease tryAcquire(int peer_id);
+
+    // Waits until the connection to peer_id is up or deadline passes (empty lease then).
+    Lease waitFor(int peer_id, Clock::time_point deadline = Clock::time_point::max());
+
+    bool isUp(int peer_id);
+
+    // Called by the peer listener's handler for every frame and when the connection
+    // ends. A hello on an accepted connection makes it the one to conn.peer, and a
+    // ring offer starts reading the peer's frames from its ring; both return false
+    // if they cannot be taken up (the connection is dropped then). Every PING's
+    // client_id goes to formats.
+    bool hello(Connection &conn, int32_t peer_id);
+    void formats(Connection &conn, int32_t formats);
+    bool ringOffered(Connection &conn, int32_t nonce);
+    void heard(int32_t peer_id);
+    void closed(Connection &conn);
+};
+
+// The connection manager everything reaches the other servers through; set once at startup.
+void setConnectionManager(ConnectionManager *manager);
+ConnectionManager *getConnectionManager();
+
+#endif // CONNECTION_MANAGER_H
@@ -0,0 +1,176 @@
+#include <algorithm>
+
+#include "flatRequest.h"
+#include "utils.h"
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "flat frames are read in place, as little-endian");
+
+namespace
+{
+    template <typename T>
+    void store(std::string &out, size_t off, T v)
+    {
+        memcpy(&out[off], &v, sizeof(v));
+    }
+}
+
+std::shared_ptr<FlatRequest> FlatRequest::copy(const char *data, uint32_t len)
+{
+    auto req = std::make_shared<FlatRequest>(nullptr, 0);
+    req->owned.assign(data, len);
+    req->data = req->owned.data();
+    req->len = len;
+    if (!req->valid())
+        return nullptr;
+    return req;
+}
+
+bool FlatRequest::encode(const request::Request &req, std::string &out)
+{
+    size_t ops = 0;
+    size_t bytes = 0;
+    for (const auto &txn : req.transaction())
+    {
+        ops += txn.operations_size();
+        bytes += txn.id().size();
+        for (const auto &op : txn.operations())
+        {
+            if (!mockDB_key_ids.count(op.key()))
+                return false;
+            bytes += op.value().size();
+        }
+    }
+
+    size_t base = out.size();
+    size_t txns_at = base + HEADER;
+    size_t ops_at = txns_at + req.transaction_size() * TXN;
+    size_t bytes_at = ops_at + ops * OP;
+    if (bytes_at + bytes - base > UINT32_MAX)
+        return false;
+    out.resize(bytes_at + bytes);
+
+    out[base] = char(MAGIC);
+    out[base + 1] = char(VERSION);
+    out[base + 2] = char(req.recipient());
+    out[base + 3] = 0;
+    store<int32_t>(out, base + 4, req.server_id());
+    store<int32_t>(out, base + 8, req.round());
+    store<int32_t>(out, base + 12, req.batcher_round());
+    store<int32_t>(out, base + 16, req.target_server_id());
+    store<uint32_t>(out, base + 20, req.transaction_size());
+
+    // offsets are from the start of this frame, not of out
+    uint32_t op_index = 0;
+    size_t next_byte = bytes_at;
+    auto append = [&](const std::string &s)
+    {
+        uint32_t off = uint32_t(next_byte - base);
+        memcpy(&out[next_byte], s.data(), s.size());
+        next_byte += s.size();
+        return off;
+    };
+
+    for (int i = 0; i < req.transaction_size(); ++i)
+    {
+        const request::Transaction &txn = req.transaction(i);
+        size_t t = txns_at + i * TXN;
+        store<uint32_t>(out, t, append(txn.id()));
+        store<uint32_t>(out, t + 4, txn.id().size());
+        store<int32_t>(out, t + 8, txn.client_id());
+        store<int32_t>(out, t + 12, txn.random_stamp());
+        store<uint32_t>(out, t + 16, op_index);
+        store<uint32_t>(out, t + 20, txn.operations_size());
+
+        for (const auto &op : txn.operations())
+        {
+            size_t o = ops_at + op_index++ * OP;
+            store<uint32_t>(out, o, mockDB_key_ids.at(op.key()));
+            store<uint32_t>(out, o + 4, append(op.value()));
+            store<uint32_t>(out, o + 8, op.value().size());
+            out[o + 12] = char(op.type() == request::Operation::WRITE ? OperationType::WRITE : OperationType::READ);
+            out[o + 13] = char(op.has_value());
+            out[o + 14] = 0;
+            out[o + 15] = 0;
+        }
+    }
+    return true;
+}
+
+bool FlatRequest::valid() const
+{
+    if (len < HEADER || uint8_t(data[0]) != MAGIC || uint8_t(data[1]) != VERSION)
+        return false;
+
+    uint64_t txns = transaction_size();
+    if (HEADER + txns * TXN > len)
+        return false;
+
+    // the ops a transaction points at have to be there too
+    uint64_t ops = 0;
+    for (uint32_t i = 0; i < txns; ++i)
+    {
+        size_t t = HEADER + size_t(i) * TXN;
+        if (uint64_t(load<uint32_t>(t)) + load<uint32_t>(t + 4) > len)
+            return false;
+        ops = std::max<uint64_t>(ops, uint64_t(load<uint32_t>(t + 16)) + load<uint32_t>(t + 20));
+    }
+
+    uint64_t ops_at = opsAt();
+    if (ops_at + ops * OP > len)
+        return false;
+
+    for (uint32_t i = 0; i < ops; ++i)
+    {
+        size_t o = ops_at + size_t(i) * OP;
+        if (load<uint32_t>(o) >= mockDB_primaries.size() || uint8_t(data[o + 12]) > uint8_t(OperationType::WRITE))
+            return false;
+        if (uint64_t(load<uint32_t>(o + 4)) + load<uint32_t>(o + 8) > len)
+            return false;
+    }
+    return true;
+}
+
+void FlatRequest::decode(request::Request &out) const
+{
+    out.Clear();
+    out.set_recipient(recipient());
+    out.set_server_id(server_id());
+    out.set_round(round());
+    out.set_batcher_round(batcher_round());
+    out.set_target_server_id(target_server_id());
+
+    for (uint32_t i = 0; i < transaction_size(); ++i)
+    {
+        Txn txn = transaction(i);
+        request::Transaction *t = out.add_transaction();
+        t->set_id(std::string(txn.id));
+        t->set_client_id(txn.client_id);
+        t->set_random_stamp(txn.random_stamp);
+
+        for (uint32_t k = 0; k < txn.op_count; ++k)
+        {
+            Op op = operation(txn.first_op + k);
+            request::Operation *o = t->add_operations();
+            o->set_type(op.type == OperationType::WRITE ? request::Operation::WRITE : request::Operation::READ);
+            o->set_key(mockDB_keys[op.key_id]);
+            if (op.has_value)
+                o->set_value(std::string(op.value));
+        }
+    }
+}
+
+FlatRequest::Txn FlatRequest::transaction(uint32_t i) const
+{
+    size_t t = HEADER + size_t(i) * TXN;
+    uint32_t id_off = load<uint32_t>(t);
+    uint32_t id_len = load<uint32_t>(t + 4);
+    return {std::string_view(data + id_off, id_len), load<int32_t>(t + 8), load<int32_t>(t + 12),
+            load<uint32_t>(t + 16), load<uint32_t>(t + 20)};
+}
+
+FlatRequest::Op FlatRequest::operation(uint32_t op) const
+{
+    size_t o = opsAt() + size_t(op) * OP;
+    return {load<uint32_t>(o), OperationType(uint8_t(data[o + 12])), data[o + 13] != 0,
+            std::string_view(data + load<uint32_t>(o + 4), load<uint32_t>(o + 8))};
+}
@@ -0,0 +1,111 @@
+#ifndef FLAT_REQUEST_H
+#define FLAT_REQUEST_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "transaction.h"
+#include "../proto/request.pb.h"
+
+// A flat encoding of request::Request that is read where it lies: fixed-width
+// fields at known offsets, keys as database key ids, values as (offset, length)
+// into the frame. Decoding a field is a load, so the merger builds its
+// transactions straight from the received bytes instead of parsing them.
+//
+// Little-endian, every offset from the start of the frame:
+//   header  magic, version, recipient (1 byte each, then 1 spare), server_id,
+//           round, batcher_round, target_server_id, transaction count       24 bytes
+//   txns    id offset, id length, client_id, random_stamp, first op, op count  24 bytes each
+//   ops     key id, value offset, value length, type, has value (1 byte each,
+//           then 2 spare)                                                     16 bytes each
+//   bytes   transaction ids and values
+//
+// The magic byte has wire type 7, which protobuf never uses, so a flat frame
+// can share a connection with protobuf ones. Servers only send it to peers that
+// said they read it (see ConnectionManager).
+//
+// Received frames are not read in the transport's buffer: the reactor reuses it
+// once the handler returns and the merger gets to the frame later, on its own
+// thread, so handlers take a copy (see copy). What the format saves on receipt
+// is the parse, not that copy.
+class FlatRequest
+{
+public:
+    static constexpr uint8_t MAGIC = 0xC7;
+    static constexpr uint8_t VERSION = 1;
+
+    struct Op
+    {
+        KeyId key_id;
+        OperationType type;
+        bool has_value;
+        std::string_view value;
+    };
+
+    struct Txn
+    {
+        std::string_view id;
+        int32_t client_id;
+        int32_t random_stamp;
+        uint32_t first_op;
+        uint32_t op_count;
+    };
+
+private:
+    std::string owned; // the frame, when this holds a copy of it
+    const char *data = nullptr;
+    uint32_t len = 0;
+
+    template <typename T>
+    T load(size_t off) const
+    {
+        T v;
+        memcpy(&v, data + off, sizeof(v));
+        return v;
+    }
+
+    size_t opsAt() const { return HEADER + transaction_size() * TXN; }
+
+public:
+    static constexpr size_t HEADER = 24;
+    static constexpr size_t TXN = 24;
+    static constexpr size_t OP = 16;
+
+    // A view of a frame someone else keeps; check it with valid() first.
+    FlatRequest(const char *data_, uint32_t len_) : data(data_), len(len_) {}
+    FlatRequest(const FlatRequest &) = delete;
+    FlatRequest &operator=(const FlatRequest &) = delete;
+
+    // A copy of a received frame, nullptr if it is not a well-formed flat frame;
+    // one memcpy of the frame, which then outlives the transport's read buffer.
+    static std::shared_ptr<FlatRequest> copy(const char *data, uint32_t len);
+
+    static bool isFlat(const char *data, uint32_t len) { return len > 0 && uint8_t(data[0]) == MAGIC; }
+
+    // Appends req's encoding to out; false (out left as it was) if some key has
+    // no key id, which only protobuf can carry.
+    static bool encode(const request::Request &req, std::string &out);
+
+    // Every offset and length lies inside the frame.
+    bool valid() const;
+
+    // The protobuf form of a valid frame, for a peer that does not read flat.
+    void decode(request::Request &out) const;
+
+    request::Request::RequestRecipient recipient() const { return request::Request::RequestRecipient(uint8_t(data[2])); }
+    int32_t server_id() const { return load<int32_t>(4); }
+    int32_t round() const { return load<int32_t>(8); }
+    int32_t batcher_round() const { return load<int32_t>(12); }
+    int32_t target_server_id() const { return load<int32_t>(16); }
+    uint32_t transaction_size() const { return load<uint32_t>(20); }
+
+    Txn transaction(uint32_t i) const;
+    Op operation(uint32_t op) const; // an index from Txn::first_op on
+};
+
+using SharedFlatRequest = std::shared_ptr<FlatRequest>;
+
+#endif // FLAT_REQUEST_H
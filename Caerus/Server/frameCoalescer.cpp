@@ -0,0 +1,47 @@
+#include "frameCoalescer.h"
+
+FrameCoalescer::FrameCoalescer(size_t max_bytes, Clock::duration max_delay)
+    : max_bytes(max_bytes), max_delay(max_delay)
+{
+}
+
+void FrameCoalescer::push(const std::string &head, const std::string &body)
+{
+    if (count == frames.size())
+    {
+        frames.emplace_back();
+    }
+
+    // copied into the frame's buffer, which keeps its capacity from earlier flushes
+    std::string &frame = frames[count];
+    frame.assign(head);
+    frame.append(body);
+
+    if (count == 0)
+    {
+        oldest = Clock::now();
+    }
+    bytes += sizeof(uint32_t) + frame.size();
+    ++count;
+}
+
+bool FrameCoalescer::flush(int fd)
+{
+    sends.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        sends.push_back({fd, frames[i].data(), uint32_t(frames[i].size()), false});
+    }
+
+    sendFrames(sends.data(), sends.size());
+
+    bool ok = true;
+    for (const FrameSend &send : sends)
+    {
+        ok = ok && send.ok;
+    }
+
+    count = 0;
+    bytes = 0;
+    return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef FRAME_COALESCER_H
+#define FRAME_COALESCER_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "transport.h"
+
+// Frames waiting to go out on one peer link. The owner queues encoded frames as
+// they are produced and flushes the queue, as one sendFrames batch (a single gather
+// write on the epoll transport), once it holds max_bytes or its oldest frame
+// has used up max_delay. Frame buffers are kept between flushes, so their
+// buffers are reused rather than reallocated.
+class FrameCoalescer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    size_t max_bytes;
+    Clock::duration max_delay;
+
+    std::vector<std::string> frames; // the first count are queued
+    size_t count = 0;
+    size_t bytes = 0;
+    Clock::time_point oldest;
+    std::vector<FrameSend> sends;
+
+public:
+    FrameCoalescer(size_t max_bytes, Clock::duration max_delay);
+
+    // Queues head followed by body as the next frame, both already encoded.
+    void push(const std::string &head, const std::string &body);
+
+    bool empty() const { return count == 0; }
+    bool full() const { return bytes >= max_bytes; }
+
+    // when the oldest queued frame runs out of its latency budget
+    Clock::time_point deadline() const { return oldest + max_delay; }
+    bool due(Clock::time_point now) const { return count != 0 && (full() || now >= deadline()); }
+
+    // Writes every queued frame on fd and empties the queue; false once the
+    // connection is broken, in which case the frames are dropped.
+    bool flush(int fd);
+};
+
+#endif // FRAME_COALESCER_H
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+
+#include "frameReader.h"
+
+char *FrameReader::writable(size_t min_room)
+{
+    size_t pending = tail - head;
+
+    if (pending == 0)
+    {
+        head = tail = 0;
+        if (buf.size() > capacity)
+        {
+            // an oversized frame is gone, give the memory back
+            buf.resize(capacity);
+            buf.shrink_to_fit();
+        }
+    }
+
+    size_t need = pending + min_room;
+    if (pending >= sizeof(uint32_t))
+    {
+        uint32_t netlen;
+        memcpy(&netlen, buf.data() + head, sizeof(netlen));
+        need = std::max(need, sizeof(netlen) + ntohl(netlen));
+    }
+
+    if (buf.size() - tail < min_room || buf.size() - head < need)
+    {
+        // move the partial frame to the front, growing only if it still does not fit
+        if (head > 0)
+        {
+            memmove(buf.data(), buf.data() + head, pending);
+            head = 0;
+            tail = pending;
+        }
+        if (buf.size() < need)
+        {
+            buf.resize(need);
+        }
+    }
+
+    return buf.data() + tail;
+}
+
+void FrameReader::append(const char *data, size_t len)
+{
+    memcpy(writable(len), data, len);
+    commit(len);
+}
+
+bool FrameReader::next(const char *&data, uint32_t &len)
+{
+    if (tail - head < sizeof(uint32_t))
+    {
+        return false;
+    }
+
+    uint32_t netlen;
+    memcpy(&netlen, buf.data() + head, sizeof(netlen));
+    uint32_t frame_len = ntohl(netlen);
+    if (tail - head - sizeof(netlen) < frame_len)
+    {
+        return false;
+    }
+
+    data = buf.data() + head + sizeof(netlen);
+    len = frame_len;
+    head += sizeof(netlen) + frame_len;
+    return true;
+}
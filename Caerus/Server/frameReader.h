@@ -0,0 +1,42 @@
+#ifndef FRAME_READER_H
+#define FRAME_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A connection's read buffer. Bytes are read straight into it (writable() and
+// commit()) or copied in with append(), and next() hands out every complete
+// length-prefixed frame in place, without copying it out. The buffer is reused
+// for the life of the connection and only grows for a frame that does not fit;
+// it goes back to its normal size once that frame has been consumed.
+class FrameReader
+{
+private:
+    std::vector<char> buf;
+    size_t capacity; // normal size of buf
+    size_t head = 0; // first byte not handed out yet
+    size_t tail = 0; // end of the buffered bytes
+
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 16 * 1024;
+    static constexpr size_t MIN_READ = 1024;
+
+    explicit FrameReader(size_t capacity = DEFAULT_CAPACITY) : buf(capacity), capacity(capacity) {}
+
+    // Where to read to: at least min_room bytes, and room for the whole of the frame
+    // at the front. Frames handed out by next() are invalidated.
+    char *writable(size_t min_room = MIN_READ);
+    size_t writableSize() const { return buf.size() - tail; }
+    void commit(size_t n) { tail += n; }
+
+    void append(const char *data, size_t len);
+
+    // The next complete frame, if there is one; data points into the buffer and
+    // stays valid until the next writable() or append().
+    bool next(const char *&data, uint32_t &len);
+
+    size_t buffered() const { return tail - head; }
+};
+
+#endif // FRAME_READER_H
@@ -11,6 +11,11 @@
 
 #include "graph.h"
 
+// Per-edge graph.log tracing; benchmarks build with -DGRAPH_LOG_EDGES=0.
+#ifndef GRAPH_LOG_EDGES
+#define GRAPH_LOG_EDGES 1
+#endif
+
 namespace
 {
 constexpr const char *kGraphLogPath = "graph.log";
@@ -18,7 +23,7 @@ std::mutex graph_log_mtx;
 std::atomic<uint64_t> graph_log_seq{0};
 std::once_flag graph_log_init_once;
 
-void appendGraphLog(const std::string &event, const std::string &details)
+[[maybe_unused]] void appendGraphLog(const std::string &event, const std::string &details)
 {
     const uint64_t seq = graph_log_seq.fetch_add(1, std::memory_order_relaxed) + 1;
 
@@ -38,59 +43,88 @@ void appendGraphLog(const std::string &event, const std::string &details)
 }
 } // namespace
 
-Transaction *Graph::addNode(std::unique_ptr<Transaction> uptr)
+Transaction *Graph::addNode(const Transaction &txn)
 {
-    const std::string &key = uptr->getID();
-    Transaction *ptr = uptr.get();
+    Transaction *ptr = pool.acquire(txn);
+    const std::string &key = ptr->getID();
+
+    if (ptr->getHandle() == INVALID_TXN_HANDLE)
+    {
+        ptr->setHandle(ids.intern(key));
+    }
+
+    const TxnHandle handle = ptr->getHandle();
+    if (handle >= nodes.size())
+    {
+        nodes.resize(handle + 1);
+        txn_scc_index.resize(handle + 1, -1);
+    }
 
-    nodes[key] = std::move(uptr);
+    nodes[handle] = ptr;
+    ++node_count;
 
     {
         std::lock_guard<std::mutex> lock(snapshot_mtx);
-        nodes_static[key] = std::make_unique<Transaction>(
-            ptr->getOrder(),
-            ptr->getServerId(),
-            ptr->getOperations(),
-            ptr->getID()
-        );
+        nodes_static[key]; // no out neighbors yet
     }
 
     //appendGraphLog("add_node", "tx=" + key + " size=" + std::to_string(nodes.size()));
 
-    return ptr;
-}
+    if (incremental_scc)
+    {
+        candidate_sccs.insert(newComponent(ptr));
+    }
 
-Transaction *Graph::getNode(const std::string &uuid)
-{
-    auto it = nodes.find(uuid);
-    return it == nodes.end() ? nullptr : it->second.get();
+    return ptr;
 }
 
 void Graph::addNeighborOut(Transaction* from, Transaction* to) {
-    from->addNeighborOut(to);
+    if (!from->addNeighborOut(to))
+    {
+        return; // edge already present
+    }
+
+    if (incremental_scc)
+    {
+        addComponentEdge(txn_scc_index[from->getHandle()], txn_scc_index[to->getHandle()]);
+    }
 
     // copy to static graph as well
     {
         std::lock_guard<std::mutex> lock(snapshot_mtx);
         auto it_from = nodes_static.find(from->getID());
-        auto it_to = nodes_static.find(to->getID());
-        if (it_from != nodes_static.end() && it_to != nodes_static.end()) {
-            it_from->second->addNeighborOut(it_to->second.get()); 
+        if (it_from != nodes_static.end() && nodes_static.count(to->getID())) {
+            it_from->second.push_back(to->getID());
         }
     }
     
+#if GRAPH_LOG_EDGES
     const auto &nbr = from->getOutNeighbors();
     appendGraphLog(
         "add_edge",
         "from=" + from->getID() + " to=" + to->getID() + " out_deg=" + std::to_string(nbr.size()));
+#endif
+}
+
+void Graph::addSeenRegion(Transaction *txn, int32_t region)
+{
+    txn->addSeenRegion(region);
+
+    // completeness of its SCC may have changed
+    if (incremental_scc)
+    {
+        candidate_sccs.insert(txn_scc_index[txn->getHandle()]);
+    }
 }
 
 void Graph::printAll() const
 {
-    std::cout << "Graph contains " << nodes.size() << " node(s):\n";
-    for (const auto &kv : nodes)
+    std::cout << "Graph contains " << node_count << " node(s):\n";
+    for (const auto &node : nodes)
     {
-        const Transaction *t = kv.second.get();
+        if (!node)
+            continue;
+        const Transaction *t = node;
         // Basic info
         std::cout << "- ID: " << t->getID() << "\n";
         // Operations
@@ -111,27 +145,29 @@ void Graph::printAll() const
         // Neighbors
         const auto &nbr = t->getOutNeighbors();
         std::cout << "    Neighbors (" << nbr.size() << "):";
-        for (auto *n : nbr)
+        for (TxnHandle n : nbr)
         {
-            std::cout << " " << n->getID();
+            std::cout << " " << nodes[n]->getID();
         }
         std::cout << "\n\n";
 
         // Expected regions
         const auto &expected_regions = t->getExpectedRegions();
-        std::cout << "    Expected regions (" << expected_regions.size() << "):";
-        for (auto region : expected_regions)
+        std::cout << "    Expected regions (" << expected_regions.count() << "):";
+        for (int32_t region = 0; region < MAX_CLUSTER_SIZE; ++region)
         {
-            std::cout << " " << region;
+            if (expected_regions.test(region))
+                std::cout << " " << region;
         }
         std::cout << "\n";
 
         // Seen regions
         const auto &seen_regions = t->getSeenRegions();
-        std::cout << "    Seen regions (" << seen_regions.size() << "):";
-        for (auto region : seen_regions)
+        std::cout << "    Seen regions (" << seen_regions.count() << "):";
+        for (int32_t region = 0; region < MAX_CLUSTER_SIZE; ++region)
         {
-            std::cout << " " << region;
+            if (seen_regions.test(region))
+                std::cout << " " << region;
         }
         std::cout << "\n";
     }
@@ -139,143 +175,185 @@ void Graph::printAll() const
 
 void Graph::clear()
 {
+    for (Transaction *node : nodes)
+    {
+        if (node)
+            pool.release(node);
+    }
     nodes.clear();
-    index_map.clear();
-    low_link_map.clear();
-    tarjan_stack = std::stack<Transaction *>{};
+    node_count = 0;
+    tarjan_edge_begin.clear();
+    tarjan_edges.clear();
+    index_of.clear();
+    low_link.clear();
     on_stack.clear();
+    tarjan_stack.clear();
+    call_stack.clear();
     sccs.clear();
     current_index = 0;
+    txn_scc_index.clear();
+    components.clear();
+    free_components.clear();
+    candidate_sccs.clear();
+    next_ord = 0;
 }
 
-std::unique_ptr<Transaction> Graph::removeTransaction(Transaction *rem)
+bool Graph::removeTransaction(Transaction *rem)
 {
-    auto it = nodes.find(rem->getID());
-    if (it == nodes.end())
-        return nullptr;
+    const TxnHandle handle = rem->getHandle();
+    if (getNode(handle) != rem)
+        return false;
 
     // copy the incoming‐neighbor list and break those edges
-    std::vector<Transaction *> preds(
+    std::vector<TxnHandle> preds(
         rem->getIncomingNeighbors().begin(),
         rem->getIncomingNeighbors().end());
-    for (Transaction *pred : preds)
+    for (TxnHandle pred_handle : preds)
     {
+        Transaction *pred = nodes[pred_handle];
         pred->removeOutNeighbor(rem);
         rem->addNeighborInID(pred->getID());
     }
 
     // copy the outgoing‐neighbor list and break those edges
-    std::vector<Transaction *> succs(
+    std::vector<TxnHandle> succs(
         rem->getOutNeighbors().begin(),
         rem->getOutNeighbors().end());
-    for (Transaction *succ : succs)
+    for (TxnHandle succ : succs)
     {
-        rem->removeOutNeighbor(succ);
+        rem->removeOutNeighbor(nodes[succ]);
     }
 
-    // 3) now it’s safe to steal and erase
-    auto removed = std::move(it->second);
-    nodes.erase(it);
+    // 3) now it’s safe to erase; the caller hands the node back to the pool
+    nodes[handle] = nullptr;
+    --node_count;
+    txn_scc_index[handle] = -1;
 
     // 4) remove from mrw or mrr maps
-    for (const auto &op : removed->getOperations())
+    for (const auto &op : rem->getOperations())
     {
-        auto db_it = mockDB.find(op.key);
-
-        if (db_it == mockDB.end())
+        if (op.key_id == INVALID_KEY_ID)
         {
             std::cout << "REMOVE::ReadWriteSet: key " << op.key << " not found" << std::endl;
             continue;
         }
 
-        auto data_item = db_it->second;
-
         if (op.type == OperationType::READ)
         {
-            remove_MRR(data_item, removed->getID());
+            remove_MRR(op.key_id, handle);
         }
         else if (op.type == OperationType::WRITE)
         {
-            remove_MRW(data_item);
+            remove_MRW(op.key_id);
         }
     }
 
     // print size of graph after removal
     //std::cout << "Graph size after removal: " << nodes.size() << " nodes remaining." << std::endl;
 
-    // check if this transaction has actually been removed
-    if (nodes.find(rem->getID()) != nodes.end())
-    {
-        std::cerr << "Error: Transaction " << rem->getID() << " was not removed from graph!" << std::endl;
-    }
-    else
-    {
-        //std::cout << "Transaction " << rem->getID() << " successfully removed from graph." << std::endl;
-    }
+    // the handle is free for the next transaction the merger sees
+    ids.release(handle);
 
     //printAll();
 
-    return removed;
+    return true;
 }
 
-void Graph::strongConnect(Transaction *v)
+void Graph::strongConnect(int32_t root)
 {
-    // 1. Set the depth index for v
-    index_map[v] = current_index;
-    low_link_map[v] = current_index;
-    ++current_index;
+    auto visit = [this](int32_t v)
+    {
+        // 1. Set the depth index for v
+        index_of[v] = current_index;
+        low_link[v] = current_index;
+        ++current_index;
 
-    tarjan_stack.push(v);
-    on_stack.insert(v);
+        tarjan_stack.push_back(v);
+        on_stack[v] = 1;
+        call_stack.push_back({v, tarjan_edge_begin[v]});
+    };
 
-    // 2. Consider successors of v
-    for (Transaction *w : v->getOutNeighbors())
+    visit(root);
+
+    while (!call_stack.empty())
     {
-        if (index_map.find(w) == index_map.end())
+        TarjanFrame &frame = call_stack.back();
+        const int32_t v = frame.v;
+
+        // 2. Consider successors of v, one per iteration
+        if (frame.next_edge < tarjan_edge_begin[v + 1])
         {
-            // w has not yet been visited; recurse on it
-            strongConnect(w);
-            low_link_map[v] = std::min(low_link_map[v], low_link_map[w]);
+            const int32_t w = tarjan_edges[frame.next_edge++];
+            if (index_of[w] < 0)
+            {
+                // w has not yet been visited; descend into it
+                visit(w);
+            }
+            else if (on_stack[w])
+            {
+                // successor w is in stack and hence in the current SCC
+                low_link[v] = std::min(low_link[v], index_of[w]);
+            }
+            continue;
         }
-        else if (on_stack.count(w))
+
+        // 3. If v is a root node, pop the stack and generate an SCC
+        if (low_link[v] == index_of[v])
         {
-            // successor w is in stack and hence in the current SCC
-            low_link_map[v] = std::min(low_link_map[v], index_map[w]);
+            std::vector<Transaction *> component;
+            int32_t w;
+            do
+            {
+                w = tarjan_stack.back();
+                tarjan_stack.pop_back();
+                on_stack[w] = 0;
+                component.push_back(nodes[w]);
+            } while (w != v);
+            sccs.push_back(std::move(component));
         }
-    }
 
-    // 3. If v is a root node, pop the stack and generate an SCC
-    if (low_link_map[v] == index_map[v])
-    {
-        std::vector<Transaction *> component;
-        Transaction *w = nullptr;
-        do
+        // return to the caller and fold v's low link into it
+        call_stack.pop_back();
+        if (!call_stack.empty())
         {
-            w = tarjan_stack.top();
-            tarjan_stack.pop();
-            on_stack.erase(w);
-            component.push_back(w);
-        } while (w != v);
-        sccs.push_back(std::move(component));
+            const int32_t u = call_stack.back().v;
+            low_link[u] = std::min(low_link[u], low_link[v]);
+        }
     }
 }
 
 void Graph::findSCCs()
 {
+    // flatten the adjacency for this pass; free handle slots just have no edges
+    const int32_t n = nodes.size();
+
+    tarjan_edge_begin.assign(n + 1, 0);
+    tarjan_edges.clear();
+    for (int32_t v = 0; v < n; ++v)
+    {
+        tarjan_edge_begin[v] = tarjan_edges.size();
+        if (!nodes[v])
+            continue;
+        for (TxnHandle w : nodes[v]->getOutNeighbors())
+        {
+            tarjan_edges.push_back(w);
+        }
+    }
+    tarjan_edge_begin[n] = tarjan_edges.size();
+
     // reset any old Tarjan state
-    index_map.clear();
-    low_link_map.clear();
-    while (!tarjan_stack.empty())
-        tarjan_stack.pop();
-    on_stack.clear();
+    index_of.assign(n, -1);
+    low_link.assign(n, 0);
+    on_stack.assign(n, 0);
+    tarjan_stack.clear();
+    call_stack.clear();
     sccs.clear();
     current_index = 0;
 
     // run Tarjan on every node
-    for (auto &kv : nodes)
+    for (int32_t v = 0; v < n; ++v)
     {
-        Transaction *v = kv.second.get();
-        if (index_map.find(v) == index_map.end())
+        if (nodes[v] && index_of[v] < 0)
         {
             strongConnect(v);
         }
@@ -300,19 +378,29 @@ void Graph::findSCCs()
 void Graph::buildTransactionSCCMap()
 {
 
-    txn_scc_index_map.clear();
+    components.assign(sccs.size(), {});
+    free_components.clear();
 
+    // Tarjan emits SCCs in reverse topological order, so later SCCs go first
     for (int i = 0; i < (int)sccs.size(); ++i)
     {
-        for (Transaction *txn_ptr : sccs[i])
+        Component &comp = components[i];
+        comp.members = std::move(sccs[i]);
+        comp.ord = -i;
+        comp.alive = true;
+
+        for (Transaction *txn_ptr : comp.members)
         {
-            txn_scc_index_map[txn_ptr] = i;
+            txn_scc_index[txn_ptr->getHandle()] = i;
         }
     }
 
+    next_ord = -(int64_t)sccs.size();
+    sccs.clear();
+
     // Print the mapping
     // std::cout << "Transaction to SCC mapping:\n";
-    // for (const auto& pair : txn_scc_index_map) {
+    // for (const auto& pair : txn_scc_index) {
     //     std::cout << "Transaction ID: " << pair.first->getID()
     //               << " is in SCC: " << pair.second << "\n";
     // }
@@ -320,52 +408,272 @@ void Graph::buildTransactionSCCMap()
 
 void Graph::buildCondensationGraph()
 {
-    // 1. Resize to one entry per SCC, and clear any old edges
-    neighbors_out.assign(sccs.size(), {});
-    neighbors_in.assign(sccs.size(), {});
+    // Walk *every* original edge u → v in your graph:
+    for (auto &node : nodes)
+    {
+        if (!node)
+            continue;
+        int cu = txn_scc_index[node->getHandle()]; // which SCC u belongs to
+
+        for (TxnHandle v : node->getOutNeighbors())
+        {
+            int cv = txn_scc_index[v]; // which SCC v belongs to
+
+            // If it crosses SCCs, record it once
+            if (cu != cv && components[cu].neighbors_out.insert(cv).second)
+            {
+                // record the reverse link too
+                components[cv].neighbors_in.insert(cu);
+            }
+        }
+    }
+}
+
+void Graph::rebuildSCCs()
+{
+    findSCCs();
+    buildTransactionSCCMap();
+    buildCondensationGraph();
+
+    candidate_sccs.clear();
+    for (int c = 0; c < (int)components.size(); ++c)
+    {
+        candidate_sccs.insert(c);
+    }
+}
+
+void Graph::setIncrementalSCC(bool on)
+{
+    if (on && !incremental_scc)
+    {
+        rebuildSCCs(); // pick up the edges added while we were not tracking them
+    }
+    incremental_scc = on;
+}
+
+int Graph::newComponent(Transaction *txn)
+{
+    int c;
+    if (!free_components.empty())
+    {
+        c = free_components.back();
+        free_components.pop_back();
+    }
+    else
+    {
+        c = components.size();
+        components.emplace_back();
+    }
+
+    Component &comp = components[c];
+    comp.members.assign(1, txn);
+    comp.ord = next_ord--;
+    comp.alive = true;
+
+    txn_scc_index[txn->getHandle()] = c;
+    return c;
+}
+
+void Graph::addComponentEdge(int from, int to)
+{
+    if (from == to || !components[from].neighbors_out.insert(to).second)
+    {
+        return;
+    }
+    components[to].neighbors_in.insert(from);
+
+    // only an edge against the current order can close a cycle
+    if (components[from].ord > components[to].ord)
+    {
+        reorderComponents(from, to);
+    }
+}
+
+// Pearce–Kelly: restore the topological order after adding from → to with ord[to] < ord[from].
+// Only components with ord in [ord[to], ord[from]] can be affected. If to already reaches
+// from, the components on those paths form a new SCC and are collapsed into one.
+void Graph::reorderComponents(int from, int to)
+{
+    const int64_t lb = components[to].ord;
+    const int64_t ub = components[from].ord;
+    const uint64_t epoch = ++visit_epoch;
+
+    // forward from `to`, staying at or below ub
+    std::vector<int> delta_f;
+    std::vector<int> stack{to};
+    components[to].mark_f = epoch;
+    while (!stack.empty())
+    {
+        int c = stack.back();
+        stack.pop_back();
+        delta_f.push_back(c);
+
+        for (int s : components[c].neighbors_out)
+        {
+            if (components[s].mark_f != epoch && components[s].ord <= ub)
+            {
+                components[s].mark_f = epoch;
+                stack.push_back(s);
+            }
+        }
+    }
 
-    // 2. Walk *every* original edge u → v in your graph:
-    for (auto &kv : nodes)
+    // backward from `from`, staying at or above lb
+    std::vector<int> delta_b;
+    stack.push_back(from);
+    components[from].mark_b = epoch;
+    while (!stack.empty())
     {
-        Transaction *u = kv.second.get();
-        int cu = txn_scc_index_map[u]; // which SCC u belongs to
+        int c = stack.back();
+        stack.pop_back();
+        delta_b.push_back(c);
 
-        for (Transaction *v : u->getOutNeighbors())
+        for (int p : components[c].neighbors_in)
+        {
+            if (components[p].mark_b != epoch && components[p].ord >= lb)
+            {
+                components[p].mark_b = epoch;
+                stack.push_back(p);
+            }
+        }
+    }
+
+    // every affected component gives back its slot in the order
+    std::vector<int64_t> slots;
+    slots.reserve(delta_f.size() + delta_b.size());
+    for (int c : delta_b)
+    {
+        slots.push_back(components[c].ord);
+    }
+    for (int c : delta_f)
+    {
+        if (components[c].mark_b != epoch)
         {
-            int cv = txn_scc_index_map[v]; // which SCC v belongs to
+            slots.push_back(components[c].ord);
+        }
+    }
+    std::sort(slots.begin(), slots.end());
+
+    auto byOrd = [this](int a, int b) { return components[a].ord < components[b].ord; };
 
-            // 3. If it crosses SCCs, record it once
-            if (cu != cv)
+    // a component reached from both sides lies on a cycle through the new edge
+    std::vector<int> cycle;
+    if (components[from].mark_f == epoch)
+    {
+        for (int c : delta_f)
+        {
+            if (components[c].mark_b == epoch)
             {
-                // neighbors_out[cu].insert(cv).second is true only on the first insertion
-                if (neighbors_out[cu].insert(cv).second)
-                {
-                    // record the reverse link too
-                    neighbors_in[cv].push_back(cu);
-                }
+                cycle.push_back(c);
             }
         }
+        auto onCycle = [&](int c) { return components[c].mark_f == epoch && components[c].mark_b == epoch; };
+        delta_f.erase(std::remove_if(delta_f.begin(), delta_f.end(), onCycle), delta_f.end());
+        delta_b.erase(std::remove_if(delta_b.begin(), delta_b.end(), onCycle), delta_b.end());
+    }
+
+    std::sort(delta_b.begin(), delta_b.end(), byOrd);
+    std::sort(delta_f.begin(), delta_f.end(), byOrd);
+
+    // predecessors of `from` first, then the collapsed cycle, then successors of `to`
+    size_t next = 0;
+    for (int c : delta_b)
+    {
+        components[c].ord = slots[next++];
+    }
+    if (!cycle.empty())
+    {
+        int root = collapseComponents(cycle);
+        components[root].ord = slots[next];
+    }
+    next = slots.size() - delta_f.size();
+    for (int c : delta_f)
+    {
+        components[c].ord = slots[next++];
     }
 }
 
-bool Graph::isSCCComplete(const int &scc_index)
+int Graph::collapseComponents(const std::vector<int> &cycle)
 {
-    // For SCC c to be a sink, no member may have an edge out to a txn in a different comp.
-    // And for completeness, each txn must return true from isComplete().
-    for (auto *T : sccs[scc_index])
+    // keep the biggest component and move the others into it
+    int root = cycle.front();
+    for (int c : cycle)
     {
-        // SCC‐sink check: scan every outgoing edge of T
-        for (auto *nbr : T->getOutNeighbors())
+        if (components[c].members.size() > components[root].members.size())
+        {
+            root = c;
+        }
+    }
+
+    std::unordered_set<int> in_cycle(cycle.begin(), cycle.end());
+    Component &r = components[root];
+
+    for (int c : cycle)
+    {
+        if (c == root)
+        {
+            continue;
+        }
+        Component &comp = components[c];
+
+        for (Transaction *txn : comp.members)
         {
-            if (txn_scc_index_map.at(nbr) != scc_index)
+            txn_scc_index[txn->getHandle()] = root;
+            r.members.push_back(txn);
+        }
+
+        for (int s : comp.neighbors_out)
+        {
+            components[s].neighbors_in.erase(c);
+            if (!in_cycle.count(s))
             {
-                //std::cout << "SCC " << scc_index << " incomplete due to txn " << T->getID() << " having outgoing edge to txn " << nbr->getID() << ".\n";
-                return false;
+                r.neighbors_out.insert(s);
+                components[s].neighbors_in.insert(root);
             }
         }
 
+        for (int p : comp.neighbors_in)
+        {
+            components[p].neighbors_out.erase(c);
+            if (!in_cycle.count(p))
+            {
+                r.neighbors_in.insert(p);
+                components[p].neighbors_out.insert(root);
+            }
+        }
+
+        comp = Component{};
+        free_components.push_back(c);
+    }
+
+    // edges between cycle members are now internal
+    for (auto it = r.neighbors_out.begin(); it != r.neighbors_out.end();)
+    {
+        it = in_cycle.count(*it) ? r.neighbors_out.erase(it) : std::next(it);
+    }
+    for (auto it = r.neighbors_in.begin(); it != r.neighbors_in.end();)
+    {
+        it = in_cycle.count(*it) ? r.neighbors_in.erase(it) : std::next(it);
+    }
+
+    candidate_sccs.insert(root);
+    return root;
+}
+
+bool Graph::isSCCComplete(const int &scc_index)
+{
+    // For SCC c to be a sink, it may have no edge out to a different SCC.
+    // And for completeness, each txn must return true from isComplete().
+    const Component &comp = components[scc_index];
+    if (!comp.alive || !comp.neighbors_out.empty())
+    {
+        return false;
+    }
+
+    for (auto *T : comp.members)
+    {
         // Ensure transaction has observed all expected regions.
-        if (T->getSeenRegions() != T->getExpectedRegions())
+        if (!T->isComplete())
         {
             //std::cout << "SCC " << scc_index << " incomplete due to txn " << T->getID() << " missing regions.\n";
             return false;
@@ -377,28 +685,23 @@ bool Graph::isSCCComplete(const int &scc_index)
 
 int32_t Graph::getMergedOrders_()
 {
-    // 1) SCC + condensation once
-    findSCCs(); // one rep per SCC
-    buildTransactionSCCMap();
-    buildCondensationGraph();
-    int sccs_count = sccs.size();
-
-    // 2) compute out-degrees and seed ready queue
-    std::vector<int> out_degrees(sccs_count);
-    std::queue<int> Q;
-
-    for (int c = 0; c < sccs_count; ++c)
+    // 1) bring the SCCs up to date; incrementally maintained SCCs only need the touched ones
+    if (!incremental_scc)
     {
-        out_degrees[c] = neighbors_out[c].size();
+        rebuildSCCs();
     }
 
-    for (int c = 0; c < sccs_count; ++c)
+    // 2) seed ready queue with the complete sink SCCs
+    std::queue<int> Q;
+
+    for (int c : candidate_sccs)
     {
-        if (out_degrees[c] == 0 && isSCCComplete(c))
+        if (isSCCComplete(c))
         {
             Q.push(c);
         }
     }
+    candidate_sccs.clear();
 
     int32_t transaction_count = 0;
 
@@ -406,7 +709,7 @@ int32_t Graph::getMergedOrders_()
     {
         int c = Q.front();
         Q.pop();
-        auto &comp = sccs[c];
+        auto &comp = components[c].members;
 
         if (comp.size() > 1)
         {
@@ -428,13 +731,17 @@ int32_t Graph::getMergedOrders_()
 
         for (Transaction *T : comp)
         {
-            if (auto up = removeTransaction(T))
+            if (removeTransaction(T))
             {
+                // the snapshot only needs the ids, so let go of the round's arena first
+                T->dropPayload();
+
                 // push the removed transaction into the merged order queue
                 {
                     std::lock_guard<std::mutex> lock(snapshot_mtx);
-                    merged.push(*up);
+                    merged.push(*T);
                 }
+                pool.release(T);
                 transaction_count++;
             }
         }
@@ -451,9 +758,14 @@ int32_t Graph::getMergedOrders_()
         //     std::cout << std::endl;
         // }
 
-        for (int p : neighbors_in[c])
+        std::unordered_set<int> preds = std::move(components[c].neighbors_in);
+        components[c] = Component{};
+        free_components.push_back(c);
+
+        for (int p : preds)
         {
-            if (--out_degrees[p] == 0 && isSCCComplete(p))
+            components[p].neighbors_out.erase(c);
+            if (isSCCComplete(p))
             {
                 Q.push(p);
             }
@@ -472,15 +784,12 @@ void Graph::buildSnapshotProto(request::GraphSnapshot &snap) const
 
     for (const auto &kv : nodes_static)
     {
-        const std::string &tx_id = kv.first;
-        Transaction *tx = kv.second.get();
-
         request::VertexAdj *va = snap.add_adj();
-        va->set_tx_id(tx_id);
+        va->set_tx_id(kv.first);
 
-        for (Transaction *nbr : tx->getOutNeighbors())
+        for (const std::string &nbr : kv.second)
         {
-            va->add_out(nbr->getID());
+            va->add_out(nbr);
         }
     }
 
@@ -501,115 +810,105 @@ void Graph::buildSnapshotProto(request::GraphSnapshot &snap) const
 std::vector<Transaction*> Graph::getAllNodes() const
 {
     std::vector<Transaction*> result;
-    result.reserve(nodes.size());
-    for (const auto& kv : nodes)
+    result.reserve(node_count);
+    for (const auto& node : nodes)
     {
-        result.push_back(kv.second.get());
+        if (node)
+            result.push_back(node);
     }
     return result;
 }
 
-void Graph::add_MRW(DataItem item, Transaction* txn)
+void Graph::reserveKey(KeyId key)
 {
-    // add or update the most recent writer for a data item
-
-    // std::cout << "Graph::add_MRW: adding most recent writer for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ") to transaction " << txn->getID() << std::endl;
-
-    most_recent_writer[item] = txn;
+    if (key >= most_recent_writer.size())
+    {
+        most_recent_writer.resize(key + 1, INVALID_TXN_HANDLE);
+        most_recent_readers.resize(key + 1);
+    }
+}
 
-    // std::cout << "Graph::add_MRW: set most recent writer for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ") to transaction " << txn->getID() << std::endl;
+void Graph::add_MRW(KeyId key, Transaction* txn)
+{
+    // add or update the most recent writer for a data item
+    reserveKey(key);
+    most_recent_writer[key] = txn->getHandle();
 
+    // std::cout << "Graph::add_MRW: set most recent writer for key " << key
+    //           << " to transaction " << txn->getID() << std::endl;
 }
 
-void Graph::remove_MRW(DataItem item)
+void Graph::remove_MRW(KeyId key)
 {
-    // remove the data item from the most recent writer map
-    most_recent_writer.erase(item);
-    // std::cout << "Graph::remove_MRW: removed most recent writer for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ")\n";
-
+    // forget the most recent writer of the data item
+    if (key < most_recent_writer.size())
+    {
+        most_recent_writer[key] = INVALID_TXN_HANDLE;
+    }
+    // std::cout << "Graph::remove_MRW: removed most recent writer for key " << key << "\n";
 }
 
-std::string Graph::getMostRecentWriterID(DataItem item)
+TxnHandle Graph::getMostRecentWriterID(KeyId key) const
 {
-    auto it = most_recent_writer.find(item);
-    if (it != most_recent_writer.end() && it->second != nullptr)
-    {
-        // std::cout << "Graph::getMostRecentWriterID: most recent writer for data item ("
-        //           << item.val << ", " << item.primaryCopyID
-        //           << ") is transaction " << it->second->getID() << std::endl;
-        return it->second->getID();
-    }
-    // std::cout << "Graph::getMostRecentWriterID: no most recent writer for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ")\n";
-    return ""; // return empty string if no writer found
+    if (key < most_recent_writer.size())
+    {
+        return most_recent_writer[key];
+    }
+    return INVALID_TXN_HANDLE; // no writer found
 }
 
-void Graph::add_MRR(DataItem item, const std::string& txn_id)
+void Graph::add_MRR(KeyId key, TxnHandle txn_id)
 {
-    // add the txn_id to the set of most recent readers for the data item if not already present
-    // if set does not exist, create it
-    
-    most_recent_readers[item].emplace(txn_id);
+    // add the txn_id to the most recent readers of the data item if not already present
+    reserveKey(key);
+    auto &readers = most_recent_readers[key];
+    if (std::find(readers.begin(), readers.end(), txn_id) == readers.end())
+    {
+        readers.push_back(txn_id);
+    }
 
     // std::cout << "Graph::add_MRR: added transaction " << txn_id
-    //           << " to most recent readers for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ")\n";
-
+    //           << " to most recent readers for key " << key << "\n";
 }
 
-void Graph::remove_MRR(DataItem item, const std::string& txn_id)
+void Graph::remove_MRR(KeyId key, TxnHandle txn_id)
 {
-    // remove the txn_id from the set of most recent readers for the data item
-    auto it = most_recent_readers.find(item);
-    if (it != most_recent_readers.end())
+    // remove the txn_id from the most recent readers of the data item; order does not matter
+    if (key >= most_recent_readers.size())
     {
-        it->second.erase(txn_id);
-        // if the set becomes empty, remove the entry from the map
-        if (it->second.empty())
-        {
-            most_recent_readers.erase(it);
-        }
+        return;
     }
 
-    // std::cout << "Graph::remove_MRR: removed transaction " << txn_id
-    //           << " from most recent readers for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ")\n";
+    auto &readers = most_recent_readers[key];
+    auto it = std::find(readers.begin(), readers.end(), txn_id);
+    if (it != readers.end())
+    {
+        *it = readers.back();
+        readers.pop_back();
+    }
 
+    // std::cout << "Graph::remove_MRR: removed transaction " << txn_id
+    //           << " from most recent readers for key " << key << "\n";
 }
 
-std::unordered_set<std::string> Graph::getMostRecentReadersIDs(DataItem item)
+const std::vector<TxnHandle>& Graph::getMostRecentReadersIDs(KeyId key) const
 {
-    auto it = most_recent_readers.find(item);
-    if (it != most_recent_readers.end())
-    {
-        // std::cout << "Graph::getMostRecentReadersIDs: most recent readers for data item ("
-        //           << item.val << ", " << item.primaryCopyID
-        //           << ") are:";
-        // for (const auto& reader_id : it->second)
-        // {
-        //     std::cout << " " << reader_id;
-        // }
-        // std::cout << std::endl;  
+    static const std::vector<TxnHandle> no_readers;
 
-        return it->second;
+    if (key < most_recent_readers.size())
+    {
+        return most_recent_readers[key];
     }
-    return {}; // return empty set if no readers found
+    return no_readers; // no readers found
 }
 
-void Graph::clearMRRIds(DataItem item)
+void Graph::clearMRRIds(KeyId key)
 {
-    most_recent_readers.erase(item);
+    // keeps the buffer, the key is likely to be read again
+    if (key < most_recent_readers.size())
+    {
+        most_recent_readers[key].clear();
+    }
 
-    // std::cout << "Graph::clearMRRIds: cleared most recent readers for data item ("
-    //           << item.val << ", " << item.primaryCopyID
-    //           << ")\n";
+    // std::cout << "Graph::clearMRRIds: cleared most recent readers for key " << key << "\n";
 }
@@ -6,7 +6,6 @@
 #include <string>
 #include <memory>
 #include <vector>
-#include <stack>
 #include <unordered_set>
 #include <mutex>
 #include <condition_variable>
@@ -14,57 +13,114 @@
 #include "transaction.h"
 #include "queueTS.h"
 #include "utils.h"
+#include "idInterner.h"
+#include "transactionPool.h"
 #include "../proto/graph_snapshot.pb.h"
 
 class Graph
 {
 private:
-    std::unordered_map<std::string, std::unique_ptr<Transaction>> nodes; // all nodes in the graph
-    std::unordered_map<std::string, std::unique_ptr<Transaction>> nodes_static; // all nodes in the graph
-    std::unordered_map<DataItem, Transaction *> most_recent_writer; // points to only one transaction per data item
-    std::unordered_map<DataItem, std::unordered_set<std::string>> most_recent_readers; // points to multiple transactions per data item
-
-    // Tarjan’s helpers
-    std::unordered_map<Transaction *, int> index_map, low_link_map;
-    std::unordered_set<Transaction *> on_stack;
-    std::stack<Transaction *> tarjan_stack;
-    int current_index = 0;
+    IdInterner ids;                                      // transaction id <-> handle
+    TransactionPool pool;                                // owns every node below
+    std::vector<Transaction *> nodes;                    // all nodes in the graph, indexed by handle
+    size_t node_count = 0;
+    std::unordered_map<std::string, std::vector<std::string>> nodes_static; // every node ever added -> its out neighbor ids, for snapshots
+    std::vector<TxnHandle> most_recent_writer;               // by key id, INVALID_TXN_HANDLE if none
+    std::vector<std::vector<TxnHandle>> most_recent_readers; // by key id
+
+    void reserveKey(KeyId key); // grows the MRW/MRR tables to cover key
+
+    // Tarjan’s helpers (full recomputation, only used when incremental_scc is off)
+    // Handles double as dense node indices, so the per-node state lives in flat arrays;
+    // the DFS keeps its own call stack so long dependency chains cannot overflow ours.
+    struct TarjanFrame
+    {
+        int32_t v;
+        int32_t next_edge; // next position in tarjan_edges to look at
+    };
+    std::vector<int32_t> tarjan_edge_begin;       // CSR offsets into tarjan_edges, n + 1 entries
+    std::vector<int32_t> tarjan_edges;            // successors as dense indices
+    std::vector<int32_t> index_of, low_link;
+    std::vector<char> on_stack;
+    std::vector<int32_t> tarjan_stack;
+    std::vector<TarjanFrame> call_stack;
+    int32_t current_index = 0;
     std::vector<std::vector<Transaction *>> sccs;
 
-    void strongConnect(Transaction *v);
+    void strongConnect(int32_t root);
 
     // SCC helper
-    std::unordered_map<Transaction *, int> txn_scc_index_map; // maps each transaction to its SCC index
-    std::vector<std::unordered_set<int>> neighbors_out;       // outgoing edges of each SCC (indexed by SCC index)
-    std::vector<std::vector<int>> neighbors_in;               // incoming edges of each SCC (indexed by SCC index)
+    // Every live transaction belongs to exactly one component. Components are kept in a
+    // topological order of the condensation DAG (every edge points to a larger ord), which
+    // lets addNeighborOut only look at the components between the two endpoints of an edge.
+    struct Component
+    {
+        std::vector<Transaction *> members;
+        std::unordered_set<int> neighbors_out; // outgoing edges of this SCC
+        std::unordered_set<int> neighbors_in;  // incoming edges of this SCC
+        int64_t ord = 0;
+        uint64_t mark_f = 0, mark_b = 0; // visit marks for the bounded searches
+        bool alive = false;
+    };
+
+    std::vector<int> txn_scc_index; // maps each transaction handle to its SCC index
+    std::vector<Component> components;
+    std::vector<int> free_components;
+    std::unordered_set<int> candidate_sccs; // SCCs touched since the last merge pass
+    int64_t next_ord = 0;                   // new SCCs are placed before every existing one
+    uint64_t visit_epoch = 0;
+    bool incremental_scc = true;
+
+    int newComponent(Transaction *txn);
+    void addComponentEdge(int from, int to);
+    void reorderComponents(int from, int to);
+    int collapseComponents(const std::vector<int> &cycle);
+
     mutable std::mutex snapshot_mtx;                                // protects nodes_static + merged snapshot data
 
     Queue_TS<Transaction> merged;
 
 public:
-    Transaction *addNode(std::unique_ptr<Transaction> uptr);
-    Transaction *getNode(const std::string &uuid);
+    // Handles are assigned on the insert thread when a transaction goes into the graph, and
+    // released there once it is merged.
+    TxnHandle internID(const std::string &id) { return ids.intern(id); }
+    TxnHandle findID(const std::string &id) const { return ids.find(id); }
+
+    Transaction *addNode(const Transaction &txn);
+    Transaction *getNode(TxnHandle handle) const
+    {
+        return handle < nodes.size() ? nodes[handle] : nullptr;
+    }
     std::vector<Transaction*> getAllNodes() const;
     void addNeighborOut(Transaction* from, Transaction* to);
+    void addSeenRegion(Transaction *txn, int32_t region);
 
-    void add_MRW(DataItem item, Transaction* txn); // probably only used by insert algo
-    void remove_MRW(DataItem item); // probably only used when we remove a transaction from the graph
-    std::string getMostRecentWriterID(DataItem item);
-    void add_MRR(DataItem item, const std::string& txn_id); // probably only used by insert algo
-    void remove_MRR(DataItem item, const std::string& txn_id); // probably only used when we remove a transaction from the graph
-    std::unordered_set<std::string> getMostRecentReadersIDs(DataItem item);
-    void clearMRRIds(DataItem item);
+    void add_MRW(KeyId key, Transaction* txn); // probably only used by insert algo
+    void remove_MRW(KeyId key); // probably only used when we remove a transaction from the graph
+    TxnHandle getMostRecentWriterID(KeyId key) const;
+    void add_MRR(KeyId key, TxnHandle txn); // probably only used by insert algo
+    void remove_MRR(KeyId key, TxnHandle txn); // probably only used when we remove a transaction from the graph
+    const std::vector<TxnHandle>& getMostRecentReadersIDs(KeyId key) const; // valid until the next MRR update
+    void clearMRRIds(KeyId key);
 
     void printAll() const;
-    bool isEmpty() const { return nodes.empty(); }
+    bool isEmpty() const { return node_count == 0; }
     void clear();
-    std::unique_ptr<Transaction> removeTransaction(Transaction *rem);
+    bool removeTransaction(Transaction *rem);
+    TransactionPoolStats getPoolStats() const { return pool.stats(); }
 
     void findSCCs();
     void buildTransactionSCCMap();
     void buildCondensationGraph();
+    void rebuildSCCs();
     bool isSCCComplete(const int &scc_index);
 
+    // When off, every merge pass recomputes the SCCs of the whole graph from scratch
+    // (findSCCs + condensation) instead of maintaining them as edges are added.
+    void setIncrementalSCC(bool on);
+    size_t sccCount() const { return components.size() - free_components.size(); }
+    size_t size() const { return node_count; }
+
     int32_t getMergedOrders_();
 
     // Build a GraphSnapshot protobuf message representing the current graph.
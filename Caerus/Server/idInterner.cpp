@@ -0,0 +1,60 @@
+#include "idInterner.h"
+
+TxnHandle IdInterner::intern(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto it = handles.find(id);
+    if (it != handles.end())
+    {
+        return it->second;
+    }
+
+    TxnHandle handle;
+    if (!free_handles.empty())
+    {
+        handle = free_handles.back();
+        free_handles.pop_back();
+        ids[handle] = id;
+    }
+    else
+    {
+        handle = static_cast<TxnHandle>(ids.size());
+        ids.push_back(id);
+    }
+
+    handles.emplace(id, handle);
+    return handle;
+}
+
+TxnHandle IdInterner::find(const std::string &id) const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = handles.find(id);
+    return it == handles.end() ? INVALID_TXN_HANDLE : it->second;
+}
+
+std::string IdInterner::name(TxnHandle handle) const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return handle < ids.size() ? ids[handle] : std::string();
+}
+
+void IdInterner::release(TxnHandle handle)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if (handle >= ids.size() || ids[handle].empty())
+    {
+        return;
+    }
+
+    handles.erase(ids[handle]);
+    ids[handle].clear();
+    free_handles.push_back(handle);
+}
+
+size_t IdInterner::size() const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return handles.size();
+}
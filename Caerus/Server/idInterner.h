@@ -0,0 +1,38 @@
+#ifndef ID_INTERNER_H
+#define ID_INTERNER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include "transaction.h"
+
+// Maps client-supplied transaction IDs to compact handles. Handles are dense
+// (0, 1, 2, ...) and are recycled once released, so anything indexed by a
+// handle can live in a plain vector.
+class IdInterner
+{
+private:
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, TxnHandle> handles; // id -> handle
+    std::vector<std::string> ids;                       // handle -> id
+    std::vector<TxnHandle> free_handles;
+
+public:
+    // Returns the handle for id, assigning a new one the first time it is seen.
+    TxnHandle intern(const std::string &id);
+
+    // Returns the handle for id or INVALID_TXN_HANDLE if it is not interned.
+    TxnHandle find(const std::string &id) const;
+
+    // Returns the id behind a live handle (empty if the handle is not in use).
+    std::string name(TxnHandle handle) const;
+
+    // Forgets the id; the handle may be given to another id afterwards.
+    void release(TxnHandle handle);
+
+    size_t size() const;
+};
+
+#endif // ID_INTERNER_H
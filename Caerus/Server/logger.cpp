@@ -75,14 +75,14 @@ void Logger::logMergedOrders()
 
                 if (op.type == OperationType::WRITE) {
                     // write operation
-                    auto it = mockDB_logging.find(op.key);
+                    auto it = mockDB_logging.find(std::string(op.key));
                     if (it != mockDB_logging.end()) {
                         it->second.val = op.value; // update value
                     }
 
                 } else if (op.type == OperationType::READ) {
                     // read operation, we can log or ignore it as needed
-                    auto it = mockDB_logging.find(op.key);
+                    auto it = mockDB_logging.find(std::string(op.key));
                     if (it != mockDB_logging.end()) {
                         // log read operation if necessary
                     }
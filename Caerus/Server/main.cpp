@@ -10,6 +10,9 @@
 #include "merger.h"
 #include "graph.h"
 #include "logger.h"
+#include "transport.h"
+#include "connectionManager.h"
+#include "regionRelay.h"
 
 
 int main(int argc, char *argv[])
@@ -33,6 +36,16 @@ int main(int argc, char *argv[])
     getServers();
     int num_servers = servers.size();
 
+    // the transport has to exist before anything sends or listens
+    Transport *transport = makeTransport(TRANSPORT_BACKEND, IO_THREADS);
+    setTransport(transport);
+
+    // every outbound peer connection goes through here
+    setConnectionManager(new ConnectionManager(servers, my_id));
+
+    // partial sequences to other regions go through the relays
+    if (REGION_RELAY)
+        setRegionRelay(new RegionRelay(servers, my_id));
     
 
     // run batcher
@@ -58,9 +71,23 @@ int main(int argc, char *argv[])
     printf("Listening for peers on port %d\n", peer_port);
     printf("Listening for clients on port %d\n", client_port);
 
-    // start listeners
-    PeerListener peer_listener(peer_listenfd, &partial_sequencer, &merger);
-    ClientListener client_listener(client_listenfd, &merger);
+    // peers on this machine connect over a unix socket instead
+    int local_listenfd = -1;
+    for (auto &server : servers)
+    {
+        if (LOCAL_SOCKETS && isColocated(server))
+        {
+            std::string path = localSocketPath(my_id);
+            local_listenfd = setupLocalListenfd(path);
+            listen(local_listenfd, 5);
+            printf("Listening for local peers on %s\n", path.c_str());
+            break;
+        }
+    }
+
+    // start listeners, all connections are served by the transport's I/O threads
+    PeerListener peer_listener(peer_listenfd, local_listenfd, &partial_sequencer, &merger, transport);
+    ClientListener client_listener(client_listenfd, &merger, transport);
 
     Coordinator coordinator;
 
@@ -74,6 +101,8 @@ int main(int argc, char *argv[])
 
     close(peer_listenfd);
     close(client_listenfd);
+    if (local_listenfd >= 0)
+        close(local_listenfd);
 
     return 0;
 }
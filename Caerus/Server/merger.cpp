@@ -1,81 +1,477 @@
 #include "merger.h"
 #include "utils.h"
 
+#include "connectionManager.h"
 #include "logger.h"
+#include "roundArena.h"
+#include "transport.h"
 
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
 #include <string>
 #include <sstream>
 
+namespace
+{
+    constexpr std::chrono::seconds REPORT_PERIOD{5};
+
+    constexpr std::chrono::milliseconds ROUND_PERIOD{50};
+    constexpr std::chrono::milliseconds ROUND_GRACE{100}; // how long to wait for servers that sent nothing for a round
+
+    constexpr std::chrono::seconds SNAPSHOT_SEND_TIMEOUT{5}; // a client slower than this is dropped
+
+    // Writes all of buf on fd unless deadline passes first.
+    bool writeBefore(int fd, const std::string &buf, std::chrono::steady_clock::time_point deadline)
+    {
+        const char *p = buf.data();
+        size_t left = buf.size();
+        while (left)
+        {
+            ssize_t w = ::send(fd, p, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (wait.count() <= 0)
+                    return false;
+                pollfd pfd{fd, POLLOUT, 0};
+                if (poll(&pfd, 1, int(wait.count())) < 0 && errno != EINTR)
+                    return false;
+                continue;
+            }
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+            left -= w;
+            p += w;
+        }
+        return true;
+    }
+
+    constexpr size_t BODY_SWEEP_EVERY = 4096;    // bodies cached between looks for stale ones
+    constexpr int32_t BODY_MAX_AGE_ROUNDS = 600; // a body nothing named for this long is dropped
+    constexpr std::chrono::seconds BODY_WAIT{2};     // a parked sequence asks again for bodies missing this long, and every BODY_WAIT after
+    constexpr std::chrono::seconds BODY_GIVE_UP{10}; // about as long as a partial sequencer keeps what it could send again
+    constexpr std::chrono::milliseconds PARK_CHECK{100};
+
+    // a transaction touches a handful of keys, so a linear scan beats hashing
+    using KeySet = SmallVector<KeyId, 8>;
+
+    // a partial sequence whose transactions take their operations from the bodies kept for them
+    bool namesOnly(const PartialSequenceMsg &msg)
+    {
+        return (msg.flat ? msg.flat->target_server_id() : msg.req->target_server_id()) == NAMES_ONLY;
+    }
+}
+
 void Merger::popFromQueue()
 {
+    auto last_park_check = std::chrono::steady_clock::now();
     while (true)
     {
-        // wait on the local queue’s CV, then pop
-        request::Request req_proto;
+        // wait on the local queue’s CV, then pop; while sequences are parked, look at them now and then
+        PartialSequenceMsg msg;
+        bool popped = false;
         {
             std::unique_lock<std::mutex> local_lock(partial_sequencer_to_merger_queue_mtx);
-            partial_sequencer_to_merger_queue_cv.wait(local_lock, []
-                                                      { return !partial_sequencer_to_merger_queue_.empty(); });
-            req_proto = partial_sequencer_to_merger_queue_.pop();
+            auto ready = []
+            { return !partial_sequencer_to_merger_queue_.empty(); };
+            if (parked.empty())
+                partial_sequencer_to_merger_queue_cv.wait(local_lock, ready);
+            else
+                partial_sequencer_to_merger_queue_cv.wait_for(local_lock, PARK_CHECK, ready);
+
+            if (ready())
+            {
+                msg = partial_sequencer_to_merger_queue_.pop();
+                popped = true;
+            }
         }
 
-        processRequest(req_proto);
+        // parked sequences that waited out BODY_WAIT go on, however busy the queue is
+        auto now = std::chrono::steady_clock::now();
+        if (!parked.empty() && now - last_park_check >= PARK_CHECK)
+        {
+            last_park_check = now;
+            releaseParked(now);
+        }
+        if (!popped)
+            continue;
+
+        if (msg.body)
+        {
+            // sequences held back for it may be complete now, oldest first
+            cacheBody(msg.req);
+            releaseParked(now);
+            continue;
+        }
+
+        // a server's partial sequences stay in order behind one that is still missing bodies
+        int sid = msg.flat ? msg.flat->server_id() : msg.req->server_id();
+        auto it = parked.find(sid);
+        if (it != parked.end() || !bodiesReady(msg))
+        {
+            Parked &p = parked[sid];
+            if (p.waiting.empty())
+                p.head_since = now;
+            p.waiting.push_back(std::move(msg));
+            continue;
+        }
+
+        dispatch(msg);
     }
 }
 
-void Merger::processRequest(const request::Request &req_proto)
+void Merger::releaseParked(std::chrono::steady_clock::time_point now)
 {
-
-    if (req_proto.transaction_size() > 0)
+    for (auto it = parked.begin(); it != parked.end();)
     {
-        // Log the request
-        std::ofstream logf("./merger_logs/merger_log" + std::to_string(my_id) + ".jsonl", std::ios::app);
-        if (logf)
+        Parked &p = it->second;
+        while (!p.waiting.empty())
         {
-            logf << "{\"server\":" << req_proto.server_id()
-                 << ",\"round\":" << req_proto.round()
-                 << ",\"txns\":[";
-            for (int i = 0; i < req_proto.transaction_size(); ++i)
+            const PartialSequenceMsg &head = p.waiting.front();
+            if (!bodiesReady(head))
             {
-                logf << "\"" << req_proto.transaction(i).id() << "\"";
-                if (i + 1 < req_proto.transaction_size())
+                // a body was lost on the way (a failed write drops its frame): the server that named it sends it again
+                if (now - p.head_since >= BODY_WAIT && now - p.asked >= BODY_WAIT && askForBodies(it->first, head))
+                    p.asked = now;
+
+                // without it, this server's transactions could never be merged the way the others merge them
+                if (now - p.head_since >= BODY_GIVE_UP)
                 {
-                    logf << ",";
+                    std::vector<std::string> missing = missingBodies(head);
+                    fprintf(stderr, "MERGER: partial sequence of server %d round %d still misses %zu bodies (%s, ...) "
+                                    "after %llds, giving up\n",
+                            it->first, head.flat ? head.flat->round() : head.req->round(), missing.size(),
+                            missing[0].c_str(), (long long)BODY_GIVE_UP.count());
+                    exit(1);
                 }
+                break;
             }
-            logf << "]}\n";
+
+            dispatch(head);
+            p.waiting.pop_front();
+            p.head_since = now;
+            p.asked = {};
         }
+
+        if (p.waiting.empty())
+            it = parked.erase(it);
         else
+            ++it;
+    }
+}
+
+bool Merger::askForBodies(int sid, const PartialSequenceMsg &msg)
+{
+    ConnectionManager::Lease lease = getConnectionManager()->tryAcquire(sid);
+    if (!lease)
+        return false; // at the next look
+
+    std::vector<std::string> missing = missingBodies(msg);
+
+    request::Request ask;
+    ask.set_recipient(request::Request::PARTIAL);
+    ask.set_server_id(my_id);
+    ask.set_target_server_id(BODIES_WANTED);
+    ask.set_round(msg.flat ? msg.flat->round() : msg.req->round());
+    for (const std::string &id : missing)
+        ask.add_transaction()->set_id(id);
+
+    fprintf(stderr, "MERGER: partial sequence of server %d round %d misses %zu bodies (%s, ...), asking for them again\n",
+            sid, ask.round(), missing.size(), missing[0].c_str());
+
+    std::string frame;
+    if (!ask.SerializeToString(&frame))
+    {
+        perror("SerializeToString failed");
+        return false;
+    }
+    if (!sendFrame(lease.fd(), frame))
+    {
+        perror("sendFrame failed");
+        // connection broken, the manager reconnects
+        lease.broken();
+        return false;
+    }
+    return true;
+}
+
+void Merger::dispatch(const PartialSequenceMsg &msg)
+{
+    if (msg.flat)
+        processFlat(msg.flat);
+    else
+        processRequest(msg.req);
+}
+
+void Merger::cacheBody(const SharedRequest &req)
+{
+    if (req->transaction_size() == 0)
+        return;
+    const request::Transaction &txn = req->transaction(0);
+
+    // named once by the partial sequence of every region it touches, but for this one's own
+    RegionSet regions;
+    for (const auto &op : txn.operations())
+    {
+        auto it = mockDB_key_ids.find(op.key());
+        if (it != mockDB_key_ids.end())
+            regions.set(mockDB_primaries[it->second]);
+    }
+    regions.reset(my_id);
+    if (regions.none())
+        return;
+
+    // the same id again (a client retrying it): every name of either one takes a body
+    CachedBody &cached = bodies[txn.id()];
+    cached.refs_left = (cached.req ? cached.refs_left : 0) + int(regions.count());
+    cached.req = req;
+    cached.round = req->batcher_round();
+
+    // bodies whose names never came (a peer lost them) go after a while
+    if (++bodies_since_sweep >= BODY_SWEEP_EVERY)
+    {
+        bodies_since_sweep = 0;
+
+        // but not one a parked sequence is waiting to take
+        std::unordered_set<std::string> named;
+        for (const auto &entry : parked)
         {
-            std::cerr << "MERGER: failed to open log file ./merger_logs/merger_log.jsonl\n";
+            for (const PartialSequenceMsg &msg : entry.second.waiting)
+            {
+                if (msg.flat)
+                {
+                    for (uint32_t i = 0; i < msg.flat->transaction_size(); ++i)
+                        named.emplace(msg.flat->transaction(i).id);
+                }
+                else
+                {
+                    for (const auto &t : msg.req->transaction())
+                        named.insert(t.id());
+                }
+            }
+        }
+
+        size_t dropped = 0;
+        for (auto it = bodies.begin(); it != bodies.end();)
+        {
+            if (it->second.round < req->batcher_round() - BODY_MAX_AGE_ROUNDS && !named.count(it->first))
+            {
+                it = bodies.erase(it);
+                ++dropped;
+            }
+            else
+            {
+                ++it;
+            }
         }
+        if (dropped)
+            fprintf(stderr, "MERGER: dropped %zu transaction bodies nothing named\n", dropped);
     }
+}
 
-    const int sid = req_proto.server_id();
-    auto it = partial_sequences.find(sid);
+bool Merger::bodiesReady(const PartialSequenceMsg &msg) const
+{
+    if (!namesOnly(msg))
+        return true;
+
+    if (msg.flat)
+    {
+        for (uint32_t i = 0; i < msg.flat->transaction_size(); ++i)
+        {
+            if (!bodies.count(std::string(msg.flat->transaction(i).id)))
+                return false;
+        }
+        return true;
+    }
+
+    for (const auto &txn : msg.req->transaction())
+    {
+        if (!bodies.count(txn.id()))
+            return false;
+    }
+    return true;
+}
+
+std::vector<std::string> Merger::missingBodies(const PartialSequenceMsg &msg) const
+{
+    std::vector<std::string> missing;
+    if (!namesOnly(msg))
+        return missing;
+
+    auto note = [&](std::string id)
+    {
+        if (!bodies.count(id))
+            missing.push_back(std::move(id));
+    };
+    if (msg.flat)
+    {
+        for (uint32_t i = 0; i < msg.flat->transaction_size(); ++i)
+            note(std::string(msg.flat->transaction(i).id));
+        return missing;
+    }
+
+    for (const auto &txn : msg.req->transaction())
+        note(txn.id());
+    return missing;
+}
+
+SharedRequest Merger::takeBody(const std::string &id)
+{
+    auto it = bodies.find(id);
+    if (it == bodies.end())
+        return nullptr;
+
+    SharedRequest req = it->second.req;
+    if (--it->second.refs_left == 0)
+        bodies.erase(it);
+    return req;
+}
+
+void Merger::processRequest(const SharedRequest &req)
+{
+    const request::Request &req_proto = *req;
 
-    if (it == partial_sequences.end())
+    const int sid = req_proto.server_id();
+    if (partial_sequences.find(sid) == partial_sequences.end())
     {
         // unknown server id
         std::cerr << "MERGER: Unknown server ID " << req_proto.server_id() << " in processRequest" << std::endl;
         return;
     }
 
-    auto &q = it->second; // get the Queue_TS<Transaction> for this server
     std::vector<Transaction> transactions;
+    const bool names_only = req_proto.target_server_id() == NAMES_ONLY;
 
-    for (const auto &txn_proto : req_proto.transaction())
+    for (const auto &named : req_proto.transaction())
     {
+        // only the name came (payload dedup): the operations are in the body kept for it
+        SharedRequest payload = req;
+        if (names_only)
+        {
+            payload = takeBody(named.id());
+            if (!payload)
+            {
+                // sequences are only dispatched with their bodies in, so it was named more often than sent
+                std::cerr << "MERGER: no body for transaction " << named.id() << " from server " << sid << std::endl;
+                exit(1);
+            }
+        }
+        const request::Transaction &txn_proto = payload == req ? named : payload->transaction(0);
+
         std::vector<Operation> operations = getOperationsFromProtoTransaction(txn_proto);
 
-        Transaction txn(txn_proto.random_stamp(), req_proto.server_id(), operations, txn_proto.id());
+        Transaction txn(named.random_stamp(), req_proto.server_id(), operations, named.id());
+        txn.setPayload(payload);
 
-        transactions.push_back(txn);
+        transactions.push_back(std::move(txn));
 
         // std::cout << "MERGER: pushed txn " << txn.getID() << " from server " << sid << " into its queue" << std::endl;
     }
 
+    enqueuePartialSequence(sid, req_proto.round(), transactions);
+}
+
+void Merger::processFlat(const SharedFlatRequest &req)
+{
+    const int sid = req->server_id();
+    if (partial_sequences.find(sid) == partial_sequences.end())
+    {
+        std::cerr << "MERGER: Unknown server ID " << sid << " in processFlat" << std::endl;
+        return;
+    }
+
+    std::vector<Transaction> transactions;
+    transactions.reserve(req->transaction_size());
+    const bool names_only = req->target_server_id() == NAMES_ONLY;
+
+    // nothing to decode: key ids are taken as they are, values point into the frame
+    for (uint32_t i = 0; i < req->transaction_size(); ++i)
+    {
+        FlatRequest::Txn flat_txn = req->transaction(i);
+        std::string id(flat_txn.id);
+
+        if (names_only)
+        {
+            // only the name came: the operations are in the body kept for it
+            SharedRequest body = takeBody(id);
+            if (!body)
+            {
+                // sequences are only dispatched with their bodies in, so it was named more often than sent
+                std::cerr << "MERGER: no body for transaction " << id << " from server " << sid << std::endl;
+                exit(1);
+            }
+            Transaction txn(flat_txn.random_stamp, sid, getOperationsFromProtoTransaction(body->transaction(0)), id);
+            txn.setPayload(body);
+            transactions.push_back(std::move(txn));
+            continue;
+        }
+
+        std::vector<Operation> operations(flat_txn.op_count);
+        for (uint32_t k = 0; k < flat_txn.op_count; ++k)
+        {
+            FlatRequest::Op op = req->operation(flat_txn.first_op + k);
+            operations[k].type = op.type;
+            operations[k].key_id = op.key_id;
+            operations[k].key = mockDB_keys[op.key_id];
+            if (op.has_value && op.type == OperationType::WRITE)
+                operations[k].value = op.value;
+        }
+
+        Transaction txn(flat_txn.random_stamp, sid, operations, id);
+        txn.setPayload(req);
+
+        transactions.push_back(std::move(txn));
+    }
+
+    enqueuePartialSequence(sid, req->round(), transactions);
+}
+
+void Merger::enqueuePartialSequence(int sid, int32_t round, std::vector<Transaction> &transactions)
+{
+    if (!transactions.empty())
+    {
+        // Log the request
+        std::ofstream logf("./merger_logs/merger_log" + std::to_string(my_id) + ".jsonl", std::ios::app);
+        if (logf)
+        {
+            logf << "{\"server\":" << sid
+                 << ",\"round\":" << round
+                 << ",\"txns\":[";
+            for (size_t i = 0; i < transactions.size(); ++i)
+            {
+                logf << "\"" << transactions[i].getID() << "\"";
+                if (i + 1 < transactions.size())
+                {
+                    logf << ",";
+                }
+            }
+            logf << "]}\n";
+        }
+        else
+        {
+            std::cerr << "MERGER: failed to open log file ./merger_logs/merger_log.jsonl\n";
+        }
+    }
+
+    if (merge_mode == MergeMode::ROUND_ALIGNED)
+    {
+        std::lock_guard<std::mutex> g(ready_mtx);
+        auto &latest = latest_round[sid];
+        latest = std::max(latest, round);
+
+        round_heap.push_back({round, sid, std::move(transactions)});
+        std::push_heap(round_heap.begin(), round_heap.end(), CompareByRound());
+        ready_cv.notify_one();
+        return;
+    }
+
+    auto &q = partial_sequences.at(sid); // get the Queue_TS<Transaction> for this server
     q->push(transactions);
 
     {
@@ -90,206 +486,324 @@ void Merger::processRequest(const request::Request &req_proto)
     }
 }
 
-void Merger::insertAlgorithm()
+void Merger::insertPartialSequence(int sid, std::vector<Transaction> &transactions)
 {
-    std::unique_lock<std::mutex> lk(ready_mtx); // initialize lock for ready queue
+    // the primary set of this server is every key whose primary copy lives
+    // here, which mockDB_primaries answers directly by key id
+    auto inPrimarySet = [sid](KeyId key)
+    {
+        return mockDB_primaries[key] == sid;
+    };
 
-    while (true)
+    // process each transaction
+    for (auto &txn : transactions)
     {
-        ready_cv.wait(lk, [this]() { return !ready_q_.empty(); }); // wait until there is work to do
+        // std::cout << "INSERT::Transaction: " << txn.getID() << std::endl;
 
-        int sid = ready_q_.front();
-        ready_q_.pop_front();
-        enqueued_sids_.erase(sid);
+        KeySet write_set;
+        KeySet read_set;
+        RegionSet expected_regions;
 
-        lk.unlock(); // unlock ready queue mutex while working
+        // setup the read and write set for the current transaction
+        for (const auto &op : txn.getOperations())
+        {
+            if (op.key_id == INVALID_KEY_ID)
+            {
+                std::cout << "INSERT::ReadWriteSet: key " << op.key << " not found" << std::endl;
+                continue;
+            }
 
-        auto it = partial_sequences.find(sid);
-        auto &inner_map = it->second;
+            if (op.type == OperationType::WRITE)
+            {
+                write_set.insertUnique(op.key_id);
+            }
+            else if (op.type == OperationType::READ)
+            {
+                read_set.insertUnique(op.key_id);
+            }
 
-        if (inner_map->empty())
-        {
-            lk.lock(); // lock before going back to
-            continue;
+            expected_regions.set(mockDB_primaries[op.key_id]); // add primary copy id to expected regions
+
+            // pritn read and write set
+            // std::cout << "INSERT::ReadWriteSet: key " << op.key << " type " << (op.type == OperationType::READ ? "READ" : "WRITE") << std::endl;
         }
 
-        auto transactions = inner_map->pop();
+        // interned here rather than when the sequence was popped: the handle of a merged
+        // transaction is released on this thread, so one taken earlier could name another node
+        txn.setHandle(graph.internID(txn.getID()));
+        auto curr_txn = graph.getNode(txn.getHandle());
 
-        std::unordered_set<DataItem> primary_set;
+        if (curr_txn == nullptr)
+        {
+            txn.setExpectedRegions(expected_regions);
+            txn.addSeenRegion(sid);
+            curr_txn = graph.addNode(txn);
+        }
+        else
+        {
+            graph.addSeenRegion(curr_txn, sid);
+        }
 
-        // setup the primary set for current server
-        for (const auto &txn : transactions)
+        // Read Set ∩ Primary Set
+        for (KeyId key : read_set)
         {
-            for (const auto &op : txn.getOperations())
-            {
-                auto db_it = mockDB.find(op.key);
+            if (!inPrimarySet(key))
+                continue;
 
-                if (db_it == mockDB.end())
-                {
-                    std::cout << "INSERT::PrimarySet: key " << op.key << " not found" << std::endl;
-                    continue;
-                }
+            // std::cout << "INSERT::READSET:" << key << " is in read and primary set" << std::endl;
 
-                auto data_item = db_it->second;
+            auto mrw_id = graph.getMostRecentWriterID(key);
+            auto mrw = graph.getNode(mrw_id);
 
-                if (data_item.primaryCopyID == sid)
-                {
-                    primary_set.insert(data_item);
-                }
+            if (mrw_id == INVALID_TXN_HANDLE)
+            { // no previous writer
+                // std::cout << "INSERT::READSET: no previous writer for data item ("
+                //           << key
+                //           << ")" << std::endl;
+                graph.add_MRR(key, curr_txn->getHandle());
+            }
+            else if (mrw and mrw != curr_txn)
+            { // previous writer in graph
+                // std::cout << "INSERT::READSET: previous writer for data item ("
+                //           << key
+                //           << ") is transaction " << mrw->getID() << std::endl;
+                graph.addNeighborOut(curr_txn, mrw);
+                graph.add_MRR(key, curr_txn->getHandle());
+            }
+            else if (!mrw)
+            { // previous writer not in graph
+                //std::cout << "INSERT::READSET: previous writer " << mrw_id << " not in graph" << std::endl;
             }
         }
 
-        // process each transaction
-        for (auto &txn : transactions)
+        // Write Set ∩ Primary Set
+        for (KeyId key : write_set)
         {
-            // std::cout << "INSERT::Transaction: " << txn.getID() << std::endl;
 
-            std::unordered_set<DataItem> write_set;
-            std::unordered_set<DataItem> read_set;
-            std::unordered_set<int32_t> expected_regions;
+            if (!inPrimarySet(key))
+                continue;
 
-            // setup the read and write set for the current transaction
-            for (const auto &op : txn.getOperations())
-            {
+            auto mrw_id = graph.getMostRecentWriterID(key);
+            auto mrw = graph.getNode(mrw_id);
 
-                auto it = mockDB.find(op.key);
+            const auto &mrr_ids = graph.getMostRecentReadersIDs(key);
 
-                if (it == mockDB.end())
+            if (mrw_id == INVALID_TXN_HANDLE)
+            {
+                // true "no previous writer"
+                graph.add_MRW(key, curr_txn);
+                graph.clearMRRIds(key);
+                continue;
+            }
+
+            if (mrr_ids.empty())
+            {
+                if (mrw != nullptr)
+                    graph.addNeighborOut(curr_txn, mrw);
+            }
+            else
+            {
+                for (const auto &reader_id : mrr_ids)
                 {
-                    std::cout << "INSERT::ReadWriteSet: key " << op.key << " not found" << std::endl;
-                    continue;
+                    auto read_txn = graph.getNode(reader_id);
+                    if (read_txn != nullptr)
+                        graph.addNeighborOut(curr_txn, read_txn);
                 }
+            }
+
+            graph.add_MRW(key, curr_txn);
+            graph.clearMRRIds(key);
+        }
+    }
+}
 
-                DataItem data_item = it->second;
+void Merger::insertAlgorithm()
+{
+    if (merge_mode == MergeMode::ROUND_ALIGNED)
+    {
+        insertByRound();
+        return;
+    }
 
-                if (op.type == OperationType::WRITE)
-                {
-                    write_set.insert(data_item); // dont use nullptr, need to be valid pointer or just ""
-                }
-                else if (op.type == OperationType::READ)
-                {
-                    read_set.insert(data_item);
-                }
+    std::unique_lock<std::mutex> lk(ready_mtx); // initialize lock for ready queue
+    std::vector<int> sids;
 
-                expected_regions.insert(data_item.primaryCopyID); // add primary copy id to expected regions
+    while (true)
+    {
+        ready_cv.wait(lk, [this]() { return !ready_q_.empty(); }); // wait until there is work to do
 
-                // pritn read and write set
-                // std::cout << "INSERT::ReadWriteSet: key " << op.key << " type " << (op.type == OperationType::READ ? "READ" : "WRITE") << std::endl;
-            }
+        // take one sid, or every ready sid when coalescing
+        sids.clear();
+        do
+        {
+            sids.push_back(ready_q_.front());
+            enqueued_sids_.erase(ready_q_.front());
+            ready_q_.pop_front();
+        } while (merge_mode == MergeMode::COALESCE && !ready_q_.empty());
 
-            auto curr_txn = graph.getNode(txn.getID());
+        lk.unlock(); // unlock ready queue mutex while working
 
-            if (curr_txn == nullptr)
+        // insert up to the budget; per-sequence mode takes one partial sequence per pass
+        size_t budget = merge_mode == MergeMode::COALESCE ? merge_budget : 1;
+        size_t inserted = 0;
+        bool drained = false;
+        while (!drained && (budget == 0 || inserted < budget))
+        {
+            drained = true;
+            for (int sid : sids)
             {
-                txn.setExpectedRegions(expected_regions);
-                txn.addSeenRegion(sid);
-                curr_txn = graph.addNode(std::make_unique<Transaction>(txn));
+                auto &inner_map = partial_sequences.find(sid)->second;
+                if (inner_map->empty() || (budget != 0 && inserted >= budget))
+                    continue;
+
+                // round robin over the sids, so one busy server cannot use up the budget
+                auto transactions = inner_map->pop();
+                insertPartialSequence(sid, transactions);
+                ++inserted;
+                drained = false;
             }
-            else
+        }
+
+        // If more arrived for a sid while we were working, re-enqueue it
+        {
+            std::lock_guard<std::mutex> g(ready_mtx);
+            for (int sid : sids)
             {
-                curr_txn->addSeenRegion(sid);
+                // If queue isn’t empty, schedule another turn for this sid.
+                auto it2 = partial_sequences.find(sid);
+                if (it2 != partial_sequences.end() && !it2->second->empty())
+                {
+                    if (!enqueued_sids_.count(sid))
+                    {
+                        enqueued_sids_.insert(sid);
+                        ready_q_.push_back(sid);
+                        ready_cv.notify_one();
+                    }
+                }
             }
+        }
 
-            // Read Set ∩ Primary Set
-            for (const auto &data_item : read_set)
-            {
-                if (primary_set.find(data_item) == primary_set.end())
-                    continue;
+        if (inserted == 0)
+        {
+            lk.lock(); // lock before going back to
+            continue;
+        }
 
-                // std::cout << "INSERT::READSET:" << data_item.val << " is in read and primary set" << std::endl;
+        runMergePass(inserted);
 
-                auto mrw_id = graph.getMostRecentWriterID(data_item);
-                auto mrw = graph.getNode(mrw_id);
+        lk.lock(); // lock before going back to waiting, IMPORTANT needs to be locked before wait
+    }
+}
 
-                if (mrw_id.empty())
-                { // no previous writer
-                    // std::cout << "INSERT::READSET: no previous writer for data item ("
-                    //           << data_item.val << ", " << data_item.primaryCopyID
-                    //           << ")" << std::endl;
-                    graph.add_MRR(data_item, curr_txn->getID());
-                }
-                else if (mrw and mrw->getID() != curr_txn->getID())
-                { // previous writer in graph
-                    // std::cout << "INSERT::READSET: previous writer for data item ("
-                    //           << data_item.val << ", " << data_item.primaryCopyID
-                    //           << ") is transaction " << mrw_id << std::endl;
-                    graph.addNeighborOut(curr_txn, mrw);
-                    graph.add_MRR(data_item, curr_txn->getID());
-                }
-                else if (!mrw)
-                { // previous writer not in graph
-                    //std::cout << "INSERT::READSET: previous writer " << mrw_id << " not in graph" << std::endl;
-                }
-            }
+void Merger::runMergePass(size_t sequences)
+{
+    //graph.printAll();
 
-            // Write Set ∩ Primary Set
-            for (const auto &data_item : write_set)
-            {
+    // call graph cleanup for merged orders and log if any removed
+    {
+        int removed = graph.getMergedOrders_();
+        if (removed > 0)
+        {
+            std::cout << "MERGER: removed " << removed << " node from graph" << std::endl;
+        }
+    }
+    sequences_since_report += sequences;
+    ++passes_since_report;
 
-                if (primary_set.find(data_item) == primary_set.end())
-                    continue;
+    // report node memory and merge pass savings now and then
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_report >= REPORT_PERIOD)
+    {
+        double secs = std::chrono::duration<double>(now - last_report).count();
+        last_report = now;
+        TransactionPoolStats stats = graph.getPoolStats();
+        std::cout << "MERGER: node pool live=" << stats.live
+                  << " high_water=" << stats.high_water
+                  << " slots=" << stats.slots
+                  << " bytes=" << stats.bytes
+                  << " bytes/slot=" << (stats.slots ? stats.bytes / stats.slots : 0) << std::endl;
+
+        RoundArenaStats arenas = RoundArena::stats();
+        std::cout << "MERGER: round arenas live=" << arenas.live
+                  << " bytes=" << arenas.bytes << std::endl;
+
+        // one pass per partial sequence is what per-sequence mode would have run
+        std::cout << "MERGER: " << passes_since_report << " merge passes for "
+                  << sequences_since_report << " partial sequences, saved "
+                  << (sequences_since_report - passes_since_report) / secs << " passes/s" << std::endl;
+
+        if (rounds_since_report > 0)
+        {
+            std::cout << "MERGER: " << rounds_since_report << " rounds merged, "
+                      << round_latency_ms_since_report / rounds_since_report
+                      << " ms on average from round end to merge pass" << std::endl;
+        }
 
-                auto mrw_id = graph.getMostRecentWriterID(data_item);
-                auto mrw = mrw_id.empty() ? nullptr : graph.getNode(mrw_id);
+        sequences_since_report = 0;
+        passes_since_report = 0;
+        rounds_since_report = 0;
+        round_latency_ms_since_report = 0;
+    }
+}
 
-                auto mrr_ids = graph.getMostRecentReadersIDs(data_item);
+bool Merger::roundSealed(int32_t round) const
+{
+    // every server sends at most one partial sequence per round, in round order
+    for (int32_t sid : expected_server_ids)
+    {
+        auto it = latest_round.find(sid);
+        if (it == latest_round.end() || it->second < round)
+            return false;
+    }
+    return true;
+}
 
-                if (mrw_id.empty())
-                {
-                    // true "no previous writer"
-                    graph.add_MRW(data_item, curr_txn);
-                    graph.clearMRRIds(data_item);
-                    continue;
-                }
+void Merger::insertByRound()
+{
+    std::unique_lock<std::mutex> lk(ready_mtx);
+    std::vector<RoundSequence> due;
 
-                if (mrr_ids.empty())
-                {
-                    if (mrw != nullptr)
-                        graph.addNeighborOut(curr_txn, mrw);
-                }
-                else
-                {
-                    for (const auto &reader_id : mrr_ids)
-                    {
-                        auto read_txn = graph.getNode(reader_id);
-                        if (read_txn != nullptr)
-                            graph.addNeighborOut(curr_txn, read_txn);
-                    }
-                }
+    while (true)
+    {
+        ready_cv.wait(lk, [this]() { return !round_heap.empty(); });
 
-                graph.add_MRW(data_item, curr_txn);
-                graph.clearMRRIds(data_item);
-            }
+        // servers skip empty rounds, so a round is closed either once every server has sent
+        // that round or a later one, or once its grace period after the round end runs out
+        int32_t round = round_heap.front().round;
+        auto round_end = LOGICAL_EPOCH + ROUND_PERIOD * (round + 1);
+        ready_cv.wait_until(lk, round_end + ROUND_GRACE, [&]()
+                            { return round_heap.front().round < round || roundSealed(round); });
+
+        if (round_heap.front().round < round)
+        {
+            continue; // a late sequence for an earlier round showed up, close that one first
         }
 
-        // If more arrived for this sid while we were working, re-enqueue it
+        // take round R from every server (and anything older that came in late) as one unit
+        due.clear();
+        while (!round_heap.empty() && round_heap.front().round <= round)
         {
-            std::lock_guard<std::mutex> g(ready_mtx);
-            // If queue isn’t empty, schedule another turn for this sid.
-            auto it2 = partial_sequences.find(sid);
-            if (it2 != partial_sequences.end() && !it2->second->empty())
-            {
-                if (!enqueued_sids_.count(sid))
-                {
-                    enqueued_sids_.insert(sid);
-                    ready_q_.push_back(sid);
-                    ready_cv.notify_one();
-                }
-            }
+            std::pop_heap(round_heap.begin(), round_heap.end(), CompareByRound());
+            due.push_back(std::move(round_heap.back()));
+            round_heap.pop_back();
         }
 
-        //graph.printAll();
+        lk.unlock(); // unlock ready queue mutex while working
 
-        // call graph cleanup for merged orders and log if any removed
+        for (auto &seq : due)
         {
-            int removed = graph.getMergedOrders_();
-            if (removed > 0)
-            {
-                std::cout << "MERGER: removed " << removed << " node from graph" << std::endl;
-            }
+            insertPartialSequence(seq.server_id, seq.transactions);
         }
+        size_t sequences = due.size();
+        due.clear(); // the graph holds its own copies now
 
-        lk.lock(); // lock before going back to waiting, IMPORTANT needs to be locked before wait
+        auto latency = std::chrono::steady_clock::now() - round_end;
+        round_latency_ms_since_report += std::chrono::duration<double, std::milli>(latency).count();
+        ++rounds_since_report;
+
+        runMergePass(sequences);
+
+        lk.lock();
     }
 }
 
@@ -299,6 +813,25 @@ Merger::Merger()
     std::ofstream init_log("./merger_logs/merger_log" + std::to_string(my_id) + ".jsonl", std::ios::out | std::ios::trunc);
     // std::ofstream init_tp("throughput_log_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
 
+    if (MERGE_MODE == "coalesce")
+    {
+        merge_mode = MergeMode::COALESCE;
+    }
+    else if (MERGE_MODE == "round")
+    {
+        merge_mode = MergeMode::ROUND_ALIGNED;
+    }
+    else if (MERGE_MODE == "per_sequence")
+    {
+        merge_mode = MergeMode::PER_SEQUENCE;
+    }
+    else
+    {
+        fprintf(stderr, "MERGER: unknown merge mode %s\n", MERGE_MODE.c_str());
+        exit(1);
+    }
+    merge_budget = MERGE_BUDGET;
+
     partial_sequences.reserve(servers.size());
     for (const auto &server : servers)
     {
@@ -327,6 +860,51 @@ Merger::Merger()
     }
 
     pthread_detach(insert_thread);
+
+    // snapshots for clients are built and written here, never on an I/O thread
+    if (pthread_create(&snapshot_thread, nullptr, [](void *arg) -> void *
+                       {
+            static_cast<Merger*>(arg)->serveSnapshots();
+            return nullptr; }, this) != 0)
+    {
+        threadError("Error creating snapshot thread");
+    }
+
+    pthread_detach(snapshot_thread);
+}
+
+void Merger::requestMergedOrders(int fd)
+{
+    // a dup, so the fd stays this socket's even if the reactor closes its own meanwhile
+    int own = dup(fd);
+    if (own < 0)
+    {
+        perror("MERGER: dup failed");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(snapshot_mtx);
+        snapshot_fds.push_back(own);
+    }
+    snapshot_cv.notify_one();
+}
+
+void Merger::serveSnapshots()
+{
+    while (true)
+    {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lk(snapshot_mtx);
+            snapshot_cv.wait(lk, [this]() { return !snapshot_fds.empty(); });
+            fd = snapshot_fds.front();
+            snapshot_fds.pop_front();
+        }
+
+        sendMergedOrdersOnFd(fd);
+        close(fd);
+    }
 }
 
 void Merger::sendMergedOrdersOnFd(int fd)
@@ -343,20 +921,13 @@ void Merger::sendMergedOrdersOnFd(int fd)
         return;
     }
 
-    uint32_t len = static_cast<uint32_t>(payload.size());
-    uint32_t netlen = htonl(len);
+    uint32_t netlen = htonl(uint32_t(payload.size()));
+    payload.insert(0, reinterpret_cast<const char *>(&netlen), sizeof(netlen));
 
-    // write length prefix
-    if (!writeNBytes(fd, &netlen, sizeof(netlen)))
+    // a client that stops reading does not hold the snapshot thread for long
+    if (!writeBefore(fd, payload, std::chrono::steady_clock::now() + SNAPSHOT_SEND_TIMEOUT))
     {
-        std::cerr << "MERGER: failed to write snapshot length to fd " << fd << std::endl;
-        return;
-    }
-
-    // write payload
-    if (!writeNBytes(fd, payload.data(), payload.size()))
-    {
-        std::cerr << "MERGER: failed to write snapshot payload to fd " << fd << std::endl;
-        return;
+        std::cerr << "MERGER: failed to write snapshot to fd " << fd << ", dropping the client" << std::endl;
+        shutdown(fd, SHUT_RDWR); // the transport sees the hangup and closes its end
     }
 }
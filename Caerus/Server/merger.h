@@ -10,6 +10,8 @@
 #include <vector>
 #include <queue>
 #include <memory>
+#include <chrono>
+#include <algorithm>
 
 #include "transaction.h"
 #include "queueTS.h"
@@ -17,17 +19,38 @@
 #include "../proto/graph_snapshot.pb.h"
 #include "graph.h"
 
+// A partial sequence waiting for its round to close (round-aligned mode)
+struct RoundSequence
+{
+    int32_t round;
+    int32_t server_id;
+    std::vector<Transaction> transactions;
+};
+
 // Define a min-heap comparator for rounds
 struct CompareByRound
 {
-    bool operator()(const request::Request &a,
-                    const request::Request &b) const
+    bool operator()(const RoundSequence &a,
+                    const RoundSequence &b) const
     {
-        // priority_queue is a max-heap by default, so invert
-        return a.round() > b.round();
+        // the std heap functions build a max-heap, so invert; within a round, lower server ids first
+        if (a.round != b.round)
+            return a.round > b.round;
+        return a.server_id > b.server_id;
     }
 };
 
+// PER_SEQUENCE runs a merge pass after every partial sequence; COALESCE inserts
+// everything that is ready (up to merge_budget partial sequences) first and
+// then runs a single pass; ROUND_ALIGNED holds partial sequences back until
+// their round has closed and then inserts the whole round before one pass.
+enum class MergeMode
+{
+    PER_SEQUENCE,
+    COALESCE,
+    ROUND_ALIGNED
+};
+
 class Merger
 {
 private:
@@ -36,6 +59,15 @@ private:
     pthread_t popper;
     pthread_t insert_thread;
     pthread_t dump_thread;
+    pthread_t snapshot_thread;
+
+    // clients waiting for a snapshot (each fd a dup of the client's, closed once served)
+    std::mutex snapshot_mtx;
+    std::condition_variable snapshot_cv;
+    std::deque<int> snapshot_fds;
+
+    // Snapshot loop: builds and writes what requestMergedOrders queued, off the I/O threads
+    void serveSnapshots();
 
     // map server_id → queue of Transactions
     std::unordered_map<int32_t, std::unique_ptr<Queue_TS<std::vector<Transaction>>>> partial_sequences;
@@ -52,6 +84,68 @@ private:
     // Copy of the graph
     Graph graph;
 
+    MergeMode merge_mode;
+    size_t merge_budget; // 0 means no limit
+
+    // round-aligned mode, guarded by ready_mtx
+    std::vector<RoundSequence> round_heap;                // min-heap by round, see CompareByRound
+    std::unordered_map<int32_t, int32_t> latest_round;    // server id -> latest round it sent
+
+    // merge pass stats for the periodic report
+    std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+    uint64_t sequences_since_report = 0;
+    uint64_t passes_since_report = 0;
+    uint64_t rounds_since_report = 0;
+    double round_latency_ms_since_report = 0;
+
+    // PAYLOAD DEDUP: transaction bodies by id, each kept until every partial
+    // sequence from another server that only names it has come in
+    struct CachedBody
+    {
+        SharedRequest req;
+        int refs_left;
+        int32_t round;
+    };
+    std::unordered_map<std::string, CachedBody> bodies;
+    size_t bodies_since_sweep = 0;
+
+    // a server's partial sequences, in order, behind the first one still missing bodies
+    struct Parked
+    {
+        std::deque<PartialSequenceMsg> waiting;
+        std::chrono::steady_clock::time_point head_since; // when the front one started waiting
+        std::chrono::steady_clock::time_point asked;      // when its missing bodies were last asked for
+    };
+    std::unordered_map<int, Parked> parked;
+
+    void cacheBody(const SharedRequest &req);
+    bool bodiesReady(const PartialSequenceMsg &msg) const;
+    void dispatch(const PartialSequenceMsg &msg);
+
+    // Dispatches the parked sequences whose bodies are in. The server of one that
+    // has waited longer than BODY_WAIT is asked for what is missing, and the merger
+    // stops if it still is after BODY_GIVE_UP.
+    void releaseParked(std::chrono::steady_clock::time_point now);
+    std::vector<std::string> missingBodies(const PartialSequenceMsg &msg) const;
+    bool askForBodies(int sid, const PartialSequenceMsg &msg); // false if it could not be sent now
+
+    // The body a partial sequence names, given up by the cache once the last one
+    // that names it has taken it; nullptr if it is not there.
+    SharedRequest takeBody(const std::string &id);
+
+    // Hand a partial sequence from sid to the insert thread, however it arrived
+    void enqueuePartialSequence(int sid, int32_t round, std::vector<Transaction> &transactions);
+
+    // Add one partial sequence from sid to the graph
+    void insertPartialSequence(int sid, std::vector<Transaction> &transactions);
+
+    // Merge what is complete after inserting the given number of partial sequences
+    void runMergePass(size_t sequences);
+
+    // Insert loop of the round-aligned mode
+    void insertByRound();
+    bool roundSealed(int32_t round) const;
+
 public:
     // Constructor receives the list of expected server ids.
     Merger();
@@ -59,12 +153,19 @@ public:
     // Pop from input queue
     void popFromQueue();
 
-    // Process a single incoming request
-    void processRequest(const request::Request &req_proto);
+    // Process a single incoming request; its transactions keep it alive until they are merged
+    void processRequest(const SharedRequest &req);
+
+    // The same for a partial sequence that came as a flat frame
+    void processFlat(const SharedFlatRequest &req);
 
     // Insert algorithm
     void insertAlgorithm();
 
+    // Queues a client's MERGED request; the snapshot goes out on fd from the snapshot
+    // thread, and the client is dropped if it does not take it in time.
+    void requestMergedOrders(int fd);
+
     // Send merged orders (as a Request with recipient MERGED_ORDER) to the given fd.
     void sendMergedOrdersOnFd(int fd);
 };
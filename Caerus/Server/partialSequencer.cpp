@@ -1,5 +1,9 @@
 #include <chrono>
 #include "partialSequencer.h"
+#include "transport.h"
+#include "connectionManager.h"
+#include "flatRequest.h"
+#include "regionRelay.h"
 #include <netinet/in.h>
 #include <thread>
 #include <fstream>
@@ -8,6 +12,8 @@ namespace
 {
     // compile-time constant for a 5s window
     constexpr std::chrono::milliseconds ROUND_PERIOD{50};
+    constexpr std::chrono::milliseconds BUSY_RETRY{2}; // until the round ends, for connections another writer had
+    constexpr int32_t BODY_KEEP_ROUNDS = 200; // 10s of partial sequences, as long as a merger waits for a body
 
 }
 
@@ -24,42 +30,55 @@ void PartialSequencer::processPartialSequence()
 
         auto deadline = LOGICAL_EPOCH + std::chrono::milliseconds((window + 1) * ROUND_PERIOD.count());
 
+        // frames that found their connection busy go out as soon as it is free, not a round later
+        while (busy_peers && std::chrono::steady_clock::now() + BUSY_RETRY < deadline)
+        {
+            std::this_thread::sleep_for(BUSY_RETRY);
+            flushBacklog();
+        }
+
         // sleep until that moment
         std::this_thread::sleep_until(deadline);
 
+        // bodies a merger asked for again go out with this round's frames
+        answerWanted();
+
         // grab all requests for this window (may be empty)
         auto batch = batcher_to_partial_sequencer_queue_.popAll();
 
         if (batch.empty())
         {
-            // no transactions received in this window
+            // no transactions received in this window, but peers that just came back may be owed some
+            flushBacklog();
             window++;
             continue;
         }
 
-        partial_sequence_.Clear();
-        partial_sequence_.set_server_id(my_id);
-        partial_sequence_.set_recipient(request::Request::MERGER);
-        partial_sequence_.set_round(static_cast<int32_t>(window));
+        // a fresh message every window: the previous one may still be in the merger's hands.
+        // It points at the transactions in the batch rather than copying them, and keeps the batch.
+        partial_sequence_ = RoundArena::forRound(window)->newRequestOver(batch);
+        partial_sequence_->set_server_id(my_id);
+        partial_sequence_->set_recipient(request::Request::MERGER);
+        partial_sequence_->set_round(static_cast<int32_t>(window));
 
         for (auto &req : batch)
         {
             // each req.transaction(0) is a local write for your primaries
-            partial_sequence_.add_transaction()->CopyFrom(req.transaction(0));
+            partial_sequence_->mutable_transaction()->UnsafeArenaAddAllocated(req->mutable_transaction(0));
         }
 
         // log if partial sequence is not empty
-        if (partial_sequence_.transaction_size() > 0)
+        if (partial_sequence_->transaction_size() > 0)
         {
             std::ofstream logf("partial_sequence_log_" + std::to_string(my_id) + ".log",
                                std::ios::app);
             if (logf)
             {
-                for (int i = 0; i < partial_sequence_.transaction_size(); ++i)
+                for (int i = 0; i < partial_sequence_->transaction_size(); ++i)
                 {
                     logf << "round=" << window
-                         << " tx=" << partial_sequence_.transaction(i).id()
-                         << " ops=" << partial_sequence_.transaction(i).operations_size()
+                         << " tx=" << partial_sequence_->transaction(i).id()
+                         << " ops=" << partial_sequence_->transaction(i).operations_size()
                          << "\n";
                 }
             }
@@ -67,7 +86,7 @@ void PartialSequencer::processPartialSequence()
 
         {
             std::lock_guard<std::mutex> lk(partial_sequencer_to_merger_queue_mtx);
-            partial_sequencer_to_merger_queue_.push(partial_sequence_);
+            partial_sequencer_to_merger_queue_.push({partial_sequence_, nullptr});
         } // unlock first
 
         partial_sequencer_to_merger_queue_cv.notify_one();
@@ -75,69 +94,217 @@ void PartialSequencer::processPartialSequence()
         // broadcast to other regions
         sendPartialSequence();
 
+        if (PAYLOAD_DEDUP)
+        {
+            recent.emplace(int32_t(window), std::move(partial_sequence_));
+            recent.erase(recent.begin(), recent.lower_bound(int32_t(window) - BODY_KEEP_ROUNDS));
+        }
+        partial_sequence_.reset();
+
         window++;
     }
 }
 
 void PartialSequencer::sendPartialSequence()
 {
+    // the message is shared with the local merger by now, so it is only read here
+    const request::Request &seq = *partial_sequence_;
+
+    // with a region relay, other regions get it in the relay's bundle instead, unless
+    // the round's relay cannot be reached from here
+    RegionRelay *relay = getRegionRelay();
+    bool relayed = relay && relay->throughRelay(seq.round());
+    auto direct = [relay, relayed](int peer_id)
+    { return !relayed || relay->inRegion(peer_id); };
+
+    if (sent_log)
+    {
+        for (auto &target : target_peers)
+        {
+            if (!direct(target.first))
+                continue;
+            for (const auto &txn : seq.transaction())
+            {
+                sent_log << "to=" << target.first
+                         << " round=" << seq.round()
+                         << " tx=" << txn.id()
+                         << " ops=" << txn.operations_size()
+                         << "\n";
+            }
+        }
+        sent_log.flush();
+    }
+
+    // every peer gets the same bytes: encoded once per wire format, when it first goes out
+    auto outbound = std::make_shared<OutboundSequence>(PAYLOAD_DEDUP ? referencesOnly(seq) : partial_sequence_);
     for (auto &target : target_peers)
     {
-        int target_id = target.first;
-        int &connfd = merger_fds[target_id];
+        if (direct(target.first))
+            backlog[target.first].push_back(outbound);
+    }
 
-        partial_sequence_.set_target_server_id(target_id);
+    if (relayed && relay->isRelay(seq.round()))
+    {
+        if (const std::string *frame = outbound->encoded(WIRE_FORMAT == "flat"))
+            relay->collect(my_id, seq.round(), frame->data(), uint32_t(frame->size()));
+    }
+
+    flushBacklog();
+}
 
-        std::ofstream logf("partial_sequence_sent_" + std::to_string(my_id) + ".log", std::ios::app);
-        if (logf)
+SharedRequest PartialSequencer::referencesOnly(const request::Request &seq)
+{
+    // every other merger has the bodies already, the transactions only name them
+    SharedRequest refs = RoundArena::forRound(seq.round())->newRequest();
+    refs->set_server_id(seq.server_id());
+    refs->set_recipient(seq.recipient());
+    refs->set_round(seq.round());
+    refs->set_target_server_id(NAMES_ONLY);
+
+    for (const auto &txn : seq.transaction())
+    {
+        request::Transaction *ref = refs->add_transaction();
+        ref->set_id(txn.id());
+        ref->set_client_id(txn.client_id());
+        ref->set_random_stamp(txn.random_stamp());
+    }
+    return refs;
+}
+
+void PartialSequencer::resendBodies(SharedRequest &&req)
+{
+    std::lock_guard<std::mutex> lk(wanted_mtx);
+    wanted.push_back(std::move(req));
+}
+
+void PartialSequencer::answerWanted()
+{
+    std::vector<SharedRequest> asks;
+    {
+        std::lock_guard<std::mutex> lk(wanted_mtx);
+        asks.swap(wanted);
+    }
+
+    for (const SharedRequest &ask : asks)
+    {
+        auto seq = recent.find(ask->round());
+        auto to = backlog.find(ask->server_id());
+        if (seq == recent.end() || to == backlog.end())
+        {
+            fprintf(stderr, "PARTIAL SEQUENCER: server %d asks for bodies of round %d, which is not kept\n",
+                    ask->server_id(), ask->round());
+            continue;
+        }
+
+        // each body in a frame of its own, as the batcher sent it; the merger only reads protobuf bodies
+        for (const auto &named : ask->transaction())
         {
-            for (const auto &txn : partial_sequence_.transaction())
+            for (const auto &txn : seq->second->transaction())
             {
-                logf << "to=" << target_id
-                     << " round=" << partial_sequence_.round()
-                     << " tx=" << txn.id()
-                     << " ops=" << txn.operations_size()
-                     << "\n";
+                if (txn.id() != named.id())
+                    continue;
+
+                SharedRequest body = RoundArena::forRound(ask->round())->newRequest();
+                body->set_recipient(request::Request::PARTIAL);
+                body->set_server_id(my_id);
+                body->set_target_server_id(PAYLOAD_ONLY);
+                body->set_batcher_round(ask->round());
+                *body->add_transaction() = txn;
+
+                auto outbound = std::make_shared<OutboundSequence>(std::move(body));
+                outbound->flat_state = -1;
+                to->second.push_back(std::move(outbound));
+                break;
             }
         }
+    }
+}
+
+const std::string *PartialSequencer::OutboundSequence::encoded(bool flat)
+{
+    if (flat && flat_state == 0)
+    {
+        // not every request has a flat form (a key without an id)
+        flat_state = FlatRequest::encode(*seq, flat_frame) ? 1 : -1;
+    }
+    if (flat && flat_state > 0)
+        return &flat_frame;
 
-        // (re)connect on-demand if we lost it
-        if (connfd < 0)
+    if (!has_protobuf)
+    {
+        if (!seq->SerializeToString(&protobuf_frame))
         {
+            perror("SerializeToString failed");
+            return nullptr;
+        }
+        has_protobuf = true;
+    }
+    return &protobuf_frame;
+}
+
+void PartialSequencer::flushBacklog()
+{
+    ConnectionManager *connections = getConnectionManager();
 
-            server target = target_peers[target_id];
+    std::vector<ConnectionManager::Lease> leases;
+    std::vector<int> leased;    // peer of each lease
+    std::vector<size_t> owners; // lease of each frame
+    std::vector<FrameSend> sends;
 
-            while ((connfd = setupConnection(target.ip, target.port)) < 0)
-            {
-                std::cerr << "Partial Sequencer " << my_id << ": reconnect to peer " << target_id << " failed, retrying in 1s…\n";
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-            }
+    busy_peers = false;
+    for (auto &entry : backlog)
+    {
+        if (entry.second.empty())
+            continue;
 
-            merger_fds[target_id] = connfd; // update the fd in the map
+        // never wait for a connection here, nor for another writer on it: a peer that is
+        // not up keeps its frames for a later round, a busy one for the next retry
+        ConnectionManager::Lease lease = connections->tryAcquire(entry.first);
+        if (!lease)
+        {
+            busy_peers = busy_peers || connections->isUp(entry.first);
+            continue;
         }
 
-        std::string serialized_request;
-        if (!partial_sequence_.SerializeToString(&serialized_request))
+        for (const std::shared_ptr<OutboundSequence> &seq : entry.second)
         {
-            perror("SerializeToString failed");
-            close(connfd);
-            return;
+            const std::string *frame = seq->encoded(lease.readsFlat());
+            if (!frame)
+                continue;
+            owners.push_back(leases.size());
+            sends.push_back({lease.fd(), frame->data(), uint32_t(frame->size()), false});
         }
+        leases.push_back(std::move(lease));
+        leased.push_back(entry.first);
+    }
+
+    if (sends.empty())
+        return;
+
+    // every peer's frames in one batch: one gather write each on epoll, one enter on io_uring
+    sendFrames(sends.data(), sends.size());
 
-        uint32_t netlen = htonl(uint32_t(serialized_request.size()));
-        if (!writeNBytes(connfd, &netlen, sizeof(netlen)) ||
-            !writeNBytes(connfd, serialized_request.data(), serialized_request.size()))
+    for (size_t i = 0; i < sends.size(); ++i)
+    {
+        if (!sends[i].ok && leases[owners[i]])
         {
-            perror("writeNBytes failed");
-            // connection broken, force reconnect
-            close(connfd);
-            connfd = -1;
+            perror("sendFrames failed");
+            // connection broken, the manager reconnects
+            leases[owners[i]].broken();
         }
     }
+
+    // what was attempted is done with, like a failed write always dropped its frame
+    for (int peer_id : leased)
+    {
+        backlog[peer_id].clear();
+    }
 }
 
-void PartialSequencer::pushReceivedTransactionIntoPartialSequence(const request::Request &req_proto)
+void PartialSequencer::pushReceivedTransactionIntoPartialSequence(SharedRequest &&req)
 {
+    const request::Request &req_proto = *req;
+
     std::ofstream logf("partial_sequencer_received_" + std::to_string(my_id) + ".log", std::ios::app);
     if (logf && req_proto.transaction_size() > 0)
     {
@@ -148,7 +315,7 @@ void PartialSequencer::pushReceivedTransactionIntoPartialSequence(const request:
     }
 
     // Push the transaction into the queue
-    batcher_to_partial_sequencer_queue_.push(req_proto);
+    batcher_to_partial_sequencer_queue_.push(std::move(req));
 }
 
 PartialSequencer::PartialSequencer()
@@ -156,7 +323,17 @@ PartialSequencer::PartialSequencer()
 
     std::ofstream init_log("partial_sequence_log_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
     std::ofstream init_recv_log("partial_sequencer_received_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
-    std::ofstream init_sent_log("partial_sequence_sent_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
+    sent_log.open("partial_sequence_sent_" + std::to_string(my_id) + ".log", std::ios::out | std::ios::trunc);
+
+    // the peer maps are read by the sequencer thread, so they are filled in first
+    for (auto &server : servers)
+    {
+        if (server.id != my_id)
+        {
+            target_peers[server.id] = server;
+            backlog[server.id];
+        }
+    }
 
     if (pthread_create(&partial_sequencer_thread, NULL, [](void *arg) -> void *
                        {
@@ -167,13 +344,4 @@ PartialSequencer::PartialSequencer()
     }
 
     pthread_detach(partial_sequencer_thread);
-
-    for (auto &server : servers)
-    {
-        if (server.id != my_id)
-        {
-            target_peers[server.id] = server;
-            merger_fds[server.id] = -1;
-        }
-    }
 }
@@ -1,10 +1,16 @@
 #ifndef PARTIALSEQUENCER_H
 #define PARTIALSEQUENCER_H
 
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>   
 
 #include "transaction.h"
 #include "queueTS.h"
+#include "roundArena.h"
 #include "../proto/request.pb.h"
 #include "utils.h"
 
@@ -16,17 +22,54 @@ private:
     
     std::vector<Transaction> partial_sequence;
     std::vector<request::Request> transactions_received;
-    request::Request partial_sequence_;
+    SharedRequest partial_sequence_; // on the window's arena, shared with the local merger
     pthread_t partial_sequencer_thread;
         
     std::unordered_map<int, server> target_peers;
-    std::unordered_map<int,int> merger_fds; // id to fd mapping for merger
+
+    // A partial sequence on its way to the other servers, shared by all of them.
+    // It is encoded the first time a connection wants it in a given wire format,
+    // and those bytes go to every other peer that takes that format.
+    struct OutboundSequence
+    {
+        SharedRequest seq;
+        std::string protobuf_frame;
+        std::string flat_frame;
+        bool has_protobuf = false;
+        int flat_state = 0; // 0 not tried yet, 1 encoded, -1 has no flat form
+
+        explicit OutboundSequence(SharedRequest seq_) : seq(std::move(seq_)) {}
+
+        // nullptr if it cannot be encoded at all
+        const std::string *encoded(bool flat);
+    };
+
+    // partial sequences per peer, oldest first, waiting for the peer's connection
+    // (ordered, so connections are always leased in the same order)
+    std::map<int, std::vector<std::shared_ptr<OutboundSequence>>> backlog;
+    bool busy_peers = false; // some peer's frames wait only because another writer had its connection
+    std::ofstream sent_log; // what went to which peer, written once per round
+
+    // seq with its transactions cut down to what names them, for payload dedup
+    static SharedRequest referencesOnly(const request::Request &seq);
+
+    // payload dedup: this server's recent partial sequences by round, for the
+    // mergers that ask for a body they never got
+    std::map<int32_t, SharedRequest> recent;
+    std::mutex wanted_mtx;
+    std::vector<SharedRequest> wanted; // those asks, guarded by wanted_mtx
+
+    // Puts the bodies asked for into the backlog of the servers that asked.
+    void answerWanted();
 
 public:
     PartialSequencer();
     void processPartialSequence();
-    void pushReceivedTransactionIntoPartialSequence(const request::Request& req_proto);
+    void pushReceivedTransactionIntoPartialSequence(SharedRequest&& req);
+    // A merger asking again for bodies this server's partial sequence of req's round named
+    void resendBodies(SharedRequest &&req);
     void sendPartialSequence();
+    void flushBacklog();
 };
 
 #endif
\ No newline at end of file
@@ -2,11 +2,11 @@
 #include "queueTS.h"
 
 // Global instantiations:
-Queue_TS<request::Request> request_queue_;
+Queue_TS<SharedRequest> request_queue_;
 
-Queue_TS<request::Request> batcher_to_partial_sequencer_queue_;
+Queue_TS<SharedRequest> batcher_to_partial_sequencer_queue_;
 
-Queue_TS<request::Request> partial_sequencer_to_merger_queue_;
+Queue_TS<PartialSequenceMsg> partial_sequencer_to_merger_queue_;
 std::mutex partial_sequencer_to_merger_queue_mtx;
 std::condition_variable partial_sequencer_to_merger_queue_cv;
 
@@ -65,3 +65,6 @@ template class Queue_TS<std::vector<Transaction>>;
 
 template class Queue_TS<std::vector<request::Request>>;
 template class Queue_TS<request::Request>;
+template class Queue_TS<SharedRequest>;
+template class Queue_TS<PartialSequenceMsg>;
+template class Queue_TS<QueuedTransaction>;
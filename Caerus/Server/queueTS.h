@@ -4,8 +4,12 @@
 #include <mutex>
 #include <deque>
 #include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "transaction.h"
+#include "flatRequest.h"
 #include "../proto/request.pb.h"
 
 // QUEUES
@@ -31,14 +35,50 @@ public:
     }
 };
 
+// requests are shared rather than copied from the moment they are parsed, and
+// live on the arena of their round (see RoundArena)
+using SharedRequest = std::shared_ptr<request::Request>;
+
+// A client transaction the way the peers it goes to receive it: encoded once,
+// as the transaction field of a Request, and shared by all of their queues.
+// Every peer's sender puts its own routing envelope (another encoded Request)
+// in front; protobuf parses the two back to back as one message.
+struct EncodedTransaction
+{
+    std::string body;
+    std::string id; // for the logs
+    int operations;
+    int32_t batcher_round;
+};
+using SharedEncodedTransaction = std::shared_ptr<const EncodedTransaction>;
+
+// An encoded transaction in one peer's queue. A payload-only one is not for the
+// peer's partial sequencer, only for its merger (see PAYLOAD_DEDUP).
+struct QueuedTransaction
+{
+    SharedEncodedTransaction txn;
+    bool payload_only;
+};
+
 // queue for client requests to batcher
-extern Queue_TS<request::Request> request_queue_;
+extern Queue_TS<SharedRequest> request_queue_;
 
 // queue for batcher to partial sequencer
-extern Queue_TS<request::Request> batcher_to_partial_sequencer_queue_;
+extern Queue_TS<SharedRequest> batcher_to_partial_sequencer_queue_;
+
+// a partial sequence on its way to the merger: a request, or a flat frame as it
+// came off the wire (see FlatRequest); exactly one of the two is set. With
+// payload dedup on, req can also be a transaction body for the merger to keep
+// until the partial sequences that only name it arrive (body is set then).
+struct PartialSequenceMsg
+{
+    SharedRequest req;
+    SharedFlatRequest flat;
+    bool body = false;
+};
 
 // queue for partial sequencer to merger
-extern Queue_TS<request::Request> partial_sequencer_to_merger_queue_;
+extern Queue_TS<PartialSequenceMsg> partial_sequencer_to_merger_queue_;
 extern std::mutex partial_sequencer_to_merger_queue_mtx;
 extern std::condition_variable partial_sequencer_to_merger_queue_cv;
 
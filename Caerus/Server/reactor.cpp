@@ -0,0 +1,302 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "utils.h"
+
+namespace
+{
+    constexpr int MAX_EVENTS = 64;
+    constexpr size_t MAX_GATHER = 512; // frames per sendmsg, two iovecs each (IOV_MAX is 1024)
+    constexpr std::chrono::milliseconds SEND_TIMEOUT{1000}; // a gather write not done by then counts as a broken connection
+}
+
+Reactor::Reactor(int num_threads)
+{
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+
+    workers.resize(num_threads);
+    for (auto &worker : workers)
+    {
+        worker.reactor = this;
+        worker.epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker.epfd < 0)
+        {
+            error("Reactor: epoll_create1 failed");
+        }
+    }
+
+    // only start the threads once every epoll set exists
+    for (auto &worker : workers)
+    {
+        if (pthread_create(&worker.thread, NULL, [](void *arg) -> void *
+                           {
+                auto *w = static_cast<Worker*>(arg);
+                w->reactor->run(w->epfd);
+                return nullptr; }, &worker) != 0)
+        {
+            threadError("Reactor: error creating I/O thread");
+        }
+
+        pthread_detach(worker.thread);
+    }
+
+    printf("Reactor started with %d I/O threads\n", num_threads);
+}
+
+void Reactor::addListener(int listenfd, FrameHandler handler, CloseHandler on_close)
+{
+    Endpoint *ep = new Endpoint{};
+    ep->listening = true;
+    ep->conn = {listenfd, "", 0};
+    ep->handler = std::move(handler);
+    ep->on_close = std::move(on_close);
+
+    watch(workers[next_worker++ % workers.size()].epfd, ep);
+}
+
+void Reactor::addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close)
+{
+    Endpoint *ep = new Endpoint{};
+    ep->listening = false;
+    ep->conn = conn;
+    ep->handler = std::move(handler);
+    ep->on_close = std::move(on_close);
+
+    // anything that arrived before this is reported by the first wait
+    watch(workers[next_worker++ % workers.size()].epfd, ep);
+}
+
+void Reactor::watch(int epfd, Endpoint *ep)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ep->conn.fd, &ev) < 0)
+    {
+        perror("Reactor: epoll_ctl ADD failed");
+        close(ep->conn.fd);
+        delete ep;
+    }
+}
+
+void Reactor::run(int epfd)
+{
+    epoll_event events[MAX_EVENTS];
+
+    while (true)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            threadError("Reactor: epoll_wait failed");
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            auto *ep = static_cast<Endpoint *>(events[i].data.ptr);
+
+            if (ep->listening)
+            {
+                acceptAll(ep);
+            }
+            else if (!readFrames(ep, events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                closeEndpoint(epfd, ep);
+            }
+        }
+    }
+}
+
+void Reactor::acceptAll(Endpoint *listener)
+{
+    // edge-triggered: keep accepting until the backlog is empty
+    while (true)
+    {
+        sockaddr_storage addr{};
+        socklen_t addrlen = sizeof(addr);
+        int connfd = accept4(listener->conn.fd, (sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        syscalls.fetch_add(1, std::memory_order_relaxed);
+
+        if (connfd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Reactor: error accepting connection");
+            return;
+        }
+
+        Endpoint *ep = new Endpoint{};
+        ep->listening = false;
+        ep->conn = peerConnection(connfd, addr);
+        ep->handler = listener->handler;
+        ep->on_close = listener->on_close;
+
+        watch(workers[next_worker++ % workers.size()].epfd, ep);
+    }
+}
+
+bool Reactor::readFrames(Endpoint *ep, bool hangup)
+{
+    int fd = ep->conn.fd;
+
+    // edge-triggered: drain the socket, handing out every frame as it completes
+    while (true)
+    {
+        char *dst = ep->reader.writable();
+        size_t room = ep->reader.writableSize();
+        ssize_t r = ::read(fd, dst, room);
+        syscalls.fetch_add(1, std::memory_order_relaxed);
+
+        if (r == 0)
+        {
+            if (ep->reader.buffered() != 0)
+            {
+                fprintf(stderr, "Reactor: %s:%d closed in the middle of a frame\n",
+                        ep->conn.ip.c_str(), ep->conn.port);
+            }
+            return false; // peer closed
+        }
+        if (r < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true; // drained, wait for the next edge
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Reactor: read error from %s:%d: %s\n",
+                    ep->conn.ip.c_str(), ep->conn.port, strerror(errno));
+            return false;
+        }
+
+        ep->reader.commit(r);
+
+        const char *data;
+        uint32_t len;
+        while (ep->reader.next(data, len))
+        {
+            frames_in.fetch_add(1, std::memory_order_relaxed);
+            if (!ep->handler(ep->conn, data, len))
+            {
+                return false;
+            }
+        }
+
+        // a short read took everything the socket had and more data raises a new
+        // edge; a hangup has no later edge, so then read on until EOF
+        if (size_t(r) < room && !hangup)
+            return true;
+    }
+}
+
+bool Reactor::sendFrame(int fd, const char *data, uint32_t len)
+{
+    FrameSend send{fd, data, len, false};
+    sendFrames(&send, 1);
+    return send.ok;
+}
+
+void Reactor::sendFrames(FrameSend *sends, size_t n)
+{
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i + 1;
+        while (j < n && j - i < MAX_GATHER && sends[j].fd == sends[i].fd)
+            ++j;
+
+        bool ok = writeGather(sends + i, j - i);
+        for (size_t k = i; k < j; ++k)
+            sends[k].ok = ok;
+        if (ok)
+            frames_out.fetch_add(j - i, std::memory_order_relaxed);
+
+        i = j;
+    }
+}
+
+bool Reactor::writeGather(const FrameSend *sends, size_t n)
+{
+    int fd = sends[0].fd;
+    uint32_t netlens[MAX_GATHER];
+    iovec iov[2 * MAX_GATHER];
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        netlens[k] = htonl(sends[k].len);
+        iov[2 * k] = {&netlens[k], sizeof(uint32_t)};
+        iov[2 * k + 1] = {const_cast<char *>(sends[k].data), sends[k].len};
+    }
+
+    // a peer that reads slowly but still heartbeats would otherwise hold the writer, and
+    // the lease on its connection, for good; the caller reports the connection broken
+    auto deadline = std::chrono::steady_clock::now() + SEND_TIMEOUT;
+
+    iovec *cur = iov;
+    size_t left = 2 * n;
+    while (left)
+    {
+        msghdr msg{};
+        msg.msg_iov = cur;
+        msg.msg_iovlen = left;
+
+        ssize_t w = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (wait.count() <= 0)
+            {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            pollfd pfd{fd, POLLOUT, 0};
+            poll(&pfd, 1, int(wait.count()));
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return false;
+
+        // skip what went out, resuming mid-iovec after a short write
+        size_t sent = w;
+        while (left && sent >= cur->iov_len)
+        {
+            sent -= cur->iov_len;
+            ++cur;
+            --left;
+        }
+        if (left)
+        {
+            cur->iov_base = static_cast<char *>(cur->iov_base) + sent;
+            cur->iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+void Reactor::closeEndpoint(int epfd, Endpoint *ep)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ep->conn.fd, nullptr);
+    if (ep->on_close)
+        ep->on_close(ep->conn);
+    close(ep->conn.fd);
+    delete ep;
+}
@@ -0,0 +1,66 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "frameReader.h"
+#include "transport.h"
+
+// The epoll transport. Serves listening sockets and every connection accepted
+// on them from a fixed set of I/O threads. Each thread owns an edge-triggered
+// epoll set; accepted connections are spread over the threads round robin and
+// stay on the thread they were given to, so a connection's frames are handled
+// in order and never concurrently. Handlers run on the I/O thread and should
+// hand work off rather than block. Each read takes whatever the socket has
+// into the connection's FrameReader, and every complete frame in it is
+// handled in place. Frames are sent with blocking gather writes: the lengths
+// and payloads of consecutive frames for one socket go out in one sendmsg, and
+// a write the socket has not taken within SEND_TIMEOUT fails like a broken one.
+class Reactor : public Transport
+{
+private:
+    // a listening socket or an accepted connection registered with some epoll set
+    struct Endpoint
+    {
+        bool listening;
+        Connection conn;
+        FrameHandler handler;
+        CloseHandler on_close;
+
+        FrameReader reader;
+    };
+
+    struct Worker
+    {
+        Reactor *reactor;
+        int epfd;
+        pthread_t thread;
+    };
+
+    std::vector<Worker> workers;
+    std::atomic<size_t> next_worker{0};
+
+    void run(int epfd);
+    void watch(int epfd, Endpoint *ep);
+    void acceptAll(Endpoint *listener);
+    bool readFrames(Endpoint *ep, bool hangup); // false once the connection has to be closed
+    void closeEndpoint(int epfd, Endpoint *ep);
+    bool writeGather(const FrameSend *sends, size_t n); // n frames for one socket
+
+public:
+    explicit Reactor(int num_threads);
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    const char *name() const override { return "epoll"; }
+    void addListener(int listenfd, FrameHandler handler, CloseHandler on_close = nullptr) override;
+    void addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close = nullptr) override;
+    bool sendFrame(int fd, const char *data, uint32_t len) override;
+    void sendFrames(FrameSend *sends, size_t n) override;
+};
+
+#endif // REACTOR_H
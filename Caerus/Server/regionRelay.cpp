@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "regionRelay.h"
+#include "connectionManager.h"
+#include "flatRequest.h"
+#include "transport.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr std::chrono::milliseconds ROUND_PERIOD{50};
+    constexpr std::chrono::milliseconds RELAY_WAIT{10}; // after the round end, for region servers that sent nothing
+    constexpr int32_t DELIVERED_WINDOW = 1200;          // rounds a delivery is remembered for
+    constexpr std::chrono::milliseconds BUSY_RETRY{2};  // for connections another writer had
+
+    std::atomic<RegionRelay *> current_relay{nullptr};
+
+    Clock::time_point roundEnd(int32_t round)
+    {
+        return LOGICAL_EPOCH + ROUND_PERIOD * (int64_t(round) + 1);
+    }
+
+    template <typename T>
+    void store(std::string &out, size_t off, T v)
+    {
+        memcpy(&out[off], &v, sizeof(v));
+    }
+
+    template <typename T>
+    T load(const char *data, size_t off)
+    {
+        T v;
+        memcpy(&v, data + off, sizeof(v));
+        return v;
+    }
+}
+
+RegionRelay::RegionRelay(const std::vector<server> &servers, int32_t self_id)
+    : self_id(self_id)
+{
+    // an unlabelled server is a region of its own
+    std::map<std::string, std::vector<int32_t>> regions;
+    std::string mine;
+    for (const server &s : servers)
+    {
+        std::string region = s.region.empty() ? "#" + std::to_string(s.id) : s.region;
+        regions[region].push_back(s.id);
+        if (s.id == self_id)
+            mine = region;
+    }
+
+    for (auto &entry : regions)
+    {
+        std::sort(entry.second.begin(), entry.second.end());
+        if (entry.first == mine)
+            members = entry.second;
+        else
+            remotes.push_back(entry.second);
+    }
+    remote_backlog.resize(remotes.size());
+
+    if (pthread_create(&thread, NULL, [](void *arg) -> void *
+                       {
+            static_cast<RegionRelay*>(arg)->run();
+            return nullptr; }, this) != 0)
+    {
+        threadError("Error creating region relay thread");
+    }
+
+    pthread_detach(thread);
+}
+
+int32_t RegionRelay::relayOf(const std::vector<int32_t> &region, int32_t round)
+{
+    return region[size_t(round) % region.size()];
+}
+
+int32_t RegionRelay::liveMember(const std::vector<int32_t> &region, int32_t round, const std::function<bool(int32_t)> &up)
+{
+    size_t first = size_t(round) % region.size();
+    for (size_t i = 0; i < region.size(); ++i)
+    {
+        int32_t candidate = region[(first + i) % region.size()];
+        if (up(candidate))
+            return candidate;
+    }
+    return -1;
+}
+
+bool RegionRelay::throughRelay(const std::vector<int32_t> &region, int32_t self, int32_t round, const std::function<bool(int32_t)> &up)
+{
+    int32_t relay = relayOf(region, round);
+    return relay == self || up(relay);
+}
+
+bool RegionRelay::throughRelay(int32_t round) const
+{
+    ConnectionManager *connections = getConnectionManager();
+    return throughRelay(members, self_id, round, [connections](int32_t id)
+                        { return connections->isUp(id); });
+}
+
+bool RegionRelay::firstDelivery(int32_t server_id, int32_t round)
+{
+    std::lock_guard<std::mutex> lk(delivered_mtx);
+    std::set<int32_t> &rounds = delivered[server_id];
+    if (!rounds.insert(round).second)
+        return false;
+
+    // a round older than the window is long merged or given up on
+    while (!rounds.empty() && *rounds.begin() < *rounds.rbegin() - DELIVERED_WINDOW)
+        rounds.erase(rounds.begin());
+    return true;
+}
+
+bool RegionRelay::inRegion(int32_t server_id) const
+{
+    return std::find(members.begin(), members.end(), server_id) != members.end();
+}
+
+bool RegionRelay::unpack(const char *data, uint32_t len, bool &fan_out, std::vector<std::string_view> &frames)
+{
+    if (len < HEADER || !isBundle(data, len))
+        return false;
+
+    fan_out = uint8_t(data[1]) & FAN_OUT;
+    uint32_t count = load<uint32_t>(data, 8);
+
+    frames.clear();
+    size_t off = HEADER;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (len - off < 4)
+            return false;
+        uint32_t frame_len = load<uint32_t>(data, off);
+        off += 4;
+        if (len - off < frame_len)
+            return false;
+        frames.emplace_back(data + off, frame_len);
+        off += frame_len;
+    }
+    return off == len;
+}
+
+const std::string &RegionRelay::OutboundBundle::encoded(bool flat)
+{
+    if (flat || protobuf_state < 0)
+        return frame;
+    if (protobuf_state > 0)
+        return protobuf_frame;
+
+    bool fan_out;
+    std::vector<std::string_view> frames;
+    unpack(frame.data(), uint32_t(frame.size()), fan_out, frames);
+
+    bool any_flat = false;
+    for (std::string_view f : frames)
+        any_flat = any_flat || FlatRequest::isFlat(f.data(), uint32_t(f.size()));
+    if (!any_flat)
+    {
+        protobuf_state = -1;
+        return frame;
+    }
+
+    // the same header, and the same frames but for the flat ones
+    protobuf_frame.assign(frame, 0, HEADER);
+    uint32_t count = 0;
+    request::Request decoded;
+    std::string serialized;
+    for (std::string_view f : frames)
+    {
+        if (FlatRequest::isFlat(f.data(), uint32_t(f.size())))
+        {
+            // a bundle passed on is read by this server only after it is queued here
+            FlatRequest flat_req(f.data(), uint32_t(f.size()));
+            if (!flat_req.valid())
+            {
+                fprintf(stderr, "RegionRelay: malformed flat frame in a bundle for round %d, left out\n",
+                        load<int32_t>(frame.data(), 4));
+                continue;
+            }
+            flat_req.decode(decoded);
+            if (!decoded.SerializeToString(&serialized))
+            {
+                perror("RegionRelay: SerializeToString failed");
+                continue;
+            }
+            f = serialized;
+        }
+        uint32_t len = uint32_t(f.size());
+        protobuf_frame.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        protobuf_frame.append(f.data(), f.size());
+        ++count;
+    }
+    store<uint32_t>(protobuf_frame, 8, count);
+    protobuf_state = 1;
+    return protobuf_frame;
+}
+
+void RegionRelay::collect(int32_t server_id, int32_t round, const char *frame, uint32_t len)
+{
+    if (round < 0 || !isRelay(round))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        collected.push_back({round, server_id, std::string(frame, len)});
+    }
+    cv.notify_one();
+}
+
+void RegionRelay::fanOut(const char *data, uint32_t len)
+{
+    if (members.size() < 2)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        fan_outs.emplace_back(data, len);
+    }
+    cv.notify_one();
+}
+
+bool RegionRelay::due(Clock::time_point now) const
+{
+    if (collected.empty())
+        return false;
+
+    int32_t oldest = collected.front().round;
+    for (const Collected &c : collected)
+        oldest = std::min(oldest, c.round);
+
+    if (now >= roundEnd(oldest) + RELAY_WAIT)
+        return true;
+
+    // every server of the region has sent the round (servers skip empty rounds, hence the wait above)
+    size_t heard = 0;
+    for (int32_t member : members)
+    {
+        for (const Collected &c : collected)
+        {
+            if (c.round == oldest && c.server_id == member)
+            {
+                ++heard;
+                break;
+            }
+        }
+    }
+    return heard == members.size();
+}
+
+void RegionRelay::run()
+{
+    while (!LOGICAL_EPOCH_READY.load())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::vector<Collected> frames;
+    std::vector<std::string> passing;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+
+            // wake at least once a round, for bundles still waiting on a connection
+            Clock::time_point wake = Clock::now() + (busy_peers ? BUSY_RETRY : ROUND_PERIOD);
+            for (const Collected &c : collected)
+                wake = std::min(wake, roundEnd(c.round) + RELAY_WAIT);
+            cv.wait_until(lk, wake, [this]()
+                          { return !fan_outs.empty() || due(Clock::now()); });
+
+            if (due(Clock::now()))
+                frames.swap(collected);
+            passing.swap(fan_outs);
+        }
+
+        if (!frames.empty())
+        {
+            bundle(frames);
+            frames.clear();
+        }
+
+        for (std::string &received : passing)
+        {
+            // the rest of the region only takes the sequences in
+            received[1] = char(uint8_t(received[1]) & ~FAN_OUT);
+            Bundle shared = std::make_shared<OutboundBundle>(std::move(received));
+            for (int32_t member : members)
+            {
+                if (member != self_id)
+                    backlog[member].push_back(shared);
+            }
+        }
+        passing.clear();
+
+        flushBacklog();
+    }
+}
+
+void RegionRelay::bundle(std::vector<Collected> &frames)
+{
+    int32_t round = frames.front().round;
+    size_t bytes = HEADER;
+    for (const Collected &c : frames)
+    {
+        round = std::min(round, c.round);
+        bytes += 4 + c.frame.size();
+    }
+
+    // one bundle for every other region, in the two encodings at most
+    std::string frame(HEADER, '\0');
+    frame.reserve(bytes);
+    frame[0] = char(MAGIC);
+    frame[1] = char(FAN_OUT);
+    store<int32_t>(frame, 4, round);
+    store<uint32_t>(frame, 8, uint32_t(frames.size()));
+    for (const Collected &c : frames)
+    {
+        uint32_t len = uint32_t(c.frame.size());
+        frame.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        frame.append(c.frame);
+    }
+    Bundle out = std::make_shared<OutboundBundle>(std::move(frame));
+
+    // which server of each region takes it is up to the connections when it is written
+    for (auto &waiting : remote_backlog)
+        waiting.push_back({round, out});
+}
+
+void RegionRelay::flushBacklog()
+{
+    ConnectionManager *connections = getConnectionManager();
+
+    // the round-driven threads never wait for another writer; busy_peers has them come back soon
+    busy_peers = false;
+
+    // (server, its remote_backlog index or -1 - the server of this region) for every lease to take
+    std::vector<std::pair<int32_t, int>> targets;
+
+    // another region's bundles go to the round's relay there, or the next server of it that is up
+    for (size_t r = 0; r < remotes.size(); ++r)
+    {
+        if (remote_backlog[r].empty())
+            continue;
+
+        const std::vector<int32_t> &region = remotes[r];
+        int32_t target = liveMember(region, remote_backlog[r].front().round, [connections](int32_t id)
+                                    { return connections->isUp(id); });
+        if (target >= 0)
+            targets.push_back({target, int(r)});
+    }
+
+    // bundles passed on to this region's servers wait for that server
+    for (auto &entry : backlog)
+    {
+        if (!entry.second.empty())
+            targets.push_back({entry.first, -1 - entry.first});
+    }
+
+    // leases are taken in ascending server id, like PartialSequencer::flushBacklog takes them
+    std::sort(targets.begin(), targets.end());
+
+    std::vector<ConnectionManager::Lease> leases;
+    std::vector<int> leased;    // per lease: its remote_backlog index, or -1 - the server of this region
+    std::vector<size_t> owners; // lease of each frame
+    std::vector<FrameSend> sends;
+
+    for (const auto &target : targets)
+    {
+        // one that is up but busy keeps its bundles rather than passing them on to the next
+        ConnectionManager::Lease lease = connections->tryAcquire(target.first);
+        if (!lease)
+        {
+            busy_peers = busy_peers || connections->isUp(target.first);
+            continue;
+        }
+
+        if (target.second >= 0)
+        {
+            for (const RemoteBundle &bundle : remote_backlog[target.second])
+            {
+                const std::string &frame = bundle.frame->encoded(lease.readsFlat());
+                owners.push_back(leases.size());
+                sends.push_back({lease.fd(), frame.data(), uint32_t(frame.size()), false});
+            }
+        }
+        else
+        {
+            for (const Bundle &bundle : backlog[target.first])
+            {
+                const std::string &frame = bundle->encoded(lease.readsFlat());
+                owners.push_back(leases.size());
+                sends.push_back({lease.fd(), frame.data(), uint32_t(frame.size()), false});
+            }
+        }
+        leases.push_back(std::move(lease));
+        leased.push_back(target.second);
+    }
+
+    if (sends.empty())
+        return;
+
+    sendFrames(sends.data(), sends.size());
+
+    std::vector<bool> failed(leases.size(), false);
+    for (size_t i = 0; i < sends.size(); ++i)
+    {
+        if (!sends[i].ok && !failed[owners[i]])
+        {
+            perror("RegionRelay: sendFrames failed");
+            // connection broken, the manager reconnects
+            failed[owners[i]] = true;
+            leases[owners[i]].broken();
+        }
+    }
+
+    for (size_t l = 0; l < leases.size(); ++l)
+    {
+        // a bundle for another region that did not go out is tried on the next server up there
+        if (leased[l] >= 0 && !failed[l])
+            remote_backlog[leased[l]].clear();
+        else if (leased[l] < 0)
+            backlog[-1 - leased[l]].clear();
+    }
+}
+
+void setRegionRelay(RegionRelay *relay)
+{
+    current_relay.store(relay);
+}
+
+RegionRelay *getRegionRelay()
+{
+    return current_relay.load();
+}
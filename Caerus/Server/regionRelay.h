@@ -0,0 +1,148 @@
+#ifndef REGION_RELAY_H
+#define REGION_RELAY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+
+#include "utils.h"
+
+// Region-level dissemination of partial sequences, with "region_relay" on and
+// servers labelled by "region" in servers.json (an unlabelled server is a region
+// of its own).
+//
+// A server sends its partial sequence straight to the other servers of its own
+// region only. Every round one of them, taken in turn by id, is the region's
+// relay: it keeps the frames of that round's sequences from its region (its own
+// and the ones it received) and, once it has all of them or RELAY_WAIT after the
+// round end, sends them as one bundle to one server of every other region, the
+// relay of the round there if it is up. The server a bundle arrives at hands the
+// sequences in it to its merger and passes the bundle on to the rest of its
+// region. Cross-region, a round costs one frame per pair of regions instead of
+// one per pair of servers.
+//
+// A server whose connection to the round's relay is down sends that round's
+// sequence straight to every other server instead, and a bundle goes to the
+// next server of the other region that is up when it is written. A sequence can
+// then arrive twice (say through the relay once it is back, and directly); the
+// servers hand each server's round to their merger only once.
+//
+// A bundle frame, little-endian:
+//   header  magic, flags (FAN_OUT: pass it on to the rest of the region), 2
+//           spare, round, frame count                                     12 bytes
+//   frames  length (4 bytes) and the frame, as the server that sent it encoded it
+//
+// A flat frame in a bundle (see FlatRequest) only goes to servers that said they
+// read flat; the others get the bundle with it turned into protobuf, built the
+// first time such a server's connection wants it.
+//
+// The magic byte has wire type 7 like FlatRequest's, so bundles share peer
+// connections with the other frames.
+class RegionRelay
+{
+public:
+    static constexpr uint8_t MAGIC = 0xCF;
+    static constexpr uint8_t FAN_OUT = 1;
+    static constexpr size_t HEADER = 12;
+
+private:
+    struct Collected
+    {
+        int32_t round;
+        int32_t server_id;
+        std::string frame;
+    };
+
+    // A bundle on its way out, shared by every server it goes to.
+    struct OutboundBundle
+    {
+        std::string frame;          // as it was put together, flat frames included
+        std::string protobuf_frame; // the same with every flat frame as protobuf
+        int protobuf_state = 0;     // 0 not built yet, 1 built, -1 frame has no flat frames
+
+        explicit OutboundBundle(std::string frame_) : frame(std::move(frame_)) {}
+
+        const std::string &encoded(bool flat);
+    };
+
+    using Bundle = std::shared_ptr<OutboundBundle>;
+
+    int32_t self_id;
+    std::vector<int32_t> members;              // this region's servers, by id
+    std::vector<std::vector<int32_t>> remotes; // every other region's servers, by id
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Collected> collected;   // this region's sequences for the next bundle, in arrival order
+    std::vector<std::string> fan_outs;  // bundles from other regions for the rest of this one
+    pthread_t thread;
+
+    // bundles waiting for a connection, oldest first; relay thread only
+    struct RemoteBundle
+    {
+        int32_t round;
+        Bundle frame;
+    };
+    std::vector<std::vector<RemoteBundle>> remote_backlog; // per region in remotes, to whichever server is up
+    std::map<int, std::vector<Bundle>> backlog;            // per server of this region
+    bool busy_peers = false;                               // some wait only for another writer to finish
+
+    // (server, round) of the partial sequences bundles brought, for the rounds still in the window
+    std::mutex delivered_mtx;
+    std::map<int32_t, std::set<int32_t>> delivered;
+
+    void run();
+    bool due(std::chrono::steady_clock::time_point now) const; // with mtx held
+    void bundle(std::vector<Collected> &frames);
+    void flushBacklog();
+
+    static int32_t relayOf(const std::vector<int32_t> &region, int32_t round);
+
+public:
+    RegionRelay(const std::vector<server> &servers, int32_t self_id);
+    RegionRelay(const RegionRelay &) = delete;
+    RegionRelay &operator=(const RegionRelay &) = delete;
+
+    static bool isBundle(const char *data, uint32_t len) { return len > 0 && uint8_t(data[0]) == MAGIC; }
+
+    // The frames in a bundle, false if it is malformed.
+    static bool unpack(const char *data, uint32_t len, bool &fan_out, std::vector<std::string_view> &frames);
+
+    // The server of region a bundle for round goes to: the round's relay there or
+    // the next one after it that is up; -1 if none is.
+    static int32_t liveMember(const std::vector<int32_t> &region, int32_t round, const std::function<bool(int32_t)> &up);
+
+    // Whether self's partial sequence for round leaves the region through a relay
+    // (self, or one up is); otherwise self sends it to every other server itself.
+    static bool throughRelay(const std::vector<int32_t> &region, int32_t self, int32_t round, const std::function<bool(int32_t)> &up);
+
+    // Whether server_id's partial sequences go to the other regions through here.
+    bool inRegion(int32_t server_id) const;
+    bool isRelay(int32_t round) const { return relayOf(members, round) == self_id; }
+    bool throughRelay(int32_t round) const;
+
+    // False if a partial sequence of server_id for round came here before; a
+    // sequence can take two ways when a relay goes down (see above).
+    bool firstDelivery(int32_t server_id, int32_t round);
+
+    // A partial sequence (as it was encoded for the wire) of a server in this
+    // region; kept for the bundle if this server is the round's relay.
+    void collect(int32_t server_id, int32_t round, const char *frame, uint32_t len);
+
+    // A bundle from another region that came here with FAN_OUT set.
+    void fanOut(const char *data, uint32_t len);
+};
+
+// The relay of this server's region if "region_relay" is on, otherwise nullptr; set once at startup.
+void setRegionRelay(RegionRelay *relay);
+RegionRelay *getRegionRelay();
+
+#endif // REGION_RELAY_H
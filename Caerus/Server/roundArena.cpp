@@ -0,0 +1,101 @@
+#include <vector>
+
+#include "roundArena.h"
+
+std::mutex RoundArena::registry_mtx;
+std::unordered_map<int64_t, std::weak_ptr<RoundArena>> RoundArena::registry;
+
+google::protobuf::ArenaOptions RoundArena::options()
+{
+    google::protobuf::ArenaOptions opts;
+    opts.start_block_size = FIRST_BLOCK;
+    opts.max_block_size = MAX_BLOCK;
+    return opts;
+}
+
+RoundArena::RoundArena(int64_t round_)
+    : round(round_), arena(options())
+{
+}
+
+RoundArena::~RoundArena()
+{
+    std::lock_guard<std::mutex> lk(registry_mtx);
+    auto it = registry.find(round);
+
+    // the round may already have been reopened by a late caller; leave that one alone
+    if (it != registry.end() && it->second.expired())
+    {
+        registry.erase(it);
+    }
+}
+
+std::shared_ptr<RoundArena> RoundArena::forRound(int64_t round)
+{
+    std::lock_guard<std::mutex> lk(registry_mtx);
+    auto &slot = registry[round];
+
+    std::shared_ptr<RoundArena> arena = slot.lock();
+    if (!arena)
+    {
+        arena = std::make_shared<RoundArena>(round);
+        slot = arena;
+    }
+    return arena;
+}
+
+std::shared_ptr<request::Request> RoundArena::newRequest()
+{
+    auto *req = google::protobuf::Arena::CreateMessage<request::Request>(&arena);
+    return std::shared_ptr<request::Request>(shared_from_this(), req);
+}
+
+std::shared_ptr<request::Request> RoundArena::newRequestOver(std::vector<std::shared_ptr<request::Request>> sources)
+{
+    struct Owner
+    {
+        std::shared_ptr<RoundArena> arena;
+        std::vector<std::shared_ptr<request::Request>> sources;
+    };
+
+    auto owner = std::make_shared<Owner>(Owner{shared_from_this(), std::move(sources)});
+    auto *req = google::protobuf::Arena::CreateMessage<request::Request>(&arena);
+    return std::shared_ptr<request::Request>(owner, req);
+}
+
+std::shared_ptr<request::Request> RoundArena::parseRequest(int64_t round, const char *data, uint32_t len)
+{
+    // a weak reference, so an idle thread does not hold on to a round it saw last
+    static thread_local std::weak_ptr<RoundArena> last;
+
+    std::shared_ptr<RoundArena> arena = last.lock();
+    if (!arena || arena->round != round)
+    {
+        arena = forRound(round);
+        last = arena;
+    }
+
+    std::shared_ptr<request::Request> req = arena->newRequest();
+    if (!req->ParseFromArray(data, len))
+        return nullptr;
+    return req;
+}
+
+RoundArenaStats RoundArena::stats()
+{
+    // declared before the lock so the references are dropped after it is released
+    std::vector<std::shared_ptr<RoundArena>> live;
+    std::lock_guard<std::mutex> lk(registry_mtx);
+
+    RoundArenaStats s{0, 0};
+    for (auto &entry : registry)
+    {
+        if (auto arena = entry.second.lock())
+        {
+            s.bytes += arena->arena.SpaceAllocated();
+            live.push_back(std::move(arena));
+        }
+    }
+    s.live = live.size();
+    return s;
+}
@@ -0,0 +1,71 @@
+#ifndef ROUND_ARENA_H
+#define ROUND_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+
+#include "../proto/request.pb.h"
+
+struct RoundArenaStats
+{
+    size_t live;  // rounds whose arena has not been released yet
+    size_t bytes; // memory those arenas hold
+};
+
+// Memory for everything the pipeline builds on behalf of one round: the
+// requests that came in during it (from clients and from peers, parsed straight
+// onto the arena) and the partial sequence built by the partial sequencer. Messages are bump-allocated and never freed one by one;
+// the whole arena goes away in one step when the last reference to it is
+// dropped. The merger's graph nodes keep the arena of the partial sequence
+// they came from, since their operations point into it, so a round is
+// released once all of its transactions have left the graph.
+class RoundArena : public std::enable_shared_from_this<RoundArena>
+{
+private:
+    static constexpr size_t FIRST_BLOCK = 16 * 1024;
+    static constexpr size_t MAX_BLOCK = 256 * 1024;
+
+    static std::mutex registry_mtx;
+    static std::unordered_map<int64_t, std::weak_ptr<RoundArena>> registry;
+
+    int64_t round;
+    google::protobuf::Arena arena;
+
+    static google::protobuf::ArenaOptions options();
+
+public:
+    explicit RoundArena(int64_t round_);
+    RoundArena(const RoundArena &) = delete;
+    RoundArena &operator=(const RoundArena &) = delete;
+    ~RoundArena();
+
+    // Returns the arena for round, opening it if nothing holds it right now.
+    static std::shared_ptr<RoundArena> forRound(int64_t round);
+
+    // Allocates an empty request on this arena. The returned pointer holds a
+    // reference to the arena rather than to the message.
+    std::shared_ptr<request::Request> newRequest();
+
+    // Like newRequest, but the request may also point into the messages in
+    // sources, which it keeps alive: their transactions can be added to it with
+    // UnsafeArenaAddAllocated instead of being copied. All of them must be on
+    // arenas, so that no message ever deletes what it shares.
+    std::shared_ptr<request::Request> newRequestOver(std::vector<std::shared_ptr<request::Request>> sources);
+
+    // Parses a frame that has just come in onto the arena of round; nullptr if
+    // it is not a request. Every thread remembers the arena it parsed into last,
+    // so the registry is only consulted when the round turns.
+    static std::shared_ptr<request::Request> parseRequest(int64_t round, const char *data, uint32_t len);
+
+    static RoundArenaStats stats();
+
+    int64_t getRound() const { return round; }
+};
+
+#endif // ROUND_ARENA_H
@@ -4,191 +4,200 @@
 #include <cstring>
 
 #include "server.h"
+#include "connectionManager.h"
+#include "roundArena.h"
+#include "regionRelay.h"
 #include "../proto/request.pb.h"
 
-PeerListener::PeerListener(int listenfd, PartialSequencer* partial_sequencer, Merger* merger)
+PeerListener::PeerListener(int listenfd, int local_listenfd, PartialSequencer* partial_sequencer, Merger* merger, Transport* transport)
 {
 
-    args =  {listenfd, partial_sequencer, merger};
-    pthread_t listener_thread;
+    args =  {listenfd, local_listenfd, partial_sequencer, merger};
 
-    if (pthread_create(&listener_thread, NULL, peerListener, (void*)&args) != 0)
-    {
-        threadError("error creating server listener thread");
-    }
-    
-    pthread_detach(listener_thread);
-
-}
+    FrameHandler handler = [partial_sequencer, merger](Connection &conn, const char *data, uint32_t len)
+    { return handlePeerFrame(conn, data, len, partial_sequencer, merger); };
 
-void *handlePeer(void *server_args)
-{
-
-    //printf("handlePeer: started\n");
+    // peers that connect here and the peers this server connects to are served alike
+    ConnectionManager *connections = getConnectionManager();
+    CloseHandler on_close = [connections](Connection &conn)
+    { connections->closed(conn); };
 
-    // 1) Cast and copy the entire struct
-    auto* ptr = static_cast<ServerArgs*>(server_args);
-    ServerArgs local = *ptr;     // copies connfd, server_addr, partial_sequencer, merger…
-    free(ptr);
+    transport->addListener(listenfd, handler, on_close);
+    if (local_listenfd >= 0)
+        transport->addListener(local_listenfd, handler, on_close);
+    connections->serve(transport, handler);
 
-    // 2) Now use 'local' safely
-    int connfd = local.connfd;
-    sockaddr_in server_addr = local.server_addr;
-    auto* partial_sequencer = local.partial_sequencer;
-    auto* merger = local.merger;
+}
 
-    // get server's IP address and port
-    char *server_ip = inet_ntoa(server_addr.sin_addr);
-    int server_port = ntohs(server_addr.sin_port);
+bool handlePeerFrame(Connection &conn, const char *data, uint32_t msglen, PartialSequencer* partial_sequencer, Merger* merger)
+{
+    const char *server_ip = conn.ip.c_str();
+    int server_port = conn.port;
+
+    // any frame from a peer is a heartbeat
+    if (conn.peer >= 0)
+        getConnectionManager()->heard(conn.peer);
+
+    // a flat partial sequence is not parsed at all: the merger reads it where it lies
+    if (FlatRequest::isFlat(data, msglen))
+        return handleFlatFrame(conn, data, msglen);
+
+    // another region's partial sequences, from its relay or passed on by ours
+    if (RegionRelay::isBundle(data, msglen))
+        return handleBundleFrame(conn, data, msglen);
+
+    // parse, onto the arena of the round it came in during
+    SharedRequest req = RoundArena::parseRequest(currentRound(), data, msglen);
+    if (!req) {
+        fprintf(stderr, "ParseFromArray failed (%u bytes) from %s:%d\n",
+                msglen,
+                server_ip, server_port);
+        return false;
+    }
+    const request::Request &req_proto = *req;
 
-    while (true) //maintain a persistent connection
+    // Check the recipient
+    if (req_proto.recipient() == request::Request::PING)
     {
-        // read the 4-byte length prefix
-        uint32_t netlen;
-        ssize_t len = readNBytes(connfd, &netlen, sizeof(netlen));
-        if (len == 0) {
-            // peer cleanly closed
-            break;
-        }
-        if (len < 0 || len != sizeof(netlen)) {
-            fprintf(stderr, "PEER_HANDLER: length read error from %s:%d\n",
-                    server_ip, server_port);
-            break;
-        }
-
-        uint32_t msglen = ntohl(netlen);
-
-        // read exactly msglen bytes
-        std::vector<char> buf(msglen);
-        ssize_t bytes_read = readNBytes(connfd, buf.data(), msglen);
-
-        if (bytes_read != static_cast<ssize_t>(msglen)) {
-            fprintf(stderr,
-                    "PEER_HANDLER: Truncated read: expected %u bytes, got %zd bytes from %s:%d\n",
-                    msglen,             // what we expected
-                    bytes_read,         // what we actually got
-                    server_ip,          // peer IP
-                    server_port         // peer port
-            );
-            break;
-        }
-    
-        // parse
-        request::Request req_proto;
-        if (!req_proto.ParseFromArray(buf.data(), msglen)) {
-            fprintf(stderr, "ParseFromArray failed (%u bytes) from %s:%d\n",
-                    msglen,
-                    server_ip, server_port);
-            break;
-        }
+        ConnectionManager *connections = getConnectionManager();
+
+        // the first frame on a connection a peer opened says who it is
+        if (conn.peer < 0 && !connections->hello(conn, req_proto.server_id()))
+            return false;
+        // and every PING which wire formats its sender reads
+        connections->formats(conn, req_proto.client_id());
+        // a co-located peer moving the rest of its frames to a shared-memory ring
+        if (req_proto.has_round())
+            return connections->ringOffered(conn, req_proto.round());
+        return true;
+    }
+    else if (req_proto.recipient() == request::Request::PARTIAL)
+    {
+        //printf("PARTIAL: received transaction %s from: %d\n", req_proto.transaction(0).id().c_str(), req_proto.server_id());
 
-        // Check the recipient
-        if (req_proto.recipient() == request::Request::PING)
-        {
-            continue;
-        }
-        else if (req_proto.recipient() == request::Request::PARTIAL)
+        // not a transaction: a merger that never got the bodies of some it was sent the names of
+        if (req_proto.target_server_id() == BODIES_WANTED)
         {
-            //printf("PARTIAL: received transaction %s from: %d\n", req_proto.transaction(0).id().c_str(), req_proto.server_id());
-            partial_sequencer->pushReceivedTransactionIntoPartialSequence(req_proto);
+            partial_sequencer->resendBodies(std::move(req));
+            return true;
         }
-        else if (req_proto.recipient() == request::Request::MERGER)
-        {
-
 
-            // if partial sequence is empty, ignore
-            if (req_proto.transaction_size() > 0) {
-                //printf("MERGER: received partial sequence from: %d\n", req_proto.server_id());
-            }
-            
+        // the one copy of the body this server gets, whoever sequences it
+        if (PAYLOAD_DEDUP)
+        {
             {
                 std::lock_guard<std::mutex> lk(partial_sequencer_to_merger_queue_mtx);
-                partial_sequencer_to_merger_queue_.push(req_proto);
-            } // unlock first
-            
+                partial_sequencer_to_merger_queue_.push({req, nullptr, true});
+            }
             partial_sequencer_to_merger_queue_cv.notify_one();
+        }
+
+        if (req_proto.target_server_id() != PAYLOAD_ONLY)
+            partial_sequencer->pushReceivedTransactionIntoPartialSequence(std::move(req));
+    }
+    else if (req_proto.recipient() == request::Request::MERGER)
+    {
+
 
+        // if partial sequence is empty, ignore
+        if (req_proto.transaction_size() > 0) {
+            //printf("MERGER: received partial sequence from: %d\n", req_proto.server_id());
         }
-        else if(req_proto.recipient() == request::Request::START)
+        
+        deliverPartialSequence({req, nullptr}, req_proto.server_id(), req_proto.round(), data, msglen);
+    }
+    else if(req_proto.recipient() == request::Request::START)
+    {
+        LOGICAL_EPOCH = std::chrono::steady_clock::now();
+        LOGICAL_EPOCH_READY.store(true);
+        printf("Received START from server %d, logical epoch set.\n", req_proto.server_id());
+        
+    }else if (req_proto.recipient() == request::Request::READY) {
+        int sender_id = req_proto.server_id();  // whichever ID the other server put
         {
-            LOGICAL_EPOCH = std::chrono::steady_clock::now();
-            LOGICAL_EPOCH_READY.store(true);
-            printf("Received START from server %d, logical epoch set.\n", req_proto.server_id());
-            
-        }else if (req_proto.recipient() == request::Request::READY) {
-            int sender_id = req_proto.server_id();  // whichever ID the other server put
-            {
 
-                printf("Received READY from server %d\n", sender_id);
+            printf("Received READY from server %d\n", sender_id);
 
-                std::lock_guard<std::mutex> lg(READY_MTX);
-                if (READY_SET.insert(sender_id).second) {
-                    // first time seeing this server’s READY
-                    READY_CV.notify_one();
-                }
+            std::lock_guard<std::mutex> lg(READY_MTX);
+            if (READY_SET.insert(sender_id).second) {
+                // first time seeing this server’s READY
+                READY_CV.notify_one();
             }
-        }else
-        {
-            fprintf(stderr, "Unknown recipient type: %d from %s:%d\n",
-                    req_proto.recipient(), server_ip, server_port);
-            break;
-
         }
+    }else
+    {
+        fprintf(stderr, "Unknown recipient type: %d from %s:%d\n",
+                req_proto.recipient(), server_ip, server_port);
+        return false;
 
     }
-    
-    close(connfd);
-    return nullptr;
+
+    return true;
 }
 
-void *peerListener(void *args)
+bool handleFlatFrame(Connection &conn, const char *data, uint32_t msglen)
 {
-    PeerListenerThreadsArgs *my_args = (PeerListenerThreadsArgs *)args;
-    struct sockaddr_in server_addr;
-    socklen_t server_addrlen = sizeof(server_addr);
-
-    while (true)
+    // the frame only lives as long as this call; the copy is checked once, here
+    SharedFlatRequest req = FlatRequest::copy(data, msglen);
+    if (!req || req->recipient() != request::Request::MERGER)
     {
-        int connfd = accept(my_args->listenfd, (struct sockaddr *)&server_addr, &server_addrlen);
+        fprintf(stderr, "malformed flat frame (%u bytes) from %s:%d\n", msglen, conn.ip.c_str(), conn.port);
+        return false;
+    }
 
-        if (connfd < 0)
-        {
-            if (errno == EWOULDBLOCK)
-            {
-                usleep(10000);
-                continue;
-            }
-            else
-            {
-                threadError("serverListener: error accepting connection");
-            }
-        }
+    deliverPartialSequence({nullptr, req}, req->server_id(), req->round(), data, msglen);
+    return true;
+}
 
-        // server args
-        ServerArgs *server_args = (ServerArgs *)malloc(sizeof(ServerArgs));
+void deliverPartialSequence(PartialSequenceMsg msg, int32_t sid, int32_t round, const char *data, uint32_t msglen)
+{
+    // with relays, a sequence can come both through one and directly; the merger takes it once
+    RegionRelay *relay = getRegionRelay();
+    if (relay && !relay->firstDelivery(sid, round))
+        return;
 
-        if (!server_args)
-        {
-            close(connfd);
-            threadError("serverListener: memory allocation failed");
-        }
+    {
+        std::lock_guard<std::mutex> lk(partial_sequencer_to_merger_queue_mtx);
+        partial_sequencer_to_merger_queue_.push(std::move(msg));
+    } // unlock first
+    partial_sequencer_to_merger_queue_cv.notify_one();
+
+    // this region's sequences go on to the others from the round's relay
+    if (relay && relay->inRegion(sid))
+        relay->collect(sid, round, data, msglen);
+}
 
-        server_args->connfd = connfd;
-        server_args->server_addr = server_addr;
-        server_args->partial_sequencer = my_args->partial_sequencer;
-        server_args->merger = my_args->merger;
+bool handleBundleFrame(Connection &conn, const char *data, uint32_t msglen)
+{
+    bool fan_out = false;
+    std::vector<std::string_view> frames;
+    if (!RegionRelay::unpack(data, msglen, fan_out, frames))
+    {
+        fprintf(stderr, "malformed bundle (%u bytes) from %s:%d\n", msglen, conn.ip.c_str(), conn.port);
+        return false;
+    }
 
-        pthread_t server_thread;
+    RegionRelay *relay = getRegionRelay();
+    if (fan_out && relay)
+        relay->fanOut(data, msglen);
 
-        if (pthread_create(&server_thread, NULL, handlePeer, (void *)server_args) != 0)
+    // a bundle holds partial sequences only: nothing in it speaks for the connection it came on
+    for (std::string_view frame : frames)
+    {
+        if (FlatRequest::isFlat(frame.data(), uint32_t(frame.size())))
         {
-            free(server_args);
-            close(connfd);
-            threadError("serverListener: error creating thread");
+            if (!handleFlatFrame(conn, frame.data(), uint32_t(frame.size())))
+                return false;
+            continue;
         }
 
-        pthread_detach(server_thread);
+        SharedRequest req = RoundArena::parseRequest(currentRound(), frame.data(), uint32_t(frame.size()));
+        if (!req || req->recipient() != request::Request::MERGER)
+        {
+            fprintf(stderr, "bad frame in a bundle from %s:%d\n", conn.ip.c_str(), conn.port);
+            return false;
+        }
+        deliverPartialSequence({req, nullptr}, req->server_id(), req->round(), frame.data(), uint32_t(frame.size()));
     }
-
-    pthread_exit(NULL);
+    return true;
 }
@@ -8,34 +8,32 @@
 #include "utils.h"
 #include "partialSequencer.h"
 #include "merger.h"
+#include "transport.h"
 
-struct PeerListenerThreadsArgs
+struct PeerListenerArgs
 {
     int listenfd;
+    int local_listenfd; // AF_UNIX, for peers on the same machine; -1 if none
     PartialSequencer* partial_sequencer;
     Merger* merger;
 };
 
-struct ServerArgs
-{
-    int connfd;
-    struct sockaddr_in server_addr;
-    PartialSequencer* partial_sequencer;
-    Merger* merger;
-
-};
-
+// Handles one frame received on a peer connection; returns false to drop the connection.
+bool handlePeerFrame(Connection &conn, const char *data, uint32_t msglen, PartialSequencer* partial_sequencer, Merger* merger);
+bool handleFlatFrame(Connection &conn, const char *data, uint32_t msglen);
+bool handleBundleFrame(Connection &conn, const char *data, uint32_t msglen);
 
-void* handlePeer(void *server_args);
-void* peerListener(void *args);
+// Hands a partial sequence received from a peer (data, its frame) to the merger,
+// and to the region relay if it is one of this region's.
+void deliverPartialSequence(PartialSequenceMsg msg, int32_t sid, int32_t round, const char *data, uint32_t msglen);
 
 class PeerListener
 {
 private:
-    PeerListenerThreadsArgs args;
+    PeerListenerArgs args;
 public:
 
-    PeerListener(int listenfd, PartialSequencer* partial_sequencer, Merger* merger);
+    PeerListener(int listenfd, int local_listenfd, PartialSequencer* partial_sequencer, Merger* merger, Transport* transport);
 
 };
 
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#include "shmRing.h"
+
+namespace
+{
+    // polls of the other side's position before sleeping; none on one CPU, where
+    // the other side cannot move while this one spins
+    const int SPINS = std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+    constexpr long SLEEP_NS = 20'000'000; // a sleeper looks at the closed flag at least this often
+
+    inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // not FUTEX_PRIVATE: the word is in memory shared with another process
+    void futexWait(std::atomic<uint32_t> *word, uint32_t expected)
+    {
+        timespec timeout{0, SLEEP_NS};
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+    }
+
+    void futexWake(std::atomic<uint32_t> *word)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+// At the start of the segment; the ring's bytes follow it. Positions only grow,
+// the offset into the ring is a position modulo the capacity.
+struct ShmRing::Header
+{
+    alignas(64) std::atomic<uint64_t> head; // bytes consumed, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail; // bytes produced, written by the producer
+
+    alignas(64) std::atomic<uint32_t> data_seq;  // futex the consumer sleeps on
+    std::atomic<uint32_t> room_seq;              // futex the producer sleeps on
+    std::atomic<uint32_t> consumer_asleep;
+    std::atomic<uint32_t> producer_asleep;
+    std::atomic<uint32_t> is_closed;
+    uint64_t capacity;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "the ring's atomics are shared between processes");
+
+std::shared_ptr<ShmRing> ShmRing::create(const std::string &name, size_t capacity)
+{
+    size_t cap = 4096;
+    while (cap < capacity)
+        cap <<= 1;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ShmRing: cannot create %s: %s\n", name.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    std::shared_ptr<ShmRing> ring(new ShmRing());
+    ring->segment = name;
+
+    size_t size = sizeof(Header) + cap;
+    if (ftruncate(fd, size) < 0 || !ring->map(fd, size))
+    {
+        fprintf(stderr, "ShmRing: cannot size %s: %s\n", name.c_str(), strerror(errno));
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    ::close(fd);
+
+    // the segment starts out zeroed, which is an empty, open ring
+    ring->header->capacity = cap;
+    ring->capacity = cap;
+    return ring;
+}
+
+std::shared_ptr<ShmRing> ShmRing::open(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ShmRing: cannot open %s: %s\n", name.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    // both sides have it mapped now, nothing else needs the name
+    shm_unlink(name.c_str());
+
+    std::shared_ptr<ShmRing> ring(new ShmRing());
+    ring->segment = name;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) <= sizeof(Header) || !ring->map(fd, st.st_size))
+    {
+        fprintf(stderr, "ShmRing: cannot map %s\n", name.c_str());
+        ::close(fd);
+        return nullptr;
+    }
+    ::close(fd);
+
+    ring->capacity = ring->header->capacity;
+    if (ring->capacity + sizeof(Header) != ring->mapped)
+    {
+        fprintf(stderr, "ShmRing: %s is not a ring\n", name.c_str());
+        return nullptr;
+    }
+    return ring;
+}
+
+bool ShmRing::map(int fd, size_t size)
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+
+    mapped = size;
+    header = static_cast<Header *>(p);
+    data = static_cast<char *>(p) + sizeof(Header);
+    return true;
+}
+
+ShmRing::~ShmRing()
+{
+    if (header)
+        munmap(header, mapped);
+}
+
+void ShmRing::close()
+{
+    header->is_closed.store(1);
+    header->data_seq.fetch_add(1);
+    header->room_seq.fetch_add(1);
+    futexWake(&header->data_seq);
+    futexWake(&header->room_seq);
+
+    // in case the consumer never opened it
+    shm_unlink(segment.c_str());
+}
+
+bool ShmRing::closed() const
+{
+    return header->is_closed.load(std::memory_order_acquire) != 0;
+}
+
+void ShmRing::wakeConsumer()
+{
+    // pairs with the fence in waitForData: either the consumer sees the new tail
+    // or this sees it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->consumer_asleep.load(std::memory_order_relaxed))
+    {
+        header->data_seq.fetch_add(1);
+        futexWake(&header->data_seq);
+    }
+}
+
+void ShmRing::wakeProducer()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->producer_asleep.load(std::memory_order_relaxed))
+    {
+        header->room_seq.fetch_add(1);
+        futexWake(&header->room_seq);
+    }
+}
+
+bool ShmRing::waitForRoom(uint64_t tail, uint64_t &head)
+{
+    for (int i = 0; i < SPINS; ++i)
+    {
+        head = header->head.load(std::memory_order_acquire);
+        if (tail - head < capacity)
+            return true;
+        cpuRelax();
+    }
+
+    while (!closed())
+    {
+        uint32_t seq = header->room_seq.load();
+        header->producer_asleep.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        head = header->head.load(std::memory_order_acquire);
+        if (tail - head < capacity)
+        {
+            header->producer_asleep.store(0);
+            return true;
+        }
+
+        futexWait(&header->room_seq, seq);
+        header->producer_asleep.store(0);
+    }
+    return false;
+}
+
+bool ShmRing::waitForData(uint64_t head)
+{
+    for (int i = 0; i < SPINS; ++i)
+    {
+        if (header->tail.load(std::memory_order_acquire) != head)
+            return true;
+        cpuRelax();
+    }
+
+    while (!closed())
+    {
+        uint32_t seq = header->data_seq.load();
+        header->consumer_asleep.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (header->tail.load(std::memory_order_acquire) != head)
+        {
+            header->consumer_asleep.store(0);
+            return true;
+        }
+
+        futexWait(&header->data_seq, seq);
+        header->consumer_asleep.store(0);
+    }
+    return false;
+}
+
+void ShmRing::write(FrameSend *sends, size_t n)
+{
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+
+    // copies len bytes in, publishing what is there whenever it has to wait for room
+    auto put = [&](const char *src, size_t len) -> bool
+    {
+        while (len)
+        {
+            if (tail - head == capacity)
+            {
+                header->tail.store(tail, std::memory_order_release);
+                wakeConsumer();
+                if (!waitForRoom(tail, head))
+                    return false;
+            }
+
+            size_t off = tail & (capacity - 1);
+            size_t chunk = std::min({len, size_t(capacity - (tail - head)), capacity - off});
+            memcpy(data + off, src, chunk);
+            src += chunk;
+            len -= chunk;
+            tail += chunk;
+        }
+        return true;
+    };
+
+    bool open = !closed();
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint32_t netlen = htonl(sends[i].len);
+        open = open && put(reinterpret_cast<const char *>(&netlen), sizeof(netlen)) &&
+               put(sends[i].data, sends[i].len);
+        sends[i].ok = open;
+    }
+
+    // the whole batch is published at once; a frame cut short by a close is never read
+    header->tail.store(tail, std::memory_order_release);
+    wakeConsumer();
+}
+
+bool ShmRing::consume(const FrameHandler &handler, Connection &conn)
+{
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        uint64_t tail = header->tail.load(std::memory_order_acquire);
+        if (tail == head)
+        {
+            if (!waitForData(head))
+                return true;
+            continue;
+        }
+
+        // up to the end of the ring; what wraps around comes next time
+        size_t off = head & (capacity - 1);
+        size_t len = std::min(size_t(tail - head), capacity - off);
+        if (closed())
+            return true;
+        if (!feed(handler, conn, data + off, len))
+            return false;
+
+        // the producer may only reuse the bytes once every frame in them is handled
+        head += len;
+        header->head.store(head, std::memory_order_release);
+        wakeProducer();
+    }
+}
+
+bool ShmRing::feed(const FrameHandler &handler, Connection &conn, const char *bytes, size_t len)
+{
+    if (pending.buffered() != 0)
+    {
+        pending.append(bytes, len);
+
+        const char *frame;
+        uint32_t frame_len;
+        while (pending.next(frame, frame_len))
+        {
+            if (!handler(conn, frame, frame_len))
+                return false;
+        }
+        return true;
+    }
+
+    // the common case: whole frames straight out of the segment
+    size_t off = 0;
+    while (len - off >= sizeof(uint32_t))
+    {
+        uint32_t netlen;
+        memcpy(&netlen, bytes + off, sizeof(netlen));
+        uint32_t frame_len = ntohl(netlen);
+        if (len - off - sizeof(netlen) < frame_len)
+            break;
+
+        if (!handler(conn, bytes + off + sizeof(netlen), frame_len))
+            return false;
+        off += sizeof(netlen) + frame_len;
+    }
+
+    if (off < len)
+        pending.append(bytes + off, len - off);
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "frameReader.h"
+#include "transport.h"
+
+// A single-producer single-consumer byte ring in a POSIX shared-memory segment,
+// carrying frames between two processes on one machine. The producer copies the
+// same bytes a socket would carry (4-byte big-endian length, then the payload)
+// straight into the segment, and the consumer hands every whole frame to its
+// handler in place, so a frame is copied once and never goes through the
+// kernel. Neither side makes a system call while the other keeps up: a side
+// only sleeps (on a futex in the segment) after spinning for a while, and the
+// other side only wakes it when it has said it is asleep.
+//
+// One producer and one consumer at a time; callers serialize their writers.
+class ShmRing
+{
+private:
+    struct Header;
+
+    std::string segment;
+    Header *header = nullptr;
+    char *data = nullptr;
+    size_t mapped = 0;
+    size_t capacity = 0; // a power of two
+
+    FrameReader pending; // consumer: start of a frame that wraps around the end
+
+    ShmRing() = default;
+    bool map(int fd, size_t size);
+    bool waitForRoom(uint64_t tail, uint64_t &head); // producer; false once closed
+    bool waitForData(uint64_t head);                 // consumer; false once closed
+    void wakeConsumer();
+    void wakeProducer();
+    bool feed(const FrameHandler &handler, Connection &conn, const char *bytes, size_t len);
+
+public:
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+    ~ShmRing();
+
+    // Producer side: a new segment of at least capacity bytes under name ("/..."),
+    // nullptr if it cannot be created.
+    static std::shared_ptr<ShmRing> create(const std::string &name, size_t capacity);
+
+    // Consumer side: maps the segment created under name and unlinks the name.
+    static std::shared_ptr<ShmRing> open(const std::string &name);
+
+    // Appends frames, waiting for room as needed; each entry's ok says whether its
+    // frame went in, which stops being the case once the ring is closed.
+    void write(FrameSend *sends, size_t n);
+
+    // Hands frames to handler until the ring is closed (true) or the handler
+    // returns false (false). Frames point into the segment and are only valid
+    // during the call.
+    bool consume(const FrameHandler &handler, Connection &conn);
+
+    // Either side: no more frames. Wakes the other side, which sees it too.
+    void close();
+    bool closed() const;
+
+    const std::string &name() const { return segment; }
+};
+
+#endif // SHM_RING_H
@@ -0,0 +1,163 @@
+#ifndef SMALL_VECTOR_H
+#define SMALL_VECTOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+// Vector that keeps up to N elements inline and only goes to the heap once it
+// grows past that. Meant for small sets of plain values such as adjacency
+// lists, where most nodes have a handful of entries: insertUnique does the
+// duplicate check with a linear scan and erase does not keep the order.
+template <typename T, uint32_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector only holds trivially copyable values");
+
+private:
+    union
+    {
+        T inline_data[N];
+        T *heap_data;
+    };
+    uint32_t count = 0;
+    uint32_t capacity = N;
+
+    bool isInline() const { return capacity == N; }
+    T *data() { return isInline() ? inline_data : heap_data; }
+    const T *data() const { return isInline() ? inline_data : heap_data; }
+
+    void grow()
+    {
+        uint32_t new_capacity = capacity * 2;
+        T *bigger = static_cast<T *>(std::malloc(sizeof(T) * new_capacity));
+        if (bigger == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        std::memcpy(bigger, data(), sizeof(T) * count);
+        if (!isInline())
+        {
+            std::free(heap_data);
+        }
+        heap_data = bigger;
+        capacity = new_capacity;
+    }
+
+    void copyFrom(const SmallVector &other)
+    {
+        if (other.count > N)
+        {
+            heap_data = static_cast<T *>(std::malloc(sizeof(T) * other.count));
+            if (heap_data == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            capacity = other.count;
+        }
+        std::memcpy(data(), other.data(), sizeof(T) * other.count);
+        count = other.count;
+    }
+
+    void moveFrom(SmallVector &other)
+    {
+        if (other.isInline())
+        {
+            std::memcpy(inline_data, other.inline_data, sizeof(T) * other.count);
+        }
+        else
+        {
+            heap_data = other.heap_data;
+            capacity = other.capacity;
+        }
+        count = other.count;
+        other.count = 0;
+        other.capacity = N;
+    }
+
+    void release()
+    {
+        if (!isInline())
+        {
+            std::free(heap_data);
+        }
+        count = 0;
+        capacity = N;
+    }
+
+public:
+    SmallVector() {}
+    SmallVector(const SmallVector &other) { copyFrom(other); }
+    SmallVector(SmallVector &&other) noexcept { moveFrom(other); }
+
+    SmallVector &operator=(const SmallVector &other)
+    {
+        if (this != &other)
+        {
+            release();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    SmallVector &operator=(SmallVector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    ~SmallVector() { release(); }
+
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + count; }
+    uint32_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    bool contains(const T &value) const
+    {
+        return std::find(begin(), end(), value) != end();
+    }
+
+    // Appends value unless it is already present; returns whether it was added.
+    bool insertUnique(const T &value)
+    {
+        if (contains(value))
+        {
+            return false;
+        }
+        if (count == capacity)
+        {
+            grow();
+        }
+        data()[count++] = value;
+        return true;
+    }
+
+    // Removes value by moving the last element into its place; returns whether it was present.
+    bool erase(const T &value)
+    {
+        T *first = data();
+        T *it = std::find(first, first + count, value);
+        if (it == first + count)
+        {
+            return false;
+        }
+        *it = first[--count];
+        return true;
+    }
+
+    // Drops the elements but keeps any heap buffer for reuse.
+    void clear() { count = 0; }
+
+    // Bytes held on the heap (0 while the elements fit inline).
+    size_t heapBytes() const { return isInline() ? 0 : sizeof(T) * capacity; }
+};
+
+#endif // SMALL_VECTOR_H
@@ -2,20 +2,44 @@
 #define TRANSACTION_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <cstdint>
 #include <cstring>
 #include <unordered_set>
+#include <bitset>
+
+#include "smallVector.h"
+
+// compact stand-in for a transaction ID inside the merger (see IdInterner)
+using TxnHandle = uint32_t;
+constexpr TxnHandle INVALID_TXN_HANDLE = UINT32_MAX;
+
+// dense id of a mock database key, assigned when the database is loaded
+using KeyId = uint32_t;
+constexpr KeyId INVALID_KEY_ID = UINT32_MAX;
+
+// Regions (server ids) are kept as bits, so a cluster can only have ids in
+// [0, MAX_CLUSTER_SIZE). getServers rejects configurations outside of that.
+constexpr int32_t MAX_CLUSTER_SIZE = 64;
+using RegionSet = std::bitset<MAX_CLUSTER_SIZE>;
+
+// most transactions have one to three edges each way, which then fit inline
+using AdjacencyList = SmallVector<TxnHandle, 4>;
 
 enum class OperationType {
     READ,
     WRITE
 };
 
+// key and value point into the request the operation was parsed from, which
+// the owning Transaction keeps alive through its payload
 struct Operation {
     OperationType type;
-    std::string key;
-    std::string value;  // Only used for write operations
+    KeyId key_id = INVALID_KEY_ID; // INVALID_KEY_ID if the key is not in the database
+    std::string_view key;
+    std::string_view value;  // Only used for write operations
 };
 
 class Transaction
@@ -23,16 +47,18 @@ class Transaction
 private:
     int32_t order;
     std::string id;
+    TxnHandle handle = INVALID_TXN_HANDLE;
     int32_t server_id;
     std::vector<Operation> operations;
+    std::shared_ptr<const void> payload; // whatever owns the bytes operations point into
 
-    // intrusive adjacency list
-    std::unordered_set<Transaction*> neighbors_out;
-    std::unordered_set<Transaction*> neighbors_in;
-    std::unordered_set<std::string> neigbors_in_ids;
+    // intrusive adjacency list, by handle
+    AdjacencyList neighbors_out;
+    AdjacencyList neighbors_in;
+    std::vector<std::string> neigbors_in_ids; // filled on removal, only used for snapshots
 
-    std::unordered_set<int32_t> expected_regions;
-    std::unordered_set<int32_t> seen_regions;
+    RegionSet expected_regions;
+    RegionSet seen_regions;
 public:
     Transaction(int32_t order_, int32_t server_id_, const std::vector<Operation>& ops, const std::string& id_ = "")
         :order(order_), id(id_), server_id(server_id_), operations(ops) {}
@@ -42,40 +68,55 @@ public:
 
     const std::string& getID() const { return id; }
 
+    TxnHandle getHandle() const { return handle; }
+    void setHandle(TxnHandle handle_) { handle = handle_; }
+
     int32_t getServerId() const { return server_id; }
 
     const std::vector<Operation>& getOperations() const { return operations; }
 
-    void addNeighborOut(Transaction* ptr) { 
-        neighbors_out.insert(ptr); 
-        ptr->neighbors_in.insert(this); 
+    void setPayload(std::shared_ptr<const void> payload_) { payload = std::move(payload_); }
+
+    // Drops the operations and the reference to the request they came from,
+    // keeping the operations buffer for reuse.
+    void dropPayload() {
+        operations.clear();
+        payload.reset();
+    }
+
+    // returns false if the edge was already there
+    bool addNeighborOut(Transaction* ptr) { 
+        if (!neighbors_out.insertUnique(ptr->handle))
+            return false;
+        ptr->neighbors_in.insertUnique(handle); 
+        return true;
     }
 
     void addNeighborInID(const std::string& neighbor_id) {
-        neigbors_in_ids.insert(neighbor_id);
+        neigbors_in_ids.push_back(neighbor_id);
     }
 
     void removeOutNeighbor(Transaction* ptr) { 
-        neighbors_out.erase(ptr); 
-        ptr->neighbors_in.erase(this);
+        neighbors_out.erase(ptr->handle); 
+        ptr->neighbors_in.erase(handle);
     }
 
     void removeInNeighbor(Transaction* ptr) { 
-        neighbors_in.erase(ptr); 
-        ptr->neighbors_out.erase(this);
+        neighbors_in.erase(ptr->handle); 
+        ptr->neighbors_out.erase(handle);
     }
 
-    const std::unordered_set<Transaction*>& getOutNeighbors() const { return neighbors_out; }
+    const AdjacencyList& getOutNeighbors() const { return neighbors_out; }
 
-    const std::unordered_set<Transaction*>& getIncomingNeighbors() const { return neighbors_in; }
+    const AdjacencyList& getIncomingNeighbors() const { return neighbors_in; }
 
-    const std::unordered_set<std::string>& getIncomingNeighborIDs() const { return neigbors_in_ids; }
+    const std::vector<std::string>& getIncomingNeighborIDs() const { return neigbors_in_ids; }
 
-    void setExpectedRegions(const std::unordered_set<int32_t>& regions) { expected_regions = regions; }
-    const std::unordered_set<int32_t>& getExpectedRegions() const { return expected_regions; }
+    void setExpectedRegions(const RegionSet& regions) { expected_regions = regions; }
+    const RegionSet& getExpectedRegions() const { return expected_regions; }
 
-    void addSeenRegion(int32_t region) { seen_regions.insert(region); }
-    const std::unordered_set<int32_t>& getSeenRegions() const { return seen_regions; }
+    void addSeenRegion(int32_t region) { seen_regions.set(region); }
+    const RegionSet& getSeenRegions() const { return seen_regions; }
 
     bool isComplete() const { return seen_regions == expected_regions; }
 
@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#include "transactionPool.h"
+
+namespace
+{
+    // heap bytes behind a string, 0 while it fits in the small-string buffer
+    size_t stringHeapBytes(const std::string &s)
+    {
+        return s.capacity() > 15 ? s.capacity() + 1 : 0;
+    }
+}
+
+Transaction *TransactionPool::slot(size_t i) const
+{
+    return reinterpret_cast<Transaction *>(slabs[i / SLAB_SIZE][i % SLAB_SIZE].storage);
+}
+
+TransactionPool::~TransactionPool()
+{
+    for (size_t i = 0; i < carved; ++i)
+    {
+        slot(i)->~Transaction();
+    }
+}
+
+Transaction *TransactionPool::acquire(const Transaction &txn)
+{
+    Transaction *t;
+
+    if (!free_list.empty())
+    {
+        t = free_list.back();
+        free_list.pop_back();
+        *t = txn; // reuses the buffers the slot already owns
+    }
+    else
+    {
+        if (carved == slabs.size() * SLAB_SIZE)
+        {
+            slabs.emplace_back(new Slot[SLAB_SIZE]);
+        }
+        t = new (slabs[carved / SLAB_SIZE][carved % SLAB_SIZE].storage) Transaction(txn);
+        ++carved;
+    }
+
+    high_water = std::max(high_water, ++live);
+    return t;
+}
+
+void TransactionPool::release(Transaction *txn)
+{
+    txn->dropPayload(); // a parked slot must not keep its round's arena alive
+    --live;
+    free_list.push_back(txn);
+}
+
+TransactionPoolStats TransactionPool::stats() const
+{
+    size_t bytes = slabs.size() * SLAB_SIZE * sizeof(Slot);
+
+    for (size_t i = 0; i < carved; ++i)
+    {
+        const Transaction *t = slot(i);
+        bytes += stringHeapBytes(t->getID());
+        bytes += t->getOperations().capacity() * sizeof(Operation);
+        bytes += t->getOutNeighbors().heapBytes() + t->getIncomingNeighbors().heapBytes();
+    }
+
+    return {live, high_water, carved, bytes};
+}
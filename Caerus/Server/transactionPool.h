@@ -0,0 +1,56 @@
+#ifndef TRANSACTION_POOL_H
+#define TRANSACTION_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "transaction.h"
+
+struct TransactionPoolStats
+{
+    size_t live;       // nodes handed out and not yet released
+    size_t high_water; // most nodes live at the same time
+    size_t slots;      // slots carved out of slabs so far (live + free)
+    size_t bytes;      // slab memory plus the heap storage the slots hold on to
+};
+
+// Slab allocator for graph nodes. Released nodes are not destroyed: they stay
+// constructed on a free list and the next acquire copy-assigns into them, so
+// the id string and the operations vector reuse the buffers of the
+// transaction that used the slot before.
+class TransactionPool
+{
+private:
+    static constexpr size_t SLAB_SIZE = 256; // transactions per slab
+
+    struct Slot
+    {
+        alignas(Transaction) unsigned char storage[sizeof(Transaction)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    size_t carved = 0; // slots constructed so far, in slab order
+    std::vector<Transaction *> free_list;
+    size_t live = 0;
+    size_t high_water = 0;
+
+    Transaction *slot(size_t i) const;
+
+public:
+    TransactionPool() = default;
+    TransactionPool(const TransactionPool &) = delete;
+    TransactionPool &operator=(const TransactionPool &) = delete;
+    ~TransactionPool();
+
+    // Returns a pooled copy of txn.
+    Transaction *acquire(const Transaction &txn);
+
+    // Gives the node back to the pool; the pointer must not be used afterwards.
+    void release(Transaction *txn);
+
+    // Walks every slot, so call it for reporting rather than per transaction.
+    TransactionPoolStats stats() const;
+};
+
+#endif // TRANSACTION_POOL_H
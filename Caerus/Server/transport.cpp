@@ -0,0 +1,161 @@
+#include <arpa/inet.h>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+#include "transport.h"
+#include "reactor.h"
+#include "uringTransport.h"
+#include "shmRing.h"
+#include "utils.h"
+
+namespace
+{
+    std::atomic<Transport *> current_transport{nullptr};
+
+    std::mutex rings_mtx;
+    std::unordered_map<int, std::shared_ptr<ShmRing>> rings; // by socket
+    std::atomic<size_t> ring_count{0};                       // senders skip the lookup while 0
+
+    void writeFrames(FrameSend *sends, size_t n)
+    {
+        if (Transport *transport = getTransport())
+        {
+            transport->sendFrames(sends, n);
+            return;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t netlen = htonl(sends[i].len);
+            sends[i].ok = writeNBytes(sends[i].fd, &netlen, sizeof(netlen)) &&
+                          writeNBytes(sends[i].fd, sends[i].data, sends[i].len);
+        }
+    }
+}
+
+void Transport::sendFrames(FrameSend *sends, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        sends[i].ok = sendFrame(sends[i].fd, sends[i].data, sends[i].len);
+    }
+}
+
+Connection peerConnection(int fd, const sockaddr_storage &addr)
+{
+    if (addr.ss_family != AF_INET)
+    {
+        return {fd, "local", 0};
+    }
+
+    const sockaddr_in &in = reinterpret_cast<const sockaddr_in &>(addr);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &in.sin_addr, ip, sizeof(ip));
+    return {fd, ip, ntohs(in.sin_port)};
+}
+
+Transport *makeTransport(const std::string &name, int io_threads)
+{
+    if (name == "io_uring")
+    {
+        if (UringTransport::supported())
+        {
+            return new UringTransport(io_threads);
+        }
+        fprintf(stderr, "Transport: io_uring not available on this kernel, falling back to epoll\n");
+    }
+    else if (name != "epoll")
+    {
+        fprintf(stderr, "Transport: unknown transport %s, using epoll\n", name.c_str());
+    }
+
+    return new Reactor(io_threads);
+}
+
+void setTransport(Transport *transport)
+{
+    current_transport.store(transport);
+}
+
+Transport *getTransport()
+{
+    return current_transport.load();
+}
+
+void attachRing(int fd, std::shared_ptr<ShmRing> ring)
+{
+    std::lock_guard<std::mutex> lk(rings_mtx);
+    rings[fd] = std::move(ring);
+    ring_count.store(rings.size());
+}
+
+std::shared_ptr<ShmRing> detachRing(int fd)
+{
+    std::lock_guard<std::mutex> lk(rings_mtx);
+    auto it = rings.find(fd);
+    if (it == rings.end())
+        return nullptr;
+
+    std::shared_ptr<ShmRing> ring = std::move(it->second);
+    rings.erase(it);
+    ring_count.store(rings.size());
+    return ring;
+}
+
+std::shared_ptr<ShmRing> ringFor(int fd)
+{
+    if (ring_count.load() == 0)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lk(rings_mtx);
+    auto it = rings.find(fd);
+    return it == rings.end() ? nullptr : it->second;
+}
+
+bool sendFrame(int fd, const std::string &payload)
+{
+    FrameSend send{fd, payload.data(), uint32_t(payload.size()), false};
+    sendFrames(&send, 1);
+    return send.ok;
+}
+
+void sendFrames(FrameSend *sends, size_t n)
+{
+    if (ring_count.load() == 0)
+    {
+        writeFrames(sends, n);
+        return;
+    }
+
+    // frames for sockets with a ring go into it, the rest to the transport in one batch
+    std::vector<FrameSend> rest;
+    std::vector<size_t> rest_at;
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i + 1;
+        while (j < n && sends[j].fd == sends[i].fd)
+            ++j;
+
+        if (std::shared_ptr<ShmRing> ring = ringFor(sends[i].fd))
+        {
+            ring->write(sends + i, j - i);
+        }
+        else
+        {
+            for (size_t k = i; k < j; ++k)
+            {
+                rest.push_back(sends[k]);
+                rest_at.push_back(k);
+            }
+        }
+        i = j;
+    }
+
+    if (rest.empty())
+        return;
+
+    writeFrames(rest.data(), rest.size());
+    for (size_t k = 0; k < rest.size(); ++k)
+        sends[rest_at[k]].ok = rest[k].ok;
+}
@@ -0,0 +1,104 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+// A served socket, as seen by a frame handler.
+struct Connection
+{
+    int fd;
+    std::string ip;
+    int port;
+    int32_t peer = -1; // server on the other end, once known; handlers may set it
+};
+
+// The Connection for an accepted socket: ip and port for TCP, "local" and 0 for a unix socket.
+Connection peerConnection(int fd, const sockaddr_storage &addr);
+
+// Called once per complete length-prefixed frame; returning false closes the connection.
+using FrameHandler = std::function<bool(Connection &conn, const char *data, uint32_t len)>;
+
+// Called when a connection ends, right before the transport closes its socket.
+using CloseHandler = std::function<void(Connection &conn)>;
+
+// One frame to write in a sendFrames batch; ok is filled in with the result.
+struct FrameSend
+{
+    int fd;
+    const char *data;
+    uint32_t len;
+    bool ok;
+};
+
+struct TransportStats
+{
+    uint64_t syscalls;   // reads, writes, epoll waits and ring enters issued by the transport
+    uint64_t frames_in;  // frames handed to handlers
+    uint64_t frames_out; // frames written
+};
+
+// Moves length-prefixed frames (4-byte big-endian length, then the payload)
+// over stream sockets. The receive side serves listening sockets and every
+// connection accepted on them; the send side writes whole frames on
+// connected sockets and may be called from any thread.
+class Transport
+{
+protected:
+    std::atomic<uint64_t> syscalls{0};
+    std::atomic<uint64_t> frames_in{0};
+    std::atomic<uint64_t> frames_out{0};
+
+public:
+    virtual ~Transport() = default;
+
+    virtual const char *name() const = 0;
+
+    // Starts accepting on listenfd, which has to be bound, listening and non-blocking.
+    // Every connection accepted on it is served by handler, and on_close is told when
+    // one ends.
+    virtual void addListener(int listenfd, FrameHandler handler, CloseHandler on_close = nullptr) = 0;
+
+    // Serves a socket connected elsewhere like an accepted one; it has to be
+    // non-blocking, and the transport owns it from here on.
+    virtual void addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close = nullptr) = 0;
+
+    // Writes one frame; false once the connection is broken.
+    virtual bool sendFrame(int fd, const char *data, uint32_t len) = 0;
+
+    // Writes several frames, possibly on different sockets, in as few system calls as
+    // the backend allows; each entry's ok says whether its frame went out.
+    virtual void sendFrames(FrameSend *sends, size_t n);
+
+    TransportStats stats() const { return {syscalls.load(), frames_in.load(), frames_out.load()}; }
+};
+
+// Builds the backend named by name ("epoll" or "io_uring"). Falls back to epoll
+// when io_uring is asked for but the kernel does not support what it needs.
+Transport *makeTransport(const std::string &name, int io_threads);
+
+// The transport the senders go through; set once at startup.
+void setTransport(Transport *transport);
+Transport *getTransport();
+
+class ShmRing;
+
+// From now on frames sent on fd go into ring instead (a co-located peer that
+// reads them from shared memory); the socket stays open for the peer's frames.
+void attachRing(int fd, std::shared_ptr<ShmRing> ring);
+std::shared_ptr<ShmRing> detachRing(int fd);
+std::shared_ptr<ShmRing> ringFor(int fd);
+
+// Writes one frame on fd through the current transport (plain blocking writes
+// if none is set yet); false once the connection is broken.
+bool sendFrame(int fd, const std::string &payload);
+
+// Writes a batch of frames through the current transport; see Transport::sendFrames.
+void sendFrames(FrameSend *sends, size_t n);
+
+#endif // TRANSPORT_H
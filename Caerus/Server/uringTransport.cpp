@@ -0,0 +1,738 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uringTransport.h"
+#include "utils.h"
+
+namespace
+{
+    constexpr unsigned RECV_RING_ENTRIES = 256;
+    constexpr unsigned RECV_BUFFERS = 128; // provided buffers per I/O thread, a power of two
+    constexpr unsigned RECV_BUFFER_SIZE = 16 * 1024;
+    constexpr uint16_t RECV_GROUP = 0;
+
+    constexpr unsigned SEND_RING_ENTRIES = 64;
+    constexpr size_t SEND_BUFFER_SIZE = 256 * 1024; // registered once per sending thread
+
+    // user_data that is not an endpoint (endpoints are never null or odd)
+    constexpr uint64_t WAKE_TAG = 0;    // the eventfd read
+    constexpr uint64_t PROVIDE_TAG = 1; // a failed PROVIDE_BUFFERS
+
+    int uringSetup(unsigned entries, io_uring_params *p)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    int uringRegister(int fd, unsigned opcode, void *arg, unsigned nr_args)
+    {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    template <typename T>
+    T loadAcquire(const T *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+
+    template <typename T>
+    void storeRelease(T *p, T v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+    // The buffers multishot recv picks from, handed to the kernel with
+    // PROVIDE_BUFFERS. Successful provides post no completion.
+    class ProvidedBuffers
+    {
+    private:
+        std::unique_ptr<char[]> memory{new char[size_t(RECV_BUFFERS) * RECV_BUFFER_SIZE]};
+
+    public:
+        char *buffer(uint16_t bid) { return memory.get() + size_t(bid) * RECV_BUFFER_SIZE; }
+
+        // hands buffers [bid, bid + count) back to the kernel
+        void provide(io_uring_sqe *sqe, uint16_t bid, unsigned count)
+        {
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = int(count);
+            sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+            sqe->len = RECV_BUFFER_SIZE;
+            sqe->buf_group = RECV_GROUP;
+            sqe->off = bid;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            sqe->user_data = PROVIDE_TAG;
+        }
+    };
+
+    void prepRecv(io_uring_sqe *sqe, int fd, uint64_t user_data)
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_GROUP;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = user_data;
+    }
+
+    // A sending thread's ring and the buffer registered on it. fixed says whether
+    // the kernel takes registered buffers for SEND; plain SEND from the same
+    // buffer is used when it does not.
+    struct SendRing
+    {
+        UringRing ring;
+        std::unique_ptr<char[]> buffer;
+        bool fixed = false;
+
+        // the frames one sqe carries: consecutive staged frames for one socket share a SEND
+        struct Group
+        {
+            size_t first;
+            size_t count;
+            uint32_t bytes;
+        };
+
+        // per-batch scratch, indexed by sqe, kept to avoid reallocating on every send
+        std::vector<uint32_t> netlens;
+        std::vector<iovec> iovs;
+        std::vector<msghdr> msgs;
+        std::vector<Group> groups;
+
+        bool init()
+        {
+            if (!ring.init(SEND_RING_ENTRIES))
+                return false;
+
+            buffer.reset(new char[SEND_BUFFER_SIZE]);
+            iovec iov{buffer.get(), SEND_BUFFER_SIZE};
+            if (uringRegister(ring.fd(), IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+                return false;
+
+            fixed = probeFixedSend();
+
+            netlens.resize(SEND_RING_ENTRIES);
+            iovs.resize(2 * SEND_RING_ENTRIES);
+            msgs.resize(SEND_RING_ENTRIES);
+            groups.resize(SEND_RING_ENTRIES);
+            return true;
+        }
+
+        // sends one byte over a socketpair with IORING_RECVSEND_FIXED_BUF
+        bool probeFixedSend()
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+                return false;
+
+            buffer[0] = 0;
+            io_uring_sqe *sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = sv[0];
+            sqe->addr = reinterpret_cast<uint64_t>(buffer.get());
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = 0;
+
+            bool ok = false;
+            if (ring.submitAndWait(1) >= 0)
+            {
+                if (io_uring_cqe *cqe = ring.peekCqe())
+                {
+                    ok = cqe->res == 1;
+                    ring.seenCqe();
+                }
+            }
+
+            close(sv[0]);
+            close(sv[1]);
+            return ok;
+        }
+    };
+
+    // nullptr if this thread cannot get a ring; it then sends with plain writes
+    SendRing *sendRing()
+    {
+        thread_local std::unique_ptr<SendRing> ring;
+        thread_local bool failed = false;
+
+        if (!ring && !failed)
+        {
+            ring.reset(new SendRing);
+            if (!ring->init())
+            {
+                fprintf(stderr, "UringTransport: no send ring for this thread, using plain writes\n");
+                ring.reset();
+                failed = true;
+            }
+        }
+        return ring.get();
+    }
+}
+
+UringRing::~UringRing()
+{
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (cq_ptr && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr)
+        munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+}
+
+bool UringRing::init(unsigned requested)
+{
+    io_uring_params p{};
+    ring_fd = uringSetup(requested, &p);
+    if (ring_fd < 0)
+        return false;
+
+    entries = p.sq_entries;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+
+    void *sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return false;
+    sq_ptr = sq;
+
+    if (single_mmap)
+    {
+        cq_ptr = sq_ptr;
+    }
+    else
+    {
+        void *cq = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return false;
+        cq_ptr = cq;
+    }
+
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED)
+        return false;
+    sqes = static_cast<io_uring_sqe *>(s);
+
+    char *sqc = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sqc + p.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sqc + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sqc + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sqc + p.sq_off.array);
+
+    char *cqc = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cqc + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cqc + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cqc + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cqc + p.cq_off.cqes);
+
+    sqe_tail = flushed_tail = *sq_tail;
+    return true;
+}
+
+io_uring_sqe *UringRing::getSqe()
+{
+    if (sqe_tail - loadAcquire(sq_head) >= entries)
+        return nullptr;
+
+    unsigned idx = sqe_tail & *sq_mask;
+    sq_array[idx] = idx;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail;
+    return sqe;
+}
+
+int UringRing::submitAndWait(unsigned wait_nr)
+{
+    unsigned to_submit = sqe_tail - flushed_tail;
+    if (to_submit)
+    {
+        storeRelease(sq_tail, sqe_tail);
+        flushed_tail = sqe_tail;
+    }
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int r;
+    do
+    {
+        // after an interrupted wait the kernel only takes what is still in the queue
+        r = uringEnter(ring_fd, to_submit, wait_nr, flags);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+io_uring_cqe *UringRing::peekCqe()
+{
+    unsigned head = *cq_head;
+    if (head == loadAcquire(cq_tail))
+        return nullptr;
+    return &cqes[head & *cq_mask];
+}
+
+void UringRing::seenCqe()
+{
+    storeRelease(cq_head, *cq_head + 1);
+}
+
+bool UringTransport::supported()
+{
+    // try the receive path for real: provided buffers and a multishot recv on a socketpair
+    UringRing ring;
+    if (!ring.init(8))
+        return false;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return false;
+
+    ProvidedBuffers buffers;
+    buffers.provide(ring.getSqe(), 0, 1);
+    prepRecv(ring.getSqe(), sv[0], 2);
+
+    bool ok = false;
+    if (write(sv[1], "x", 1) == 1 && ring.submitAndWait(1) >= 0)
+    {
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peekCqe()))
+        {
+            if (cqe->user_data == 2)
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+            ring.seenCqe();
+        }
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+}
+
+UringTransport::UringTransport(int num_threads)
+{
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+
+    for (int i = 0; i < num_threads; ++i)
+    {
+        Worker *worker = new Worker{};
+        worker->transport = this;
+        worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (worker->wake_fd < 0)
+        {
+            error("UringTransport: eventfd failed");
+        }
+        workers.push_back(worker);
+    }
+
+    for (Worker *worker : workers)
+    {
+        if (pthread_create(&worker->thread, NULL, [](void *arg) -> void *
+                           {
+                auto *w = static_cast<Worker*>(arg);
+                w->transport->run(w);
+                return nullptr; }, worker) != 0)
+        {
+            threadError("UringTransport: error creating I/O thread");
+        }
+
+        pthread_detach(worker->thread);
+    }
+
+    printf("UringTransport started with %d I/O threads\n", num_threads);
+}
+
+void UringTransport::addListener(int listenfd, FrameHandler handler, CloseHandler on_close)
+{
+    Endpoint *ep = new Endpoint{};
+    ep->listening = true;
+    ep->conn = {listenfd, "", 0};
+    ep->handler = std::move(handler);
+    ep->on_close = std::move(on_close);
+
+    handOver(ep);
+}
+
+void UringTransport::addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close)
+{
+    Endpoint *ep = new Endpoint{};
+    ep->listening = false;
+    ep->conn = conn;
+    ep->handler = std::move(handler);
+    ep->on_close = std::move(on_close);
+
+    handOver(ep);
+}
+
+void UringTransport::handOver(Endpoint *ep)
+{
+    // the ring belongs to its thread, so the endpoint is handed over and armed there
+    Worker *worker = workers[next_worker++ % workers.size()];
+    {
+        std::lock_guard<std::mutex> lock(worker->inbox_mtx);
+        worker->inbox.push_back(ep);
+    }
+
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        perror("UringTransport: waking I/O thread failed");
+    }
+}
+
+void UringTransport::run(Worker *worker)
+{
+    UringRing ring;
+    if (!ring.init(RECV_RING_ENTRIES))
+    {
+        threadError("UringTransport: io_uring_setup failed");
+    }
+
+    ProvidedBuffers buffers;
+    std::vector<Endpoint *> starved; // recv ran out of buffers, re-armed once some are back
+
+    auto nextSqe = [&]() -> io_uring_sqe *
+    {
+        io_uring_sqe *sqe;
+        while (!(sqe = ring.getSqe()))
+        {
+            ring.submitAndWait(0);
+            syscalls.fetch_add(1, std::memory_order_relaxed);
+        }
+        return sqe;
+    };
+
+    auto armWake = [&]()
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = worker->wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&worker->wake_value);
+        sqe->len = sizeof(worker->wake_value);
+        sqe->user_data = WAKE_TAG;
+    };
+
+    auto armAccept = [&](Endpoint *ep)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = ep->conn.fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = reinterpret_cast<uint64_t>(ep);
+    };
+
+    auto armRecv = [&](Endpoint *ep)
+    {
+        prepRecv(nextSqe(), ep->conn.fd, reinterpret_cast<uint64_t>(ep));
+    };
+
+    buffers.provide(nextSqe(), 0, RECV_BUFFERS);
+    armWake();
+
+    while (true)
+    {
+        if (ring.submitAndWait(1) < 0)
+        {
+            threadError("UringTransport: io_uring_enter failed");
+        }
+        syscalls.fetch_add(1, std::memory_order_relaxed);
+
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peekCqe()))
+        {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.seenCqe();
+
+            if (tag == PROVIDE_TAG)
+            {
+                fprintf(stderr, "UringTransport: providing buffers failed: %s\n", strerror(-res));
+                continue;
+            }
+
+            if (tag == WAKE_TAG)
+            {
+                std::vector<Endpoint *> arrived;
+                {
+                    std::lock_guard<std::mutex> lock(worker->inbox_mtx);
+                    arrived.swap(worker->inbox);
+                }
+                for (Endpoint *ep : arrived)
+                {
+                    if (ep->listening)
+                        armAccept(ep);
+                    else
+                        armRecv(ep);
+                }
+                armWake();
+                continue;
+            }
+
+            auto *ep = reinterpret_cast<Endpoint *>(tag);
+            bool more = flags & IORING_CQE_F_MORE;
+
+            if (ep->listening)
+            {
+                if (res >= 0)
+                {
+                    sockaddr_storage addr{};
+                    socklen_t addrlen = sizeof(addr);
+                    getpeername(res, (sockaddr *)&addr, &addrlen);
+
+                    Endpoint *conn = new Endpoint{};
+                    conn->listening = false;
+                    conn->conn = peerConnection(res, addr);
+                    conn->handler = ep->handler;
+                    conn->on_close = ep->on_close;
+                    armRecv(conn);
+                }
+                else if (res != -ECONNABORTED && res != -EINTR)
+                {
+                    fprintf(stderr, "UringTransport: error accepting connection: %s\n", strerror(-res));
+                }
+
+                if (!more)
+                    armAccept(ep);
+                continue;
+            }
+
+            if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+            {
+                uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (!ep->closing && !consume(ep, buffers.buffer(bid), res))
+                {
+                    // the final completion comes once the shutdown ends the recv
+                    ep->closing = true;
+                    shutdown(ep->conn.fd, SHUT_RDWR);
+                }
+                buffers.provide(nextSqe(), bid, 1);
+            }
+
+            if (more)
+                continue;
+
+            // the multishot recv ended: re-arm if it just ran out of buffers or stopped
+            // on its own, otherwise the connection is done
+            if (!ep->closing && res == -ENOBUFS)
+            {
+                starved.push_back(ep);
+                continue;
+            }
+            if (!ep->closing && res > 0)
+            {
+                armRecv(ep);
+                continue;
+            }
+
+            if (res == 0 && ep->pending.buffered() != 0)
+            {
+                fprintf(stderr, "UringTransport: %s:%d closed in the middle of a frame\n",
+                        ep->conn.ip.c_str(), ep->conn.port);
+            }
+            else if (res < 0 && !ep->closing)
+            {
+                fprintf(stderr, "UringTransport: read error from %s:%d: %s\n",
+                        ep->conn.ip.c_str(), ep->conn.port, strerror(-res));
+            }
+
+            if (ep->on_close)
+                ep->on_close(ep->conn);
+            close(ep->conn.fd);
+            delete ep;
+        }
+
+        // queued behind this pass's provides, so the buffers are back by the time they run
+        for (Endpoint *ep : starved)
+            armRecv(ep);
+        starved.clear();
+    }
+}
+
+bool UringTransport::consume(Endpoint *ep, const char *data, size_t len)
+{
+    if (ep->pending.buffered() == 0)
+    {
+        // the common case: frames are handed out straight from the provided buffer
+        long used = parseFrames(ep, data, len);
+        if (used < 0)
+            return false;
+        if (size_t(used) < len)
+            ep->pending.append(data + used, len - used);
+        return true;
+    }
+
+    ep->pending.append(data, len);
+
+    const char *frame;
+    uint32_t frame_len;
+    while (ep->pending.next(frame, frame_len))
+    {
+        frames_in.fetch_add(1, std::memory_order_relaxed);
+        if (!ep->handler(ep->conn, frame, frame_len))
+            return false;
+    }
+    return true;
+}
+
+long UringTransport::parseFrames(Endpoint *ep, const char *data, size_t len)
+{
+    size_t off = 0;
+    while (len - off >= sizeof(uint32_t))
+    {
+        uint32_t netlen;
+        memcpy(&netlen, data + off, sizeof(netlen));
+        uint32_t frame_len = ntohl(netlen);
+        if (len - off - sizeof(netlen) < frame_len)
+            break;
+
+        frames_in.fetch_add(1, std::memory_order_relaxed);
+        if (!ep->handler(ep->conn, data + off + sizeof(netlen), frame_len))
+            return -1;
+        off += sizeof(netlen) + frame_len;
+    }
+    return long(off);
+}
+
+bool UringTransport::sendFrame(int fd, const char *data, uint32_t len)
+{
+    FrameSend send{fd, data, len, false};
+    sendFrames(&send, 1);
+    return send.ok;
+}
+
+void UringTransport::sendFrames(FrameSend *sends, size_t n)
+{
+    SendRing *sr = sendRing();
+    if (!sr)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t netlen = htonl(sends[i].len);
+            sends[i].ok = writeNBytes(sends[i].fd, &netlen, sizeof(netlen)) &&
+                          writeNBytes(sends[i].fd, sends[i].data, sends[i].len);
+            syscalls.fetch_add(2, std::memory_order_relaxed);
+            if (sends[i].ok)
+                frames_out.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    // a chunk fills the ring at most; the staging buffer is reused once a chunk completes
+    for (size_t next = 0; next < n;)
+    {
+        size_t staged = 0;
+        unsigned used = 0;
+        io_uring_sqe *last = nullptr;
+        bool last_staged = false;
+
+        for (; next < n && used < SEND_RING_ENTRIES; ++next)
+        {
+            FrameSend &s = sends[next];
+            size_t bytes = sizeof(uint32_t) + s.len;
+            bool fits = staged + bytes <= SEND_BUFFER_SIZE;
+
+            if (fits)
+            {
+                char *dst = sr->buffer.get() + staged;
+                uint32_t netlen = htonl(s.len);
+                memcpy(dst, &netlen, sizeof(netlen));
+                memcpy(dst + sizeof(netlen), s.data, s.len);
+                staged += bytes;
+
+                // right behind the previous staged frame for the same socket: one SEND for both
+                if (last_staged && last->fd == s.fd)
+                {
+                    SendRing::Group &g = sr->groups[used - 1];
+                    g.count++;
+                    g.bytes += uint32_t(bytes);
+                    last->len = g.bytes;
+                    continue;
+                }
+            }
+
+            // frames on the same socket go out in order
+            if (last && last->fd == s.fd)
+                last->flags |= IOSQE_IO_LINK;
+
+            io_uring_sqe *sqe = sr->ring.getSqe();
+            sqe->fd = s.fd;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = used;
+            sr->groups[used] = {next, 1, uint32_t(bytes)};
+
+            if (fits)
+            {
+                sqe->opcode = IORING_OP_SEND;
+                sqe->addr = reinterpret_cast<uint64_t>(sr->buffer.get() + staged - bytes);
+                sqe->len = uint32_t(bytes);
+                if (sr->fixed)
+                {
+                    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                    sqe->buf_index = 0;
+                }
+            }
+            else
+            {
+                sr->netlens[used] = htonl(s.len);
+                iovec *iov = &sr->iovs[2 * used];
+                iov[0] = {&sr->netlens[used], sizeof(uint32_t)};
+                iov[1] = {const_cast<char *>(s.data), s.len};
+                msghdr &msg = sr->msgs[used];
+                msg = msghdr{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = 2;
+
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->addr = reinterpret_cast<uint64_t>(&msg);
+            }
+
+            last = sqe;
+            last_staged = fits;
+            ++used;
+        }
+
+        unsigned done = 0;
+        while (done < used)
+        {
+            if (sr->ring.submitAndWait(used - done) < 0)
+            {
+                perror("UringTransport: io_uring_enter failed");
+                for (size_t i = 0; i < n; ++i)
+                    sends[i].ok = false;
+                return;
+            }
+            syscalls.fetch_add(1, std::memory_order_relaxed);
+
+            io_uring_cqe *cqe;
+            while ((cqe = sr->ring.peekCqe()))
+            {
+                const SendRing::Group &g = sr->groups[cqe->user_data];
+                // MSG_WAITALL makes anything short of every frame in the sqe a failure
+                bool ok = cqe->res == int(g.bytes);
+                sr->ring.seenCqe();
+
+                for (size_t i = g.first; i < g.first + g.count; ++i)
+                    sends[i].ok = ok;
+                if (ok)
+                    frames_out.fetch_add(g.count, std::memory_order_relaxed);
+                ++done;
+            }
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef URING_TRANSPORT_H
+#define URING_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#include "frameReader.h"
+#include "transport.h"
+
+// Just enough of io_uring for the transport, straight on top of the system
+// calls (liburing is not a dependency). One ring belongs to one thread.
+class UringRing
+{
+private:
+    int ring_fd = -1;
+    unsigned entries = 0;
+
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes;
+
+    unsigned sqe_tail = 0;     // next sqe handed out
+    unsigned flushed_tail = 0; // sqes already made visible to the kernel
+
+public:
+    UringRing() = default;
+    UringRing(const UringRing &) = delete;
+    UringRing &operator=(const UringRing &) = delete;
+    ~UringRing();
+
+    bool init(unsigned entries);
+    int fd() const { return ring_fd; }
+
+    // Returns a zeroed sqe, or nullptr if the submission queue is full.
+    io_uring_sqe *getSqe();
+
+    // Submits every pending sqe and waits for at least wait_nr completions, in one
+    // io_uring_enter; returns its result.
+    int submitAndWait(unsigned wait_nr);
+
+    io_uring_cqe *peekCqe();
+    void seenCqe();
+};
+
+// The io_uring transport. Each I/O thread owns a ring and a pool of provided
+// buffers; listeners accept with multishot accept and every connection
+// receives with multishot recv, so the kernel keeps filling buffers without a
+// new request per read. Whole frames are parsed straight out of the provided
+// buffers, and all re-arms and recycled buffers go back in the same
+// io_uring_enter that waits for the next completions.
+//
+// Senders get a ring per thread with one registered buffer: frames (length
+// plus payload) are copied into it and consecutive frames for one socket go
+// out as a single fixed-buffer SEND; a sendFrames batch is submitted with one
+// io_uring_enter. Frames that do
+// not fit go out as one SENDMSG with the length and the payload as two iovecs.
+// Sends use MSG_WAITALL, so a frame is never left half written behind the next
+// one queued on the same socket.
+class UringTransport : public Transport
+{
+private:
+    struct Endpoint
+    {
+        bool listening;
+        bool closing;
+        Connection conn;
+        FrameHandler handler;
+        CloseHandler on_close;
+        FrameReader pending; // start of a frame that did not fit in one buffer
+    };
+
+    struct Worker
+    {
+        UringTransport *transport;
+        pthread_t thread;
+        int wake_fd;     // eventfd used to hand new listeners and connections to the thread
+        uint64_t wake_value;
+        std::mutex inbox_mtx;
+        std::vector<Endpoint *> inbox;
+    };
+
+    std::vector<Worker *> workers;
+    std::atomic<size_t> next_worker{0};
+
+    void run(Worker *worker);
+    void handOver(Endpoint *ep); // to the next I/O thread, which arms it
+
+    // Hands every whole frame in data to the endpoint's handler and keeps the tail;
+    // false once the handler wants the connection closed.
+    bool consume(Endpoint *ep, const char *data, size_t len);
+    long parseFrames(Endpoint *ep, const char *data, size_t len); // bytes used, -1 to close
+
+public:
+    explicit UringTransport(int num_threads);
+    UringTransport(const UringTransport &) = delete;
+    UringTransport &operator=(const UringTransport &) = delete;
+
+    // Whether the kernel has everything this transport uses (provided buffers and
+    // multishot recv), tried out on a socketpair.
+    static bool supported();
+
+    const char *name() const override { return "io_uring"; }
+    void addListener(int listenfd, FrameHandler handler, CloseHandler on_close = nullptr) override;
+    void addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close = nullptr) override;
+    bool sendFrame(int fd, const char *data, uint32_t len) override;
+    void sendFrames(FrameSend *sends, size_t n) override;
+};
+
+#endif // URING_TRANSPORT_H
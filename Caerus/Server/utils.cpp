@@ -4,19 +4,41 @@
 #include <pthread.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <cstring>
 
 #include "json.hpp"
 #include "utils.h"
+#include "transport.h"
+#include "connectionManager.h"
 
 using json = nlohmann::json;
 
 std::unordered_map<std::string, DataItem> mockDB;
 std::unordered_map<std::string, DataItem> mockDB_logging;
+std::unordered_map<std::string, KeyId> mockDB_key_ids;
+std::vector<int32_t> mockDB_primaries;
+std::vector<std::string> mockDB_keys;
 
 int peer_port;
 int32_t my_id;
 std::vector<server> servers;
 
+std::string MERGE_MODE = "coalesce";
+int MERGE_BUDGET = 64;
+int IO_THREADS = 2;
+std::string TRANSPORT_BACKEND = "epoll";
+std::string WIRE_FORMAT = "protobuf";
+bool PAYLOAD_DEDUP = false;
+bool REGION_RELAY = false;
+int COALESCE_BYTES = 64 * 1024;
+int COALESCE_DELAY_US = 200;
+bool LOCAL_SOCKETS = true;
+std::string UNIX_SOCKET_DIR = "/tmp";
+bool SHM_RINGS = false;
+int SHM_RING_BYTES = 4 * 1024 * 1024;
+
 
 std::string LEADER_IP;
 int LEADER_PORT;
@@ -123,6 +145,70 @@ int setupListenfd(int my_port)
     return listenfd;
 }
 
+int setupLocalListenfd(const std::string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "setupLocalListenfd: socket path too long: %s\n", path.c_str());
+        exit(1);
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+    {
+        error("setupLocalListenfd: error creating listening socket");
+    }
+
+    // left behind by an earlier run
+    unlink(path.c_str());
+
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        error("setupLocalListenfd: error binding the socket path");
+    }
+
+    if (!setNonBlocking(listenfd))
+    {
+        error("setupLocalListenfd: error setting socket to non-blocking mode");
+    }
+
+    return listenfd;
+}
+
+bool isColocated(const server &peer)
+{
+    if (peer.id == my_id)
+        return false;
+
+    for (const server &self : servers)
+    {
+        if (self.id != my_id)
+            continue;
+        if (!self.host.empty() && self.host == peer.host)
+            return true;
+        return self.ip == peer.ip;
+    }
+    return false;
+}
+
+std::string localSocketPath(int32_t id)
+{
+    return UNIX_SOCKET_DIR + "/caerus-peer-" + std::to_string(id) + ".sock";
+}
+
+// the round the logical clock is in right now, -1 until it has started
+int64_t currentRound()
+{
+    if (!LOGICAL_EPOCH_READY.load())
+        return -1;
+
+    auto elapsed = std::chrono::steady_clock::now() - LOGICAL_EPOCH;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 50;
+}
+
 bool setNonBlocking(int listenfd)
 {
 
@@ -167,6 +253,20 @@ void setupMockDB(){
     {
         mockDB.insert({data_item["key"], {data_item["value"], (int32_t) data_item["primary_server_id"]} });
         mockDB_logging.insert({data_item["key"], {data_item["value"], (int32_t) data_item["primary_server_id"]} });
+
+        // key ids follow the order of the file
+        std::string key = data_item["key"];
+        int32_t primary = data_item["primary_server_id"];
+        if (primary < 0 || primary >= MAX_CLUSTER_SIZE)
+        {
+            fprintf(stderr, "setupMockDB: primary server %d of key %s out of range\n", primary, key.c_str());
+            exit(1);
+        }
+        if (mockDB_key_ids.emplace(key, (KeyId) mockDB_primaries.size()).second)
+        {
+            mockDB_primaries.push_back(primary);
+            mockDB_keys.push_back(key);
+        }
     }
     
     file.close();
@@ -190,7 +290,15 @@ void getServers()
 
     for (auto& server : servers_list)
     {
-        servers.push_back({server["ip"], server["port"], (int32_t) server["id"], false, (bool) server["leader"]});
+        int32_t id = server["id"];
+        if (id < 0 || id >= MAX_CLUSTER_SIZE)
+        {
+            fprintf(stderr, "getServers: server id %d out of range, ids must be below %d\n", id, MAX_CLUSTER_SIZE);
+            exit(1);
+        }
+
+        servers.push_back({server["ip"], server["port"], (int32_t) server["id"], false, (bool) server["leader"],
+                           server.value("host", std::string()), server.value("region", std::string())});
 
 
         if ((bool)server["leader"] == true)
@@ -209,6 +317,36 @@ void getServers()
 
     }
 
+    IO_THREADS = data.value("io_threads", IO_THREADS);
+    TRANSPORT_BACKEND = data.value("transport", TRANSPORT_BACKEND);
+    WIRE_FORMAT = data.value("wire_format", WIRE_FORMAT);
+    PAYLOAD_DEDUP = data.value("payload_dedup", PAYLOAD_DEDUP);
+    REGION_RELAY = data.value("region_relay", REGION_RELAY);
+    LOCAL_SOCKETS = data.value("local_sockets", LOCAL_SOCKETS);
+    UNIX_SOCKET_DIR = data.value("unix_socket_dir", UNIX_SOCKET_DIR);
+
+    // optional merger tuning, defaults stay in place when absent
+    if (data.contains("merger"))
+    {
+        auto merger = data["merger"];
+        MERGE_MODE = merger.value("mode", MERGE_MODE);
+        MERGE_BUDGET = merger.value("budget", MERGE_BUDGET);
+    }
+
+    if (data.contains("shm_ring"))
+    {
+        auto shm_ring = data["shm_ring"];
+        SHM_RINGS = shm_ring.value("enabled", true);
+        SHM_RING_BYTES = shm_ring.value("bytes", SHM_RING_BYTES);
+    }
+
+    if (data.contains("coalesce"))
+    {
+        auto coalesce = data["coalesce"];
+        COALESCE_BYTES = coalesce.value("bytes", COALESCE_BYTES);
+        COALESCE_DELAY_US = coalesce.value("delay_us", COALESCE_DELAY_US);
+    }
+
     file.close();
 
 }
@@ -223,6 +361,12 @@ std::vector<Operation> getOperationsFromProtoTransaction(const request::Transact
         operation.type = (op_proto.type() == request::Operation::WRITE) ? OperationType::WRITE : OperationType::READ;
         operation.key = op_proto.key();
 
+        auto key_it = mockDB_key_ids.find(op_proto.key());
+        if (key_it != mockDB_key_ids.end())
+        {
+            operation.key_id = key_it->second;
+        }
+
         if (op_proto.has_value() && operation.type == OperationType::WRITE)
         {
             operation.value = op_proto.value();
@@ -261,12 +405,12 @@ void* Pinger::pingPeers()
 
         for (auto& server : *args.servers)
         {
-            if (server.port == args.my_port)
+            if (server.id == my_id)
             {
                 continue;
             }
 
-            server.isOnline = Pinger::pingAPeer(server.ip, server.port);
+            server.isOnline = Pinger::pingAPeer(server.id);
             // printf("server %s:%d status: %d\n", server.ip.c_str(), server.port, server.isOnline);
         }
 
@@ -277,43 +421,11 @@ void* Pinger::pingPeers()
 
 }
 
-bool Pinger::pingAPeer(const std::string &ip, int port)   
+bool Pinger::pingAPeer(int32_t id)
 {
-
-    int connfd = setupConnection(ip, port);
-
-    if (connfd < 0)
-    {
-        return false;
-    }
-
-    // create a Request message
-    request::Request request;
-    request.set_server_id(my_id);
-
-    // Set the recipient
-    request.set_recipient(request::Request::PING);
-
-    // // Create the empty Transaction 
-    // request::Transaction *transaction = request.add_transaction();
-
-    // Serialize the Request message
-    std::string serialized_request;
-    if (!request.SerializeToString(&serialized_request))
-    {
-        error("error serializing request");
-    }
-
-    // Send serialized request
-    int sent_bytes = write(connfd, serialized_request.c_str(), serialized_request.size());
-    if (sent_bytes < 0)
-    {
-        error("error writing to socket");
-    }
-
-    close(connfd);
-
-    return true;
+    // the connection manager pings idle connections and hears every frame, so a
+    // peer is online exactly while its connection is up
+    return getConnectionManager()->isUp(id);
 }
 
 // Read exactly n bytes or return –1 on error, 0 on EOF
@@ -335,6 +447,13 @@ bool writeNBytes(int fd, const void *buf, size_t n) {
     size_t left = n;
     while (left) {
         ssize_t w = ::send(fd, p, left, MSG_NOSIGNAL);
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // reactor sockets are non-blocking; wait until there is room again
+            pollfd pfd{fd, POLLOUT, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return false;
+            continue;
+        }
+        if (w < 0 && errno == EINTR) continue;
         if (w <= 0) return false;
         left -= w; p += w;
     }
@@ -359,8 +478,10 @@ Coordinator::Coordinator()
         for (auto& peer : servers) {
             printf("Coordinator: peer %s:%d\n", peer.ip.c_str(), peer.port);
             if (peer.id == my_id) continue;
-            int connfd = setupConnection(peer.ip, peer.port);
-            if (connfd < 0) {
+            // every peer has just sent READY over its connection; give up on one that stays unreachable
+            ConnectionManager::Lease lease =
+                getConnectionManager()->waitFor(peer.id, std::chrono::steady_clock::now() + std::chrono::seconds(5));
+            if (!lease) {
                 fprintf(stderr, "Coordinator: cannot connect to %s:%d\n",
                         peer.ip.c_str(), peer.port);
                 continue;
@@ -373,21 +494,15 @@ Coordinator::Coordinator()
             std::string serialized_request;
             if (!start_msg.SerializeToString(&serialized_request)) {
                 perror("SerializeToString failed");
-                close(connfd);
                 return;
             }
 
-            uint32_t netlen = htonl(uint32_t(serialized_request.size()));
-            if (!writeNBytes(connfd, &netlen, sizeof(netlen)) ||
-                !writeNBytes(connfd, serialized_request.data(), serialized_request.size()))
+            if (!sendFrame(lease.fd(), serialized_request))
             {
-                perror("writeNBytes failed");
-                // connection broken, force reconnect
-                close(connfd);
-                connfd = -1;
-            }  
-
-            close(connfd);
+                perror("sendFrame failed");
+                // connection broken, the manager reconnects
+                lease.broken();
+            }
         }
 
         LOGICAL_EPOCH = std::chrono::steady_clock::now();
@@ -417,8 +532,10 @@ bool Coordinator::sendReadyToLeader(const std::string &leader_ip, int leader_por
 {
     printf("Coordinator: sending READY to leader %s:%d\n", leader_ip.c_str(), leader_port);
 
-    int connfd = setupConnection(leader_ip, leader_port);
-    if (connfd < 0) {
+    // bounded, so the caller's retry loop keeps printing while the leader is down
+    ConnectionManager::Lease lease =
+        getConnectionManager()->waitFor(LEADER_ID, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+    if (!lease) {
         fprintf(stderr, "sendReady: cannot connect to leader %s:%d\n",
                 leader_ip.c_str(), leader_port);
         return false;
@@ -432,17 +549,14 @@ bool Coordinator::sendReadyToLeader(const std::string &leader_ip, int leader_por
     std::string serialized_request;
     if (!ready_msg.SerializeToString(&serialized_request)) {
         perror("SerializeToString failed");
-        close(connfd);
         return false;
     }
 
-    uint32_t netlen = htonl(uint32_t(serialized_request.size()));
-    if (!writeNBytes(connfd, &netlen, sizeof(netlen)) ||
-        !writeNBytes(connfd, serialized_request.data(), serialized_request.size()))
+    if (!sendFrame(lease.fd(), serialized_request))
     {
-        perror("writeNBytes failed");
-        // connection broken, force reconnect
-        close(connfd);
+        perror("sendFrame failed");
+        // connection broken, the manager reconnects
+        lease.broken();
         return false;
     }    
 
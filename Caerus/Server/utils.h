@@ -25,6 +25,8 @@ struct server
     int32_t id;
     bool isOnline;
     bool isLeader;
+    std::string host; // optional "host" label: servers that share one run on the same machine
+    std::string region; // optional "region" label, for the region relay
 };
 
 // PINGER THREAD
@@ -43,7 +45,7 @@ private:
 public:
     Pinger(std::vector<server>* servers, int num_servers, int my_port);
     void* pingPeers();
-    bool pingAPeer(const std::string &ip, int port);
+    bool pingAPeer(int32_t id);
 };
 
 
@@ -68,6 +70,11 @@ struct DataItem
 extern std::unordered_map<std::string, DataItem> mockDB;
 extern std::unordered_map<std::string, DataItem> mockDB_logging;
 
+// keys interned at load time, so the merger can index flat tables by key
+extern std::unordered_map<std::string, KeyId> mockDB_key_ids; // key -> key id
+extern std::vector<int32_t> mockDB_primaries;                 // key id -> primary copy server
+extern std::vector<std::string> mockDB_keys;                  // key id -> key
+
 // SERVER ID
 
 extern int peer_port;
@@ -75,36 +82,49 @@ extern int32_t my_id;
 
 extern std::vector<server> servers;
 
-// HASH COMBINE FUNCTION
-
-template <class T>
-inline void hash_combine(std::size_t& seed, const T& v)
-{
-    std::hash<T> hasher;
-    seed ^= hasher(v)
-          + 0x9e3779b9
-          + (seed << 6)
-          + (seed >> 2);
-}
-
-// specialize std::hash for DataItem struct
-namespace std
-{
-    template <>
-    struct hash<DataItem>
-    {
-        size_t operator()(DataItem const &d) const noexcept
-        {
-            
-            size_t h = 0;
-            hash_combine(h, d.val);
-            hash_combine(h, d.primaryCopyID);
-            return h;
-
-        }
-    };
-
-}
+// MERGER TUNING, optional "merger" object in servers.json
+extern std::string MERGE_MODE; // "coalesce", "per_sequence" or "round"
+extern int MERGE_BUDGET;       // partial sequences per coalesced merge pass, 0 = no limit
+
+// number of transport I/O threads, optional "io_threads" in servers.json
+extern int IO_THREADS;
+// "epoll" or "io_uring", optional "transport" in servers.json
+extern std::string TRANSPORT_BACKEND;
+
+// WIRE FORMAT, optional "wire_format" in servers.json: "protobuf", or "flat" to
+// also read flat frames (see FlatRequest) and send them to peers that do too
+extern std::string WIRE_FORMAT;
+
+// PAYLOAD DEDUP, optional "payload_dedup" in servers.json (the same on every server):
+// the batcher sends a transaction's body once to every other server, and partial
+// sequences to other servers only name their transactions (id and stamp, no
+// operations); each merger keeps the bodies until the names arrive, and asks the
+// server whose partial sequence named one it never got to send it again
+extern bool PAYLOAD_DEDUP;
+constexpr int32_t PAYLOAD_ONLY = -1; // target_server_id of a body meant for the merger alone
+constexpr int32_t NAMES_ONLY = -2;   // target_server_id of a partial sequence that only names its transactions
+constexpr int32_t BODIES_WANTED = -3; // target_server_id of a merger asking a partial sequencer for bodies again
+
+// REGION RELAY, optional "region_relay" in servers.json (the same on every server):
+// partial sequences cross regions bundled per region, see RegionRelay
+extern bool REGION_RELAY;
+
+// LOCAL SOCKETS: peers on the same machine (same "host" label or same ip) are reached
+// over AF_UNIX stream sockets in UNIX_SOCKET_DIR; optional "local_sockets" (on by
+// default) and "unix_socket_dir" in servers.json
+extern bool LOCAL_SOCKETS;
+extern std::string UNIX_SOCKET_DIR;
+
+// SHARED-MEMORY RINGS, optional "shm_ring" object in servers.json: once a local
+// peer's unix socket is up, frames to it go through a ring of this many bytes
+extern bool SHM_RINGS;
+extern int SHM_RING_BYTES;
+
+// OUTBOUND COALESCING, optional "coalesce" object in servers.json: frames for a peer
+// are written together once they reach the byte budget or the oldest one has waited
+// out the delay
+extern int COALESCE_BYTES;
+extern int COALESCE_DELAY_US;
 
 //LEADER INFO
 extern std::string LEADER_IP;
@@ -134,11 +154,16 @@ public:
 
 void error(const char *msg);
 int setupListenfd(int my_port);
+int setupLocalListenfd(const std::string &path);
+bool isColocated(const server &peer);
+std::string localSocketPath(int32_t id);
+int64_t currentRound();
 bool setNonBlocking(int listenfd);
 void threadError(const char *msg);
 int setupConnection(const std::string& ip, int port);
 void setupMockDB();
 void getServers();
+// the operations point into txn_proto, which has to outlive them
 std::vector<Operation> getOperationsFromProtoTransaction(const request::Transaction& txn_proto);
 ssize_t readNBytes(int fd, void *buf, size_t n);
 bool writeNBytes(int fd, const void *buf, size_t n);
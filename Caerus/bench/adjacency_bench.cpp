@@ -0,0 +1,181 @@
+// adjacency_bench: memory per node and Tarjan traversal speed of the graph's
+// adjacency lists, comparing the old unordered_set<TxnHandle> layout with the
+// inline AdjacencyList that Transaction uses now.
+//
+// usage: ./adjacency_bench [nodes]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <random>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "../Server/transaction.h"
+
+namespace
+{
+    constexpr int WINDOW = 64; // edges go to one of the last WINDOW nodes, like MRW/MRR edges do
+
+    struct SetNode
+    {
+        std::unordered_set<TxnHandle> out, in;
+        bool link(SetNode &to, TxnHandle self, TxnHandle other)
+        {
+            if (!out.insert(other).second)
+                return false;
+            to.in.insert(self);
+            return true;
+        }
+    };
+
+    struct CompactNode
+    {
+        AdjacencyList out, in;
+        bool link(CompactNode &to, TxnHandle self, TxnHandle other)
+        {
+            if (!out.insertUnique(other))
+                return false;
+            to.in.insertUnique(self);
+            return true;
+        }
+    };
+
+    // same edge list for both layouts: mostly 1-3 out edges, a few hot nodes with more,
+    // some duplicates that insert has to drop, and the odd back edge to form cycles
+    std::vector<std::pair<TxnHandle, TxnHandle>> makeEdges(uint32_t n)
+    {
+        std::mt19937_64 rng(7);
+        std::uniform_int_distribution<int> percent(0, 99);
+        std::vector<std::pair<TxnHandle, TxnHandle>> edges;
+
+        for (uint32_t v = 1; v < n; ++v)
+        {
+            int roll = percent(rng);
+            int degree = roll < 5 ? 12 : 1 + roll % 3;
+            for (int k = 0; k < degree; ++k)
+            {
+                uint32_t back = 1 + rng() % std::min<uint32_t>(v, WINDOW);
+                edges.push_back({v, v - back});
+                if (percent(rng) < 10)
+                    edges.push_back({v, v - back}); // duplicate
+            }
+            if (percent(rng) < 2)
+                edges.push_back({v - 1, v}); // closes a cycle
+        }
+        return edges;
+    }
+
+    template <typename Node>
+    size_t countSCCs(const std::vector<Node> &nodes)
+    {
+        using Iter = decltype(nodes[0].out.begin());
+        struct Frame
+        {
+            uint32_t v;
+            Iter next, end;
+        };
+
+        const uint32_t n = nodes.size();
+        std::vector<int32_t> index_of(n, -1), low_link(n, 0);
+        std::vector<char> on_stack(n, 0);
+        std::vector<uint32_t> stack;
+        std::vector<Frame> call_stack;
+        int32_t current_index = 0;
+        size_t sccs = 0;
+
+        auto visit = [&](uint32_t v)
+        {
+            index_of[v] = low_link[v] = current_index++;
+            stack.push_back(v);
+            on_stack[v] = 1;
+            call_stack.push_back({v, nodes[v].out.begin(), nodes[v].out.end()});
+        };
+
+        for (uint32_t root = 0; root < n; ++root)
+        {
+            if (index_of[root] >= 0)
+                continue;
+            visit(root);
+            while (!call_stack.empty())
+            {
+                Frame &frame = call_stack.back();
+                const uint32_t v = frame.v;
+                if (frame.next != frame.end)
+                {
+                    const uint32_t w = *frame.next++;
+                    if (index_of[w] < 0)
+                        visit(w);
+                    else if (on_stack[w])
+                        low_link[v] = std::min(low_link[v], index_of[w]);
+                    continue;
+                }
+                if (low_link[v] == index_of[v])
+                {
+                    uint32_t w;
+                    do
+                    {
+                        w = stack.back();
+                        stack.pop_back();
+                        on_stack[w] = 0;
+                    } while (w != v);
+                    ++sccs;
+                }
+                call_stack.pop_back();
+                if (!call_stack.empty())
+                {
+                    const uint32_t u = call_stack.back().v;
+                    low_link[u] = std::min(low_link[u], low_link[v]);
+                }
+            }
+        }
+        return sccs;
+    }
+
+    template <typename Node>
+    void run(const char *name, uint32_t n, const std::vector<std::pair<TxnHandle, TxnHandle>> &edges)
+    {
+        size_t before = mallinfo2().uordblks;
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<Node> *nodes = new std::vector<Node>(n);
+        size_t kept = 0;
+        for (const auto &e : edges)
+        {
+            kept += (*nodes)[e.first].link((*nodes)[e.second], e.first, e.second);
+        }
+
+        auto built = std::chrono::steady_clock::now();
+        size_t bytes = mallinfo2().uordblks - before;
+
+        constexpr int PASSES = 5;
+        size_t sccs = 0;
+        for (int i = 0; i < PASSES; ++i)
+        {
+            sccs = countSCCs(*nodes);
+        }
+        auto done = std::chrono::steady_clock::now();
+
+        printf("%-14s %10.1f %12.1f %14.2f %10zu %8zu\n", name,
+               double(bytes) / n,
+               std::chrono::duration<double, std::milli>(built - start).count(),
+               std::chrono::duration<double, std::milli>(done - built).count() / PASSES,
+               kept, sccs);
+
+        delete nodes;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t n = argc > 1 ? std::atoi(argv[1]) : 200000;
+    auto edges = makeEdges(n);
+
+    printf("%u nodes, %zu edge inserts\n", n, edges.size());
+    printf("%-14s %10s %12s %14s %10s %8s\n", "layout", "bytes/node", "insert ms", "tarjan ms", "edges", "sccs");
+    run<SetNode>("unordered_set", n, edges);
+    run<CompactNode>("AdjacencyList", n, edges);
+    return 0;
+}
@@ -0,0 +1,222 @@
+// alloc_bench: heap allocations per transaction on the way from a client frame
+// to the partial sequence, for the ingress path as it was (every frame parsed
+// into a heap message, copied into the request queue, copied again per target
+// and once more into the partial sequence) against the arena path (frames
+// parsed onto the round's arena and shared from there on, one encoding of a
+// transaction for all of its peers, the partial sequence borrowing the rest).
+//
+// Every round, a batch of client frames goes through the ingress handler, the
+// batcher and the partial sequencer of one server, the way those stages handle
+// them. A transaction touching more than one region is also serialized for
+// each other region and parsed back in as that peer's PARTIAL frame, so both
+// kinds of ingress are counted. Allocations are counted by replacing the
+// global operator new.
+//
+// usage: ./alloc_bench [rounds] [txns per round] [ops per txn] [regions per txn]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <google/protobuf/io/coded_stream.h>
+
+#include "../Server/queueTS.h"
+#include "../Server/roundArena.h"
+
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> allocated_bytes{0};
+}
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Workload
+    {
+        int rounds;
+        int txns;
+        int ops;
+        int regions;
+    };
+
+    // serialized client requests, the same every round
+    std::vector<std::string> clientFrames(const Workload &w)
+    {
+        std::vector<std::string> frames(w.txns);
+        for (int t = 0; t < w.txns; ++t)
+        {
+            request::Request req;
+            req.set_recipient(request::Request::BATCHER);
+            req.set_client_id(7);
+            request::Transaction *txn = req.add_transaction();
+            txn->set_id("client7-txn" + std::to_string(t));
+            txn->set_client_id(7);
+            for (int o = 0; o < w.ops; ++o)
+            {
+                request::Operation *op = txn->add_operations();
+                op->set_type(request::Operation::WRITE);
+                op->set_key("key" + std::to_string(t * w.ops + o));
+                op->set_value(std::string(32, 'v'));
+            }
+            req.SerializeToString(&frames[t]);
+        }
+        return frames;
+    }
+
+    // the tree before: heap messages, copied at every hand-off
+    void heapRound(const Workload &w, int64_t round, const std::vector<std::string> &frames, std::string &wire)
+    {
+        Queue_TS<request::Request> requests;
+        Queue_TS<SharedRequest> to_sequencer;
+
+        for (const std::string &frame : frames)
+        {
+            request::Request req_proto;
+            req_proto.ParseFromArray(frame.data(), frame.size());
+            requests.push(req_proto);
+        }
+
+        std::shared_ptr<RoundArena> arena = RoundArena::forRound(round);
+        std::vector<request::Request> batch = requests.popAll();
+        std::vector<SharedRequest> local;
+        for (request::Request &req_proto : batch)
+        {
+            for (int target = 0; target < w.regions; ++target)
+            {
+                SharedRequest req = arena->newRequest();
+                req->CopyFrom(req_proto);
+                req->set_recipient(request::Request::PARTIAL);
+                req->set_target_server_id(target);
+                if (target == 0)
+                {
+                    local.push_back(req);
+                    continue;
+                }
+
+                // the peer sender writes it, the peer parses it
+                req->SerializeToString(&wire);
+                request::Request received;
+                received.ParseFromArray(wire.data(), wire.size());
+                to_sequencer.push(std::make_shared<request::Request>(std::move(received)));
+            }
+        }
+        to_sequencer.pushAll(local);
+
+        SharedRequest sequence = RoundArena::forRound(round)->newRequest();
+        for (SharedRequest &req : to_sequencer.popAll())
+            sequence->add_transaction()->CopyFrom(req->transaction(0));
+    }
+
+    // the tree now: everything on the round's arena, shared rather than copied; a
+    // transaction is encoded once for all the peers it goes to, each of which only
+    // puts its own envelope in front
+    void arenaRound(const Workload &w, int64_t round, const std::vector<std::string> &frames, std::string &wire)
+    {
+        Queue_TS<SharedRequest> requests;
+        Queue_TS<QueuedTransaction> to_peers;
+        Queue_TS<SharedRequest> to_sequencer;
+
+        for (const std::string &frame : frames)
+            requests.push(RoundArena::parseRequest(round, frame.data(), frame.size()));
+
+        std::vector<SharedRequest> batch = requests.popAll();
+        std::vector<SharedRequest> local;
+        for (SharedRequest &req : batch)
+        {
+            if (w.regions > 1)
+            {
+                const request::Transaction &txn = req->transaction(0);
+                auto encoded = std::make_shared<EncodedTransaction>();
+                uint8_t head[8];
+                head[0] = uint8_t(request::Request::kTransactionFieldNumber << 3 | 2);
+                uint8_t *end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(uint32_t(txn.ByteSizeLong()), head + 1);
+                encoded->body.assign(reinterpret_cast<char *>(head), end - head);
+                txn.AppendToString(&encoded->body);
+                for (int target = 1; target < w.regions; ++target)
+                    to_peers.push({encoded, false});
+            }
+
+            req->set_recipient(request::Request::PARTIAL);
+            req->set_target_server_id(0);
+            local.push_back(req);
+        }
+
+        // the peer senders write envelope and body, the peers parse them
+        request::Request envelope;
+        envelope.set_recipient(request::Request::PARTIAL);
+        envelope.set_batcher_round(int32_t(round));
+        std::string head;
+        envelope.SerializeToString(&head);
+        for (const QueuedTransaction &queued : to_peers.popAll())
+        {
+            wire.assign(head);
+            wire.append(queued.txn->body);
+            to_sequencer.push(RoundArena::parseRequest(round, wire.data(), wire.size()));
+        }
+        to_sequencer.pushAll(local);
+
+        std::vector<SharedRequest> received = to_sequencer.popAll();
+        SharedRequest sequence = RoundArena::forRound(round)->newRequestOver(received);
+        for (SharedRequest &req : received)
+            sequence->mutable_transaction()->UnsafeArenaAddAllocated(req->mutable_transaction(0));
+    }
+
+    template <typename RoundFn>
+    void run(const char *name, const Workload &w, RoundFn round_fn)
+    {
+        std::vector<std::string> frames = clientFrames(w);
+        std::string wire;
+
+        // one round to warm up the queues and the wire buffer
+        round_fn(w, 0, frames, wire);
+
+        uint64_t allocs_before = allocations.load();
+        uint64_t bytes_before = allocated_bytes.load();
+        auto start = Clock::now();
+        for (int r = 1; r <= w.rounds; ++r)
+            round_fn(w, r, frames, wire);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        double txns = double(w.rounds) * w.txns;
+        printf("%-6s %10.1f allocs/txn %10.0f bytes/txn %10.0f ns/txn\n", name,
+               (allocations.load() - allocs_before) / txns,
+               (allocated_bytes.load() - bytes_before) / txns,
+               seconds * 1e9 / txns);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Workload w;
+    w.rounds = argc > 1 ? atoi(argv[1]) : 200;
+    w.txns = argc > 2 ? atoi(argv[2]) : 1000;
+    w.ops = argc > 3 ? atoi(argv[3]) : 4;
+    w.regions = argc > 4 ? atoi(argv[4]) : 2;
+    if (w.rounds <= 0 || w.txns <= 0 || w.ops <= 0 || w.regions <= 0)
+    {
+        fprintf(stderr, "usage: %s [rounds] [txns per round] [ops per txn] [regions per txn]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d rounds of %d transactions, %d ops each, touching %d regions\n", w.rounds, w.txns, w.ops, w.regions);
+    run("heap", w, heapRound);
+    run("arena", w, arenaRound);
+    return 0;
+}
@@ -0,0 +1,285 @@
+// local_bench: what co-located peers gain from a unix socket or a shared-memory
+// ring over TCP loopback.
+//
+// Both ends of one connection are served by a transport (the accepted end
+// through addListener, the connecting end through addConnection), the way two
+// servers on one machine talk; the ring rows use a pair of ShmRings with a
+// reader thread on each, the way the connection manager sets them up:
+//   latency     one frame goes out, the far end sends it straight back; the
+//               round trip is timed, one at a time
+//   throughput  frames are pushed one way in sendFrames batches until the far
+//               end has them all
+//
+// usage: ./local_bench [round trips] [frames] [payload bytes] [batch]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../Server/reactor.h"
+#include "../Server/shmRing.h"
+#include "../Server/uringTransport.h"
+#include "../Server/utils.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Endpoints
+    {
+        int listenfd;
+        sockaddr_storage addr;
+        socklen_t addrlen;
+    };
+
+    // non-blocking listener on an ephemeral loopback port, or on a fresh socket path
+    Endpoints listenOn(bool local)
+    {
+        Endpoints e{};
+        if (local)
+        {
+            std::string path = "/tmp/local_bench_" + std::to_string(getpid()) + ".sock";
+            e.listenfd = setupLocalListenfd(path);
+            sockaddr_un &addr = reinterpret_cast<sockaddr_un &>(e.addr);
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            e.addrlen = sizeof(sockaddr_un);
+        }
+        else
+        {
+            e.listenfd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in &addr = reinterpret_cast<sockaddr_in &>(e.addr);
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (e.listenfd < 0 || bind(e.listenfd, (sockaddr *)&addr, sizeof(addr)) < 0)
+                error("local_bench: cannot bind on loopback");
+            e.addrlen = sizeof(addr);
+            getsockname(e.listenfd, (sockaddr *)&e.addr, &e.addrlen);
+            setNonBlocking(e.listenfd);
+        }
+
+        if (listen(e.listenfd, 16) < 0)
+            error("local_bench: cannot listen");
+        return e;
+    }
+
+    int connectTo(const Endpoints &e)
+    {
+        int fd = socket(e.addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (const sockaddr *)&e.addr, e.addrlen) < 0)
+            error("local_bench: cannot connect");
+        setNonBlocking(fd);
+        return fd;
+    }
+
+    void unlinkPath(const Endpoints &e)
+    {
+        if (e.addr.ss_family == AF_UNIX)
+            unlink(reinterpret_cast<const sockaddr_un &>(e.addr).sun_path);
+    }
+
+    struct Latency
+    {
+        double p50_us, p99_us;
+    };
+
+    // the transport is left running: its I/O threads never stop
+    Latency runLatency(Transport *transport, bool local, int round_trips, const std::string &payload)
+    {
+        Endpoints e = listenOn(local);
+
+        // the accepted end echoes every frame back
+        transport->addListener(e.listenfd, [transport](Connection &conn, const char *data, uint32_t len)
+                               { return transport->sendFrame(conn.fd, data, len); });
+
+        std::atomic<int> echoed{0};
+        int fd = connectTo(e);
+        transport->addConnection(Connection{fd, "", 0}, [&echoed](Connection &, const char *, uint32_t)
+                                 {
+            echoed.fetch_add(1, std::memory_order_release);
+            return true; });
+
+        std::vector<double> samples;
+        samples.reserve(round_trips);
+        for (int i = 0; i < round_trips; ++i)
+        {
+            auto start = Clock::now();
+            transport->sendFrame(fd, payload.data(), uint32_t(payload.size()));
+            while (echoed.load(std::memory_order_acquire) <= i)
+                std::this_thread::yield();
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+
+        unlinkPath(e);
+        std::sort(samples.begin(), samples.end());
+        return {samples[samples.size() / 2], samples[samples.size() * 99 / 100]};
+    }
+
+    double runThroughput(Transport *transport, bool local, int frames, const std::string &payload, int batch)
+    {
+        Endpoints e = listenOn(local);
+        std::atomic<int> received{0};
+
+        transport->addListener(e.listenfd, [&received](Connection &, const char *, uint32_t)
+                               {
+            received.fetch_add(1, std::memory_order_relaxed);
+            return true; });
+
+        int fd = connectTo(e);
+
+        std::vector<FrameSend> sends(batch);
+        auto start = Clock::now();
+        for (int sent = 0; sent < frames;)
+        {
+            int n = std::min(batch, frames - sent);
+            for (int k = 0; k < n; ++k)
+                sends[k] = {fd, payload.data(), uint32_t(payload.size()), false};
+            transport->sendFrames(sends.data(), n);
+            sent += n;
+        }
+        while (received.load(std::memory_order_relaxed) < frames)
+            std::this_thread::yield();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        close(fd);
+        unlinkPath(e);
+        return seconds;
+    }
+
+    std::shared_ptr<ShmRing> makeRing(const char *which)
+    {
+        std::string name = "/local_bench_" + std::to_string(getpid()) + "_" + which;
+        std::shared_ptr<ShmRing> producer = ShmRing::create(name, 4 * 1024 * 1024);
+        if (!producer)
+            error("local_bench: cannot create a ring");
+        return producer;
+    }
+
+    // one process plays both servers; each ring is still mapped twice, as between two processes
+    void runShm(int round_trips, int frames, const std::string &payload, int batch)
+    {
+        std::shared_ptr<ShmRing> there = makeRing("there");
+        std::shared_ptr<ShmRing> back = makeRing("back");
+        std::shared_ptr<ShmRing> there_reader = ShmRing::open(there->name());
+        std::shared_ptr<ShmRing> back_reader = ShmRing::open(back->name());
+
+        std::atomic<int> echoed{0};
+        std::thread echo([&]
+                         {
+            Connection conn{-1, "", 0};
+            there_reader->consume([&](Connection &, const char *data, uint32_t len)
+                                  {
+                FrameSend send{-1, data, len, false};
+                back->write(&send, 1);
+                return send.ok; }, conn); });
+        std::thread count([&]
+                          {
+            Connection conn{-1, "", 0};
+            back_reader->consume([&](Connection &, const char *, uint32_t)
+                                 {
+                echoed.fetch_add(1, std::memory_order_release);
+                return true; }, conn); });
+
+        std::vector<double> samples;
+        samples.reserve(round_trips);
+        for (int i = 0; i < round_trips; ++i)
+        {
+            auto start = Clock::now();
+            FrameSend send{-1, payload.data(), uint32_t(payload.size()), false};
+            there->write(&send, 1);
+            while (echoed.load(std::memory_order_acquire) <= i)
+                std::this_thread::yield();
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        there->close();
+        back->close();
+        echo.join();
+        count.join();
+        std::sort(samples.begin(), samples.end());
+
+        std::shared_ptr<ShmRing> stream = makeRing("stream");
+        std::shared_ptr<ShmRing> stream_reader = ShmRing::open(stream->name());
+        std::atomic<int> received{0};
+        std::thread reader([&]
+                           {
+            Connection conn{-1, "", 0};
+            stream_reader->consume([&](Connection &, const char *, uint32_t)
+                                   {
+                received.fetch_add(1, std::memory_order_relaxed);
+                return true; }, conn); });
+
+        std::vector<FrameSend> sends(batch);
+        auto start = Clock::now();
+        for (int sent = 0; sent < frames;)
+        {
+            int n = std::min(batch, frames - sent);
+            for (int k = 0; k < n; ++k)
+                sends[k] = {-1, payload.data(), uint32_t(payload.size()), false};
+            stream->write(sends.data(), n);
+            sent += n;
+        }
+        while (received.load(std::memory_order_relaxed) < frames)
+            std::this_thread::yield();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        stream->close();
+        reader.join();
+
+        printf("%-9s %-5s %9.1f us p50 %9.1f us p99 %12.0f frames/s %9.1f MB/s\n",
+               "shm", "ring", samples[samples.size() / 2], samples[samples.size() * 99 / 100],
+               frames / seconds, frames * double(payload.size()) / seconds / 1e6);
+    }
+
+    void run(const char *name, Transport *transport, int round_trips, int frames,
+             const std::string &payload, int batch)
+    {
+        for (bool local : {false, true})
+        {
+            Latency lat = runLatency(transport, local, round_trips, payload);
+            double seconds = runThroughput(transport, local, frames, payload, batch);
+            printf("%-9s %-5s %9.1f us p50 %9.1f us p99 %12.0f frames/s %9.1f MB/s\n",
+                   name, local ? "unix" : "tcp", lat.p50_us, lat.p99_us, frames / seconds,
+                   frames * double(payload.size()) / seconds / 1e6);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int round_trips = argc > 1 ? atoi(argv[1]) : 20000;
+    int frames = argc > 2 ? atoi(argv[2]) : 200000;
+    int payload_bytes = argc > 3 ? atoi(argv[3]) : 256;
+    int batch = argc > 4 ? atoi(argv[4]) : 16;
+    if (round_trips <= 0 || frames <= 0 || payload_bytes < 0 || batch <= 0)
+    {
+        fprintf(stderr, "usage: %s [round trips] [frames] [payload bytes] [batch]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string payload(payload_bytes, 'x');
+    printf("%d round trips, %d frames of %d bytes in batches of %d\n", round_trips, frames, payload_bytes, batch);
+
+    run("epoll", new Reactor(2), round_trips, frames, payload, batch);
+
+    if (UringTransport::supported())
+        run("io_uring", new UringTransport(2), round_trips, frames, payload, batch);
+    else
+        printf("io_uring  not supported by this kernel\n");
+
+    runShm(round_trips, frames, payload, batch);
+
+    return 0;
+}
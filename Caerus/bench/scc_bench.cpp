@@ -0,0 +1,167 @@
+// scc_bench: per-batch merge cost as the graph backlog grows.
+//
+// Replays the same synthetic workload twice, once with the SCCs recomputed from scratch on
+// every merge pass (the old findSCCs + condensation path) and once with the incrementally
+// maintained SCCs, and prints the average cost of inserting one batch and running
+// getMergedOrders_ at increasing backlog sizes.
+//
+// usage: ./scc_bench [rounds] [txns per round]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../Server/graph.h"
+
+namespace
+{
+    constexpr int32_t REGIONS = 3;
+    constexpr int32_t MISSING_REGION = REGIONS + 1; // never delivers, so its txns pile up
+    constexpr int RECENT_WINDOW = 8;                 // how far back a dependency can reach
+
+    struct BatchResult
+    {
+        size_t backlog;
+        double micros;
+        int32_t merged;
+    };
+
+    std::vector<BatchResult> run(bool incremental, int rounds, int per_round)
+    {
+        Graph graph;
+        graph.setIncrementalSCC(incremental);
+
+        std::mt19937_64 rng(42);
+        std::uniform_int_distribution<int32_t> stamp;
+        std::uniform_int_distribution<int> percent(0, 99);
+
+        // txns each region has sequenced recently, i.e. its most recent writers
+        std::vector<std::deque<TxnHandle>> recent(REGIONS + 1);
+        // txns that still have to show up in another region's partial sequence
+        std::vector<std::vector<TxnHandle>> pending_regions(REGIONS + 1);
+
+        std::vector<BatchResult> results;
+        results.reserve(rounds * REGIONS);
+        uint64_t next_id = 0;
+
+        auto addDependencies = [&](Transaction *txn, int32_t region)
+        {
+            auto &window = recent[region];
+            for (int k = 0; k < 2 && !window.empty(); ++k)
+            {
+                auto *dep = graph.getNode(window[rng() % window.size()]);
+                if (dep != nullptr && dep != txn)
+                {
+                    graph.addNeighborOut(txn, dep);
+                }
+            }
+            window.push_back(txn->getHandle());
+            if ((int)window.size() > RECENT_WINDOW)
+            {
+                window.pop_front();
+            }
+        };
+
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (int32_t region = 1; region <= REGIONS; ++region)
+            {
+                auto start = std::chrono::steady_clock::now();
+
+                // txns first sequenced elsewhere that this region also owns a key of
+                std::vector<TxnHandle> second_visits;
+                second_visits.swap(pending_regions[region]);
+                for (TxnHandle handle : second_visits)
+                {
+                    Transaction *txn = graph.getNode(handle);
+                    if (txn == nullptr)
+                    {
+                        continue;
+                    }
+                    graph.addSeenRegion(txn, region);
+                    addDependencies(txn, region);
+                }
+
+                for (int i = 0; i < per_round / REGIONS; ++i)
+                {
+                    RegionSet expected;
+                    expected.set(region);
+                    int roll = percent(rng);
+                    int32_t other = 0;
+                    if (roll < 2)
+                    {
+                        expected.set(MISSING_REGION);
+                    }
+                    else if (roll < 30)
+                    {
+                        other = region % REGIONS + 1;
+                        expected.set(other);
+                    }
+
+                    Transaction txn(stamp(rng), region, std::vector<Operation>{}, std::to_string(next_id++));
+                    txn.setExpectedRegions(expected);
+                    txn.addSeenRegion(region);
+                    Transaction *ptr = graph.addNode(txn);
+                    addDependencies(ptr, region);
+
+                    if (other != 0)
+                    {
+                        pending_regions[other].push_back(ptr->getHandle());
+                    }
+                }
+
+                int32_t merged = graph.getMergedOrders_();
+
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                results.push_back({graph.size(),
+                                   std::chrono::duration<double, std::micro>(elapsed).count(),
+                                   merged});
+            }
+        }
+
+        return results;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 100;
+    int per_round = argc > 2 ? std::atoi(argv[2]) : 300;
+
+    auto full = run(false, rounds, per_round);
+    auto incremental = run(true, rounds, per_round);
+
+    // both modes must merge exactly the same transactions on every pass
+    for (size_t i = 0; i < full.size(); ++i)
+    {
+        if (full[i].merged != incremental[i].merged || full[i].backlog != incremental[i].backlog)
+        {
+            fprintf(stderr, "scc_bench: mismatch at batch %zu (full merged %d, incremental merged %d)\n",
+                    i, full[i].merged, incremental[i].merged);
+            return 1;
+        }
+    }
+
+    printf("%-12s %-18s %-18s\n", "backlog", "full us/batch", "incremental us/batch");
+
+    // average over buckets of batches so the table has ~10 rows
+    size_t bucket = std::max<size_t>(1, full.size() / 10);
+    for (size_t i = 0; i < full.size(); i += bucket)
+    {
+        size_t end = std::min(full.size(), i + bucket);
+        double f = 0, inc = 0;
+        for (size_t j = i; j < end; ++j)
+        {
+            f += full[j].micros;
+            inc += incremental[j].micros;
+        }
+        printf("%-12zu %-18.1f %-18.1f\n", full[end - 1].backlog, f / (end - i), inc / (end - i));
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+// transport_bench: frames per second and system calls per frame over loopback,
+// for the old blocking path (a thread per connection, readNBytes/writeNBytes
+// for the length and the payload) against the epoll and io_uring transports.
+//
+// One sender pushes frames of a fixed size at one connection; the transports
+// get them in sendFrames batches. System calls are counted on both ends.
+//
+// usage: ./transport_bench [frames] [payload bytes] [batch]
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../Server/reactor.h"
+#include "../Server/uringTransport.h"
+#include "../Server/utils.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Result
+    {
+        double seconds;
+        uint64_t syscalls;
+    };
+
+    // non-blocking listener on an ephemeral loopback port
+    int listenLoopback(int &port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+            error("transport_bench: cannot listen on loopback");
+
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+        setNonBlocking(fd);
+        return fd;
+    }
+
+    int connectLoopback(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+            error("transport_bench: cannot connect");
+        return fd;
+    }
+
+    // the same loops as readNBytes/writeNBytes, counting every call
+    bool countedRead(int fd, void *buf, size_t n, uint64_t &calls)
+    {
+        char *p = static_cast<char *>(buf);
+        while (n)
+        {
+            ssize_t r = ::read(fd, p, n);
+            ++calls;
+            if (r <= 0)
+                return false;
+            p += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    bool countedWrite(int fd, const void *buf, size_t n, uint64_t &calls)
+    {
+        const char *p = static_cast<const char *>(buf);
+        while (n)
+        {
+            ssize_t w = ::write(fd, p, n);
+            ++calls;
+            if (w <= 0)
+                return false;
+            p += w;
+            n -= w;
+        }
+        return true;
+    }
+
+    Result runBlocking(int frames, const std::string &payload)
+    {
+        int port;
+        int listenfd = listenLoopback(port);
+        uint64_t recv_calls = 0, send_calls = 0;
+
+        std::thread receiver([&]
+                             {
+            int connfd;
+            while ((connfd = accept(listenfd, nullptr, nullptr)) < 0)
+                std::this_thread::yield();
+            int flags = fcntl(connfd, F_GETFL, 0);
+            fcntl(connfd, F_SETFL, flags & ~O_NONBLOCK);
+
+            std::vector<char> buf;
+            for (int i = 0; i < frames; ++i)
+            {
+                uint32_t netlen;
+                if (!countedRead(connfd, &netlen, sizeof(netlen), recv_calls))
+                    break;
+                buf.resize(ntohl(netlen));
+                if (!countedRead(connfd, buf.data(), buf.size(), recv_calls))
+                    break;
+            }
+            close(connfd); });
+
+        int fd = connectLoopback(port);
+        auto start = Clock::now();
+        for (int i = 0; i < frames; ++i)
+        {
+            uint32_t netlen = htonl(uint32_t(payload.size()));
+            countedWrite(fd, &netlen, sizeof(netlen), send_calls);
+            countedWrite(fd, payload.data(), payload.size(), send_calls);
+        }
+        receiver.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        close(fd);
+        close(listenfd);
+        return {seconds, recv_calls + send_calls};
+    }
+
+    // the transport is left running: its I/O threads never stop
+    Result runTransport(Transport *transport, int frames, const std::string &payload, int batch)
+    {
+        int port;
+        int listenfd = listenLoopback(port);
+        std::atomic<int> received{0};
+
+        transport->addListener(listenfd, [&received](Connection &, const char *, uint32_t)
+                               {
+            received.fetch_add(1, std::memory_order_relaxed);
+            return true; });
+
+        int fd = connectLoopback(port);
+        TransportStats before = transport->stats();
+
+        std::vector<FrameSend> sends(batch);
+        auto start = Clock::now();
+        for (int sent = 0; sent < frames;)
+        {
+            int n = std::min(batch, frames - sent);
+            for (int k = 0; k < n; ++k)
+                sends[k] = {fd, payload.data(), uint32_t(payload.size()), false};
+            transport->sendFrames(sends.data(), n);
+            sent += n;
+        }
+        while (received.load(std::memory_order_relaxed) < frames)
+            std::this_thread::yield();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        TransportStats after = transport->stats();
+        close(fd);
+        return {seconds, after.syscalls - before.syscalls};
+    }
+
+    void report(const char *name, int frames, const Result &r)
+    {
+        printf("%-10s %12.0f frames/s %8.2f syscalls/frame\n",
+               name, frames / r.seconds, double(r.syscalls) / frames);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 200000;
+    int payload_bytes = argc > 2 ? atoi(argv[2]) : 256;
+    int batch = argc > 3 ? atoi(argv[3]) : 16;
+    if (frames <= 0 || payload_bytes < 0 || batch <= 0)
+    {
+        fprintf(stderr, "usage: %s [frames] [payload bytes] [batch]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string payload(payload_bytes, 'x');
+    printf("%d frames of %d bytes, batches of %d\n", frames, payload_bytes, batch);
+
+    report("blocking", frames, runBlocking(frames, payload));
+    report("epoll", frames, runTransport(new Reactor(1), frames, payload, batch));
+
+    if (UringTransport::supported())
+        report("io_uring", frames, runTransport(new UringTransport(1), frames, payload, batch));
+    else
+        printf("io_uring   not supported by this kernel\n");
+
+    return 0;
+}
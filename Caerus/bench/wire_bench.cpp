@@ -0,0 +1,163 @@
+// wire_bench: a partial sequence through the protobuf wire format against the
+// flat one (FlatRequest), end to end on one side each:
+//   send     the partial sequencer encodes it for a peer
+//   receive  the peer's merger gets the operations of every transaction out of
+//            the frame: a parse and getOperationsFromProtoTransaction for
+//            protobuf, a copy of the frame, one check and loads for flat
+//
+// usage: ./wire_bench [sequences] [txns per sequence] [ops per txn] [value bytes]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../Server/flatRequest.h"
+#include "../Server/utils.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Result
+    {
+        double send_s;
+        double receive_s;
+        size_t bytes;
+        size_t ops; // read back, so the work is not optimized away
+    };
+
+    request::Request makeSequence(int txns, int ops, int value_bytes)
+    {
+        request::Request seq;
+        seq.set_recipient(request::Request::MERGER);
+        seq.set_server_id(1);
+        seq.set_round(42);
+        for (int t = 0; t < txns; ++t)
+        {
+            request::Transaction *txn = seq.add_transaction();
+            txn->set_id("client7-txn" + std::to_string(t));
+            txn->set_client_id(7);
+            txn->set_random_stamp(t * 7919);
+            for (int o = 0; o < ops; ++o)
+            {
+                request::Operation *op = txn->add_operations();
+                bool write = o % 2 == 0;
+                op->set_type(write ? request::Operation::WRITE : request::Operation::READ);
+                op->set_key(mockDB_keys[(t * ops + o) % mockDB_keys.size()]);
+                if (write)
+                    op->set_value(std::string(value_bytes, 'v'));
+            }
+        }
+        return seq;
+    }
+
+    Result runProtobuf(const request::Request &seq, int sequences)
+    {
+        Result r{0, 0, 0, 0};
+        std::string frame;
+
+        auto start = Clock::now();
+        for (int i = 0; i < sequences; ++i)
+        {
+            frame.clear();
+            seq.SerializeToString(&frame);
+        }
+        r.send_s = std::chrono::duration<double>(Clock::now() - start).count();
+        r.bytes = frame.size();
+
+        start = Clock::now();
+        for (int i = 0; i < sequences; ++i)
+        {
+            google::protobuf::Arena arena;
+            auto *received = google::protobuf::Arena::CreateMessage<request::Request>(&arena);
+            received->ParseFromArray(frame.data(), frame.size());
+            for (const auto &txn : received->transaction())
+                r.ops += getOperationsFromProtoTransaction(txn).size();
+        }
+        r.receive_s = std::chrono::duration<double>(Clock::now() - start).count();
+        return r;
+    }
+
+    Result runFlat(const request::Request &seq, int sequences)
+    {
+        Result r{0, 0, 0, 0};
+        std::string frame;
+
+        auto start = Clock::now();
+        for (int i = 0; i < sequences; ++i)
+        {
+            frame.clear();
+            if (!FlatRequest::encode(seq, frame))
+                error("wire_bench: cannot encode flat");
+        }
+        r.send_s = std::chrono::duration<double>(Clock::now() - start).count();
+        r.bytes = frame.size();
+
+        start = Clock::now();
+        for (int i = 0; i < sequences; ++i)
+        {
+            SharedFlatRequest received = FlatRequest::copy(frame.data(), frame.size());
+            for (uint32_t t = 0; t < received->transaction_size(); ++t)
+            {
+                FlatRequest::Txn txn = received->transaction(t);
+                std::vector<Operation> operations(txn.op_count);
+                for (uint32_t k = 0; k < txn.op_count; ++k)
+                {
+                    FlatRequest::Op op = received->operation(txn.first_op + k);
+                    operations[k].type = op.type;
+                    operations[k].key_id = op.key_id;
+                    operations[k].key = mockDB_keys[op.key_id];
+                    if (op.has_value)
+                        operations[k].value = op.value;
+                }
+                r.ops += operations.size();
+            }
+        }
+        r.receive_s = std::chrono::duration<double>(Clock::now() - start).count();
+        return r;
+    }
+
+    void report(const char *name, const Result &r, int sequences, int txns)
+    {
+        double total_txns = double(sequences) * txns;
+        double mb = double(r.bytes) * sequences / 1e6;
+        printf("%-9s %7zu bytes/seq  send %10.0f txns/s %8.1f MB/s  receive %10.0f txns/s %8.1f MB/s\n",
+               name, r.bytes, total_txns / r.send_s, mb / r.send_s, total_txns / r.receive_s, mb / r.receive_s);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int sequences = argc > 1 ? atoi(argv[1]) : 2000;
+    int txns = argc > 2 ? atoi(argv[2]) : 500;
+    int ops = argc > 3 ? atoi(argv[3]) : 4;
+    int value_bytes = argc > 4 ? atoi(argv[4]) : 32;
+    if (sequences <= 0 || txns <= 0 || ops <= 0 || value_bytes < 0)
+    {
+        fprintf(stderr, "usage: %s [sequences] [txns per sequence] [ops per txn] [value bytes]\n", argv[0]);
+        return 1;
+    }
+
+    // a database the size of the mock one, keyed the same way
+    for (int k = 0; k < 1000; ++k)
+    {
+        std::string key = "key" + std::to_string(k);
+        mockDB_key_ids.emplace(key, KeyId(k));
+        mockDB_primaries.push_back(k % 3);
+        mockDB_keys.push_back(key);
+    }
+
+    request::Request seq = makeSequence(txns, ops, value_bytes);
+    printf("%d partial sequences of %d transactions, %d ops each, %d-byte values\n", sequences, txns, ops, value_bytes);
+
+    Result proto = runProtobuf(seq, sequences);
+    Result flat = runFlat(seq, sequences);
+    if (proto.ops != flat.ops)
+        error("wire_bench: the formats disagree");
+
+    report("protobuf", proto, sequences, txns);
+    report("flat", flat, sequences, txns);
+    return 0;
+}
@@ -0,0 +1,575 @@
+// relay_failover: runs server 1's RegionRelay, with its ConnectionManager and the
+// epoll transport, against receivers for servers 2 to 5 on loopback, and checks
+// the bundles each receiver decodes while connections fail and a server goes
+// down.
+//
+// Regions {1, 2}, {3, 4} and {5}. Server 1 is the relay of the even rounds of
+// its region; the test collects both servers' partial sequences for a round and
+// expects one bundle with both of them in each other region, at the round's
+// relay there or, with that one down, at the other server:
+//
+//   round 0  everything up
+//   round 2  the bundle write to server 3 fails once: it goes out again, on the
+//            new connection to 3 or to 4, and is taken exactly once
+//   round 4  server 3 is down: server 4 takes it
+//   round 6  server 3 still down, the write to 4 fails once: 4 takes it later
+//
+// and then that a bundle from another region reaches server 2 with FAN_OUT
+// cleared, and that one whose write to 2 failed is not sent again nor holds up
+// the next one.
+//
+// Server 1 runs with "wire_format": "flat" and its region's sequences come to
+// the relay flat. Only server 5 says it reads flat, so it has to get them flat
+// and every other receiver as protobuf.
+//
+// The transport is wrapped so that the next bundle to a given server fails, the
+// way a write on a broken connection does, with the rest of its batch. The receivers heartbeat like a server and decode bundles like
+// handleBundleFrame (the merger side of deliverPartialSequence is not run).
+//
+// usage: ./relay_failover
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <set>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../Server/connectionManager.h"
+#include "../Server/flatRequest.h"
+#include "../Server/regionRelay.h"
+#include "../Server/transport.h"
+#include "../Server/utils.h"
+#include "../proto/request.pb.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr std::chrono::milliseconds WAIT{3000};   // for something that should happen
+    constexpr std::chrono::milliseconds SETTLE{300};  // for something that should not
+    constexpr std::chrono::milliseconds PING_EVERY{200};
+
+    // what a receiver took out of one bundle
+    struct Delivery
+    {
+        bool fan_out;
+        bool flat;
+        int32_t server_id;
+        int32_t round;
+    };
+
+    // The epoll transport, with bundle writes to chosen servers failing.
+    class FlakyTransport : public Transport
+    {
+    private:
+        Transport *inner;
+        std::mutex mtx;
+        std::map<int, int32_t> peer_of; // socket -> server, for the connections the manager opened
+        std::set<int32_t> fail_next;    // servers whose next bundle fails
+
+    public:
+        explicit FlakyTransport(Transport *inner) : inner(inner) {}
+
+        void failNextBundle(int32_t server_id)
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            fail_next.insert(server_id);
+        }
+
+        const char *name() const override { return "flaky"; }
+
+        void addListener(int listenfd, FrameHandler handler, CloseHandler on_close) override
+        {
+            inner->addListener(listenfd, std::move(handler), std::move(on_close));
+        }
+
+        void addConnection(const Connection &conn, FrameHandler handler, CloseHandler on_close) override
+        {
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                peer_of[conn.fd] = conn.peer;
+            }
+            inner->addConnection(conn, std::move(handler), std::move(on_close));
+        }
+
+        bool sendFrame(int fd, const char *data, uint32_t len) override
+        {
+            FrameSend send{fd, data, len, false};
+            sendFrames(&send, 1);
+            return send.ok;
+        }
+
+        void sendFrames(FrameSend *sends, size_t n) override
+        {
+            // the rest of the batch fails on a socket with a failed write; the caller's
+            // Lease::broken() shuts it down, so later writes on it fail for real
+            std::set<int> broken;
+            for (size_t i = 0; i < n; ++i)
+            {
+                {
+                    std::lock_guard<std::mutex> lk(mtx);
+                    auto it = peer_of.find(sends[i].fd);
+                    if (it != peer_of.end() && RegionRelay::isBundle(sends[i].data, sends[i].len) &&
+                        fail_next.erase(it->second))
+                        broken.insert(sends[i].fd);
+                }
+
+                if (broken.count(sends[i].fd))
+                    sends[i].ok = false;
+                else
+                    inner->sendFrames(&sends[i], 1);
+            }
+        }
+    };
+
+    // One of the other servers: takes the connection server 1 opens, heartbeats on
+    // it and decodes the bundles that come in.
+    class Receiver
+    {
+    private:
+        int32_t id;
+        int listen_fd = -1;
+        std::thread reader;
+        std::thread pinger;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        int conn_fd = -1;
+        bool stopped = false;
+        std::vector<Delivery> got;
+
+        bool writeFrame(int fd, const std::string &payload)
+        {
+            uint32_t netlen = htonl(uint32_t(payload.size()));
+            return writeNBytes(fd, &netlen, sizeof(netlen)) && writeNBytes(fd, payload.data(), payload.size());
+        }
+
+        void take(const char *data, uint32_t len)
+        {
+            if (!RegionRelay::isBundle(data, len))
+                return; // the hello and the heartbeats
+
+            bool fan_out = false;
+            std::vector<std::string_view> frames;
+            if (!RegionRelay::unpack(data, len, fan_out, frames))
+            {
+                fprintf(stderr, "FAIL: server %d got a malformed bundle\n", id);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lk(mtx);
+            for (std::string_view frame : frames)
+            {
+                if (FlatRequest::isFlat(frame.data(), uint32_t(frame.size())))
+                {
+                    SharedFlatRequest seq = FlatRequest::copy(frame.data(), uint32_t(frame.size()));
+                    if (seq && seq->recipient() == request::Request::MERGER)
+                    {
+                        got.push_back({fan_out, true, seq->server_id(), seq->round()});
+                        continue;
+                    }
+                }
+                else
+                {
+                    request::Request seq;
+                    if (seq.ParseFromArray(frame.data(), int(frame.size())) && seq.recipient() == request::Request::MERGER)
+                    {
+                        got.push_back({fan_out, false, seq.server_id(), seq.round()});
+                        continue;
+                    }
+                }
+                fprintf(stderr, "FAIL: server %d got a bundle with a frame that is no partial sequence\n", id);
+            }
+            cv.notify_all();
+        }
+
+        void readLoop()
+        {
+            while (true)
+            {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0)
+                    return; // stopped
+
+                {
+                    std::lock_guard<std::mutex> lk(mtx);
+                    if (stopped)
+                    {
+                        close(fd);
+                        return;
+                    }
+                    conn_fd = fd;
+
+                    // the dialer hears what this side reads at once, as from a server
+                    writeFrame(fd, ping());
+                }
+
+                std::string frame;
+                uint32_t netlen;
+                while (readNBytes(fd, &netlen, sizeof(netlen)) == sizeof(netlen))
+                {
+                    frame.resize(ntohl(netlen));
+                    if (readNBytes(fd, &frame[0], frame.size()) != ssize_t(frame.size()))
+                        break;
+                    take(frame.data(), uint32_t(frame.size()));
+                }
+
+                std::lock_guard<std::mutex> lk(mtx);
+                conn_fd = -1;
+                close(fd);
+            }
+        }
+
+        std::string ping() const
+        {
+            request::Request msg;
+            msg.set_recipient(request::Request::PING);
+            msg.set_server_id(id);
+            if (reads_flat)
+                msg.set_client_id(ConnectionManager::READS_FLAT);
+            std::string serialized;
+            msg.SerializeToString(&serialized);
+            return serialized;
+        }
+
+        void pingLoop()
+        {
+            std::string serialized = ping();
+
+            std::unique_lock<std::mutex> lk(mtx);
+            while (!stopped)
+            {
+                if (conn_fd >= 0)
+                    writeFrame(conn_fd, serialized);
+                cv.wait_for(lk, PING_EVERY, [this]()
+                            { return stopped; });
+            }
+        }
+
+    public:
+        int port = 0;
+        bool reads_flat;
+
+        Receiver(int32_t id, bool reads_flat) : id(id), reads_flat(reads_flat)
+        {
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t addrlen = sizeof(addr);
+            if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+                listen(listen_fd, 8) < 0 || getsockname(listen_fd, (sockaddr *)&addr, &addrlen) < 0)
+            {
+                perror("relay_failover: listener");
+                exit(1);
+            }
+            port = ntohs(addr.sin_port);
+        }
+
+        void start()
+        {
+            reader = std::thread([this]()
+                                 { readLoop(); });
+            pinger = std::thread([this]()
+                                 { pingLoop(); });
+        }
+
+        // The server goes away: its listener and its connection close.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                stopped = true;
+                if (conn_fd >= 0)
+                    shutdown(conn_fd, SHUT_RDWR);
+            }
+            cv.notify_all();
+            shutdown(listen_fd, SHUT_RDWR);
+            close(listen_fd);
+            reader.join();
+            pinger.join();
+        }
+
+        ~Receiver()
+        {
+            if (reader.joinable())
+                stop();
+        }
+
+        // How many times this server took the partial sequence of server_id for round.
+        int count(int32_t server_id, int32_t round, bool *fan_out = nullptr)
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            int n = 0;
+            for (const Delivery &d : got)
+            {
+                if (d.server_id == server_id && d.round == round)
+                {
+                    ++n;
+                    if (fan_out)
+                        *fan_out = d.fan_out;
+                }
+            }
+            return n;
+        }
+
+        // How many of the sequences taken came in a format this server does not read.
+        int unreadable()
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            int n = 0;
+            for (const Delivery &d : got)
+                n += d.flat && !reads_flat;
+            return n;
+        }
+
+        // How many of the sequences taken came flat.
+        int flat()
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            int n = 0;
+            for (const Delivery &d : got)
+                n += d.flat;
+            return n;
+        }
+    };
+
+    std::map<int32_t, std::unique_ptr<Receiver>> receivers;
+    int failures = 0;
+
+    int countIn(const std::vector<int32_t> &region, int32_t server_id, int32_t round)
+    {
+        int n = 0;
+        for (int32_t id : region)
+            n += receivers[id]->count(server_id, round);
+        return n;
+    }
+
+    // Waits for done, up to WAIT.
+    bool eventually(const std::function<bool()> &done)
+    {
+        auto deadline = Clock::now() + WAIT;
+        while (!done())
+        {
+            if (Clock::now() >= deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return true;
+    }
+
+    std::string partialSequence(int32_t server_id, int32_t round, bool flat = false)
+    {
+        request::Request seq;
+        seq.set_recipient(request::Request::MERGER);
+        seq.set_server_id(server_id);
+        seq.set_round(round);
+        request::Transaction *txn = seq.add_transaction();
+        txn->set_id(std::to_string(server_id) + "-" + std::to_string(round));
+
+        std::string frame;
+        if (flat)
+            FlatRequest::encode(seq, frame);
+        else
+            seq.SerializeToString(&frame);
+        return frame;
+    }
+
+    // Both of region {1, 2}'s sequences for round, handed to the relay like the
+    // sequencer and the peer handler hand them, and where they should turn up.
+    void relayRound(RegionRelay &relay, int32_t round, const char *what, const std::vector<int32_t> &expected_at)
+    {
+        for (int32_t server_id : {1, 2})
+        {
+            std::string frame = partialSequence(server_id, round, true);
+            relay.collect(server_id, round, frame.data(), uint32_t(frame.size()));
+        }
+
+        const std::vector<std::vector<int32_t>> remote = {{3, 4}, {5}};
+        for (const auto &region : remote)
+        {
+            for (int32_t server_id : {1, 2})
+            {
+                eventually([&]()
+                           { return countIn(region, server_id, round) > 0; });
+            }
+        }
+        std::this_thread::sleep_for(SETTLE);
+
+        int failures_before = failures;
+        for (const auto &region : remote)
+        {
+            for (int32_t server_id : {1, 2})
+            {
+                int n = countIn(region, server_id, round);
+                if (n != 1)
+                {
+                    fprintf(stderr, "FAIL: round %d (%s): region of server %d took server %d's sequence %d times\n",
+                            round, what, region.front(), server_id, n);
+                    ++failures;
+                }
+            }
+        }
+        for (int32_t id : expected_at)
+        {
+            bool fan_out = false;
+            if (receivers[id]->count(1, round, &fan_out) != 1 || !fan_out)
+            {
+                fprintf(stderr, "FAIL: round %d (%s): server %d did not take the bundle to pass on\n", round, what, id);
+                ++failures;
+            }
+        }
+        if (failures == failures_before)
+            printf("round %d (%s): each other region took both sequences once\n", round, what);
+    }
+
+    // A bundle from region {5} with FAN_OUT set, as it arrives at server 1.
+    std::string remoteBundle(int32_t round)
+    {
+        std::string inner = partialSequence(5, round);
+        std::string out(RegionRelay::HEADER, '\0');
+        out[0] = char(RegionRelay::MAGIC);
+        out[1] = char(RegionRelay::FAN_OUT);
+        memcpy(&out[4], &round, sizeof(round));
+        uint32_t count = 1, len = uint32_t(inner.size());
+        memcpy(&out[8], &count, sizeof(count));
+        out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        out.append(inner);
+        return out;
+    }
+}
+
+int main()
+{
+    for (int32_t id = 2; id <= 5; ++id)
+        receivers[id] = std::make_unique<Receiver>(id, id == 5);
+
+    const char *regions[] = {"", "a", "a", "b", "b", "c"};
+    std::vector<server> cluster;
+    cluster.push_back({"127.0.0.1", 0, 1, true, true, "", regions[1]});
+    for (auto &entry : receivers)
+        cluster.push_back({"127.0.0.1", entry.second->port, entry.first, true, false, "", regions[entry.first]});
+
+    my_id = 1;
+    servers = cluster;
+    LOCAL_SOCKETS = false;
+    REGION_RELAY = true;
+    WIRE_FORMAT = "flat";
+
+    FlakyTransport transport(makeTransport("epoll", 1));
+    setTransport(&transport);
+
+    ConnectionManager connections(cluster, 1);
+    setConnectionManager(&connections);
+    for (auto &entry : receivers)
+        entry.second->start();
+    connections.serve(&transport, [&connections](Connection &conn, const char *data, uint32_t len)
+                      {
+        connections.heard(conn.peer);
+        request::Request ping;
+        if (ping.ParseFromArray(data, int(len)) && ping.recipient() == request::Request::PING)
+            connections.formats(conn, ping.client_id());
+        return true; });
+
+    for (auto &entry : receivers)
+    {
+        if (!connections.waitFor(entry.first, Clock::now() + WAIT))
+        {
+            fprintf(stderr, "relay_failover: no connection to server %d\n", entry.first);
+            return 1;
+        }
+    }
+
+    LOGICAL_EPOCH = Clock::now();
+    LOGICAL_EPOCH_READY.store(true);
+    RegionRelay relay(cluster, 1);
+    setRegionRelay(&relay);
+
+    relayRound(relay, 0, "everything up", {3, 5});
+
+    transport.failNextBundle(3);
+    relayRound(relay, 2, "write to 3 fails", {5});
+
+    receivers[3]->stop();
+    if (!eventually([&connections]()
+                    { return !connections.isUp(3); }))
+    {
+        fprintf(stderr, "relay_failover: server 3 still up after it stopped\n");
+        return 1;
+    }
+    relayRound(relay, 4, "server 3 down", {4, 5});
+
+    transport.failNextBundle(4);
+    relayRound(relay, 6, "server 3 down, write to 4 fails", {4, 5});
+
+    // bundles from another region go on to server 2, which only takes them in
+    std::string passed = remoteBundle(7);
+    relay.fanOut(passed.data(), uint32_t(passed.size()));
+    bool fan_out = true;
+    if (!eventually([]()
+                    { return receivers[2]->count(5, 7) > 0; }) ||
+        receivers[2]->count(5, 7, &fan_out) != 1 || fan_out)
+    {
+        fprintf(stderr, "FAIL: server 2 did not take server 5's round 7 once, without FAN_OUT\n");
+        ++failures;
+    }
+
+    // a write to server 2 that fails drops that bundle, not the ones after it
+    transport.failNextBundle(2);
+    std::string lost = remoteBundle(9);
+    relay.fanOut(lost.data(), uint32_t(lost.size()));
+    std::this_thread::sleep_for(SETTLE);
+    std::string next = remoteBundle(11);
+    relay.fanOut(next.data(), uint32_t(next.size()));
+    if (!eventually([]()
+                    { return receivers[2]->count(5, 11) > 0; }))
+    {
+        fprintf(stderr, "FAIL: server 2 never took the bundle after the failed one\n");
+        ++failures;
+    }
+    std::this_thread::sleep_for(SETTLE);
+    if (receivers[2]->count(5, 9) != 0 || receivers[2]->count(5, 11) != 1)
+    {
+        fprintf(stderr, "FAIL: server 2 took the failed bundle %d times and the next one %d times\n",
+                receivers[2]->count(5, 9), receivers[2]->count(5, 11));
+        ++failures;
+    }
+
+    // the relay, the manager and the transport run on detached threads
+    for (auto &entry : receivers)
+    {
+        if (entry.second->unreadable())
+        {
+            fprintf(stderr, "FAIL: server %d took %d flat sequences, which it does not read\n", entry.first,
+                    entry.second->unreadable());
+            ++failures;
+        }
+    }
+    if (receivers[5]->flat() == 0)
+    {
+        fprintf(stderr, "FAIL: server 5 reads flat but took every sequence as protobuf\n");
+        ++failures;
+    }
+
+    if (failures)
+    {
+        printf("relay_failover: %d failures\n", failures);
+        fflush(stdout);
+        _exit(1);
+    }
+    printf("relay_failover: ok\n");
+    fflush(stdout);
+    _exit(0);
+}